@@ -0,0 +1,907 @@
+/*
+ * Benchmarks for the virtual screen pipeline.
+ *
+ * Each workload is a canned stream of program output, fed to a virtual
+ * screen in pty-sized chunks the way the main loop does it: the chunk
+ * is parsed with vscreen_write(), then vscreen_sync() and vscreen_frame()
+ * draw one frame.  Curses runs headless, with its output (and that of
+ * the other renderers) going into a pipe that is emptied after every
+ * frame, so the cost of producing the terminal output is measured
+ * without any terminal to consume it.  Each workload is run with each
+ * renderer, unless one is chosen with -r.
+ *
+ * The "sessions" benchmark churns through SESSION_CHURN real sessions
+ * (each with its pty and a process), keeping up to SESSION_LIVE of them
+ * at a time and killing them in random order, and reports the cost of
+ * creating, looking up and killing a session as the registry fills and
+ * its slots are reused.  The "exits" benchmark does the same with
+ * sessions whose leaders exit by themselves, which are torn down when
+ * they are reaped, and reports the memory and file descriptors in use
+ * after each round, which should stay the same.
+ *
+ * The "parallel" benchmark runs the log workload through real ptys, in
+ * 1, 2, 4 and then 8 sessions at once, each running cat on a file of
+ * it, with the main loop (and its worker pool, sized with -j) draining
+ * them, and reports the total throughput.  The sessions are timed until
+ * they have all been reaped, so output still in a pty when its cat
+ * exits (at most the size of the pty buffer) is counted but not parsed.
+ *
+ * The "logging" benchmark runs the log workload in PARALLEL_MAX
+ * sessions at once, as in the parallel benchmark, first with no
+ * logging, then logging the raw output and then the text of each to a
+ * file, then piping the raw output of each to a command that reads it,
+ * and to one that never does, and reports the throughput of each.
+ *
+ * The "resize" benchmark fills RESIZE_SCREENS virtual screens with the
+ * log workload, so that each has a deep history, and then drags the
+ * width of the terminal down and halfway back up a column at a time, as
+ * a window edge is dragged.  Only the screen shown is resized at each
+ * step; the others are resized the first time they are shown after
+ * the drag, and the history of each is rewrapped the first time it is
+ * scrolled back.  It reports the cost of each of the three.
+ *
+ * The "search" benchmark fills SEARCH_SCREENS virtual screens with
+ * SEARCH_HISTORY lines each of the log workload, with an error message
+ * among the oldest lines of one of them, and searches them all for it:
+ * first with no index built, then again, then for text that is nowhere,
+ * and then for the message again after SEARCH_MORE more lines have gone
+ * into each, so that the index is brought up to date.  It reports the
+ * time taken by each search.
+ *
+ * The "snapshot" benchmark fills a virtual screen with SNAPSHOT_HISTORY
+ * lines of the log workload, and then 10 and 100 times as many, first
+ * with its rows on the heap and then kept in a snapshot file, and
+ * reports the throughput of each.  It then restores a screen from the
+ * snapshot, as if ecran had been killed and run again, and reports the
+ * time taken to restore it and draw it, which should not grow with
+ * the history.
+ *
+ * The "panes" benchmark runs the log workload in 1, 2 and then 4
+ * sessions at once, as in the parallel benchmark, but with each shown
+ * in a pane of its own and drawn by the ANSI renderer, and reports the
+ * throughput, the processor time taken (by all threads) per byte, and
+ * the number of spans of lines drawn per KiB.
+ *
+ * Usage: ecran_bench [-s size_kb] [-r renderer] [-j threads] [workload ...]
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <ncurses.h>
+#include "ecran.h"
+#include "session.h"
+#include "layout.h"
+#include "vscreen.h"
+#include "render.h"
+#include "server.h"
+#include "pool.h"
+#include "log.h"
+#include "search.h"
+#include "snapshot.h"
+
+#define BENCH_LINES 50
+#define BENCH_COLS 160
+#define BENCH_CHUNK 4096          // Bytes returned by a typical pty read.
+#define BENCH_SIZE (4 * 1024)     // Default size of each workload, in KiB.
+#define SESSION_CHURN 5000        // Sessions created by the sessions benchmark,
+#define SESSION_LIVE 1000         //   at most this many at a time,
+#define SESSION_ROUND 500         //   reported every this many.
+#define PARALLEL_MAX 8            // Most sessions run by the parallel benchmark.
+#define PANES_MAX 4               // Most panes shown by the panes benchmark.
+#define RESIZE_SCREENS 32         // Screens filled by the resize benchmark.
+#define RESIZE_MIN_COLS 80        // Narrowest width it drags to.
+#define SEARCH_SCREENS 10         // Screens searched by the search benchmark,
+#define SEARCH_HISTORY 200000     //   with this many lines of history each,
+#define SEARCH_MORE 10000         //   and this many more before the last.
+#define SNAPSHOT_HISTORY 1000     // Fewest lines of history snapshotted.
+
+struct workload {
+    char *name;
+    char *description;
+    size_t (*generate)(char *buf, size_t size);
+};
+
+static size_t gen_log(char *buf, size_t size);
+static size_t gen_yes(char *buf, size_t size);
+static size_t gen_progress(char *buf, size_t size);
+static size_t gen_tui(char *buf, size_t size);
+
+static struct workload workloads[] = {
+    { "log", "plain log flood", gen_log },
+    { "yes", "output of yes", gen_yes },
+    { "progress", "progress bar redrawn with CR", gen_progress },
+    { "tui", "full-screen redraws, as by top", gen_tui },
+};
+#define NUM_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+static int term_fd = -1;         // Read end of the pipe curses writes to.
+static size_t term_bytes;
+
+static void bench_init(void);
+static void run(struct workload *w, size_t size);
+static void run_sessions(void);
+static void run_exits(void);
+static void run_parallel(size_t size);
+static void run_panes(size_t size);
+static void run_logging(size_t size);
+static void run_resize(size_t size);
+static void run_search(void);
+static void run_snapshot(void);
+static char *log_file(size_t *size);
+static double cpu_time(void);
+static long resident_kb(void);
+static int open_fds(void);
+static void drain_terminal(void);
+static double now(void);
+
+int main(int argc, char *argv[]) {
+    size_t size = BENCH_SIZE * 1024L;
+    struct renderer *renderers[] = { &render_curses, &render_ansi, &render_null };
+    int num_renderers = 3;
+    int c;
+    while((c = getopt(argc, argv, "s:r:j:")) != -1) {
+	if(c == 's') {
+	    size = atol(optarg) * 1024L;
+	} else if(c == 'j') {
+	    pool_threads = atoi(optarg) < 0 ? 0 : atoi(optarg);
+	} else if(c == 'r' && (renderers[0] = render_find(optarg)) != NULL) {
+	    num_renderers = 1;
+	} else {
+	    fprintf(stderr, "Usage: %s [-s size_kb] [-r renderer] "
+		    "[-j threads] [workload ...]\n", argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
+
+    bench_init();
+    printf("%-10s %-8s %10s %10s %8s %14s %14s\n", "workload", "renderer",
+	   "MB/s", "ns/byte", "frames", "renders/frame", "bytes/frame");
+    for(int i = 0; i < NUM_WORKLOADS; i++) {
+	int selected = optind == argc;
+	for(int j = optind; j < argc; j++)
+	    if(strcmp(argv[j], workloads[i].name) == 0)
+		selected = 1;
+	if(!selected)
+	    continue;
+	for(int r = 0; r < num_renderers; r++) {
+	    renderer = renderers[r];
+	    renderer->init();
+	    run(&workloads[i], size);
+	    renderer->fini();
+	}
+    }
+    int selected = optind == argc, exits = optind == argc;
+    int parallel = optind == argc, resize = optind == argc;
+    int panes = optind == argc, logging = optind == argc;
+    int search = optind == argc, snapshot = optind == argc;
+    for(int j = optind; j < argc; j++) {
+	if(strcmp(argv[j], "sessions") == 0)
+	    selected = 1;
+	if(strcmp(argv[j], "exits") == 0)
+	    exits = 1;
+	if(strcmp(argv[j], "parallel") == 0)
+	    parallel = 1;
+	if(strcmp(argv[j], "panes") == 0)
+	    panes = 1;
+	if(strcmp(argv[j], "logging") == 0)
+	    logging = 1;
+	if(strcmp(argv[j], "resize") == 0)
+	    resize = 1;
+	if(strcmp(argv[j], "search") == 0)
+	    search = 1;
+	if(strcmp(argv[j], "snapshot") == 0)
+	    snapshot = 1;
+    }
+    if(selected || exits || parallel || panes || logging || resize) {
+	// There is no terminal to read keys from, as for a server.
+	server_mode = 1;
+	mainloop_init();
+	renderer = &render_null;
+	layout_init();
+    }
+    if(selected)
+	run_sessions();
+    if(exits)
+	run_exits();
+    if(parallel)
+	run_parallel(size);
+    if(panes)
+	run_panes(size);
+    if(logging)
+	run_logging(size);
+    if(resize)
+	run_resize(size);
+    if(search)
+	run_search();
+    if(snapshot)
+	run_snapshot();
+    endwin();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Set up curses on a terminal of BENCH_LINES by BENCH_COLS whose output
+ * goes into a pipe, and create the windows that the virtual screens
+ * are drawn in.
+ */
+static void bench_init(void) {
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) == -1) {
+	perror("pipe");
+	exit(EXIT_FAILURE);
+    }
+    // Room for the largest frame, so that curses never blocks.
+    fcntl(fds[1], F_SETPIPE_SZ, 1024 * 1024);
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    term_fd = fds[0];
+    render_fd = fds[1];
+
+    char lines[16], cols[16];
+    snprintf(lines, sizeof(lines), "%d", BENCH_LINES);
+    snprintf(cols, sizeof(cols), "%d", BENCH_COLS);
+    setenv("LINES", lines, 1);
+    setenv("COLUMNS", cols, 1);
+    FILE *out = fdopen(fds[1], "w");
+    FILE *in = fopen("/dev/null", "r");
+    if(newterm("xterm-256color", out, in) == NULL &&
+       newterm("xterm", out, in) == NULL) {
+	fprintf(stderr, "No terminal description for xterm\n");
+	exit(EXIT_FAILURE);
+    }
+    if(has_colors()) {
+	start_color();
+	use_default_colors();
+    }
+    main_screen = newwin(LINES - 1, COLS, 0, 0);
+    status_screen = newwin(1, COLS, LINES - 1, 0);
+    drain_terminal();
+}
+
+/*
+ * Run one workload on a fresh virtual screen and report on it.
+ */
+static void run(struct workload *w, size_t size) {
+    char *buf = malloc(size);
+    size = w->generate(buf, size);
+
+    VSCREEN *vscreen = vscreen_init();
+    vscreen_show(vscreen);
+    vscreen_frame();
+    drain_terminal();
+
+    unsigned long renders = vscreen_render_calls;
+    size_t bytes = term_bytes;
+    long frames = 0;
+    double start = now();
+    for(size_t i = 0; i < size; i += BENCH_CHUNK) {
+	size_t n = size - i < BENCH_CHUNK ? size - i : BENCH_CHUNK;
+	vscreen_write(vscreen, buf + i, n);
+	vscreen_sync(vscreen);
+	vscreen_frame();
+	drain_terminal();
+	frames++;
+    }
+    double elapsed = now() - start;
+
+    printf("%-10s %-8s %10.1f %10.2f %8ld %14.1f %14.0f\n", w->name,
+	   renderer->name, size / elapsed / 1e6, elapsed * 1e9 / size, frames,
+	   (double)(vscreen_render_calls - renders) / frames,
+	   (double)(term_bytes - bytes) / frames);
+    fflush(stdout);
+    vscreen_fini(vscreen);
+    free(buf);
+}
+
+/*
+ * Churn through sessions running cat, and report on each round of
+ * SESSION_ROUND of them.  Lookups are made by number, by pty and by
+ * process ID for every live session at the end of each round.
+ */
+static void run_sessions(void) {
+    char *argv[] = { "cat", NULL };
+    SESSION *live[SESSION_LIVE];
+    int num_live = 0;
+    unsigned seed = 1;
+
+    printf("\n%-10s %8s %8s %14s %14s %14s\n", "sessions", "created",
+	   "live", "create us/op", "kill us/op", "lookup ns/op");
+    for(int created = 0; created < SESSION_CHURN; ) {
+	double create = 0, destroy = 0;
+	int kills = 0;
+	for(int i = 0; i < SESSION_ROUND; i++, created++) {
+	    // Past the first half of the round, once full, kill as many
+	    // as are created, choosing which at random.
+	    while(num_live == SESSION_LIVE ||
+		  (num_live > 0 && created >= SESSION_LIVE && i % 2)) {
+		seed = seed * 1103515245 + 12345;
+		int victim = (seed >> 8) % num_live;
+		if(live[victim] == fg_session)
+		    fg_session = NULL;
+		double t = now();
+		session_kill(live[victim]);
+		session_sweep();
+		destroy += now() - t;
+		kills++;
+		live[victim] = live[--num_live];
+		if(i % 2)
+		    break;
+	    }
+	    double t = now();
+	    SESSION *session = session_init("/bin/cat", argv);
+	    create += now() - t;
+	    if(session == NULL) {
+		fprintf(stderr, "Cannot create session %d\n", created);
+		exit(EXIT_FAILURE);
+	    }
+	    live[num_live++] = session;
+	}
+	session_reap();
+	session_sweep();
+
+	long lookups = 0;
+	double t = now();
+	for(int rep = 0; rep < 10; rep++) {
+	    for(int i = 0; i < num_live; i++) {
+		if(session_get(live[i]->sid) != live[i] ||
+		   session_find_fd(live[i]->ptyfd) != live[i] ||
+		   session_find_pid(live[i]->pid) != live[i]) {
+		    fprintf(stderr, "Session registry lookup failed\n");
+		    exit(EXIT_FAILURE);
+		}
+		lookups += 3;
+	    }
+	}
+	double lookup = now() - t;
+	printf("%-10s %8d %8d %14.1f %14.1f %14.1f\n", "", created, num_live,
+	       create * 1e6 / SESSION_ROUND, kills ? destroy * 1e6 / kills : 0,
+	       lookups ? lookup * 1e9 / lookups : 0);
+	fflush(stdout);
+    }
+    fg_session = NULL;
+    while(num_live > 0)
+	session_kill(live[--num_live]);
+    session_reap();
+    session_sweep();
+}
+
+/*
+ * Churn through sessions running echo, which exit as soon as they have
+ * started, and report on each round of SESSION_ROUND of them.  The
+ * sessions are reaped as the main loop would on SIGCHLD, with one long
+ * lived session kept so that there is always one to bring to the
+ * foreground.
+ */
+static void run_exits(void) {
+    char *anchor[] = { "cat", NULL };
+    char *argv[] = { "echo", "session", "done", NULL };
+    SESSION *keep = session_init("/bin/cat", anchor);
+
+    printf("\n%-10s %8s %14s %10s %8s\n", "exits", "created",
+	   "session us/op", "rss KB", "fds");
+    for(int created = 0; created < SESSION_CHURN; ) {
+	double t = now();
+	for(int i = 0; i < SESSION_ROUND; i++, created++) {
+	    if(session_init("/bin/echo", argv) == NULL) {
+		fprintf(stderr, "Cannot create session %d\n", created);
+		exit(EXIT_FAILURE);
+	    }
+	    session_reap();
+	    session_sweep();
+	}
+	while(session_count > 1) {
+	    siginfo_t si;
+	    waitid(P_ALL, 0, &si, WEXITED | WNOWAIT);
+	    session_reap();
+	    session_sweep();
+	}
+	double elapsed = now() - t;
+	printf("%-10s %8d %14.1f %10ld %8d\n", "", created,
+	       elapsed * 1e6 / SESSION_ROUND, resident_kb(), open_fds());
+	fflush(stdout);
+    }
+    fg_session = NULL;
+    session_kill(keep);
+    session_reap();
+    session_sweep();
+}
+
+/*
+ * Run cat on a file of the log workload in more and more sessions at
+ * once, driving the main loop until they have all exited, and report
+ * the total throughput.  A long lived session is kept, as in
+ * run_exits(), and is where the loop is done.
+ */
+static void run_parallel(size_t size) {
+    char *path = log_file(&size);
+    char *anchor[] = { "cat", NULL };
+    char *argv[] = { "cat", path, NULL };
+    SESSION *keep = session_init("/bin/cat", anchor);
+
+    printf("\n%-10s %8s %8s %10s %10s\n", "parallel", "sessions", "threads",
+	   "MB/s", "ns/byte");
+    for(int k = 1; k <= PARALLEL_MAX; k *= 2) {
+	double t = now();
+	for(int i = 0; i < k; i++) {
+	    if(session_init("/bin/cat", argv) == NULL) {
+		fprintf(stderr, "Cannot create session %d\n", i);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	while(session_count > 1)
+	    mainloop_step(100);
+	double elapsed = now() - t;
+	printf("%-10s %8d %8d %10.1f %10.2f\n", "", k, pool_threads,
+	       k * size / elapsed / 1e6, elapsed * 1e9 / (k * size));
+	fflush(stdout);
+    }
+    unlink(path);
+    fg_session = NULL;
+    session_kill(keep);
+    session_reap();
+    session_sweep();
+}
+
+/*
+ * Run cat on a file of the log workload in 1, 2 and then PANES_MAX
+ * panes at once, splitting them stacked and side by side in turn, and
+ * driving the main loop until they have all exited.  The panes are
+ * closed as their sessions exit, which leaves the long lived session
+ * kept, as in run_parallel(), in the one pane left.
+ */
+static void run_panes(size_t size) {
+    char *path = log_file(&size);
+    char *anchor[] = { "cat", NULL };
+    char *argv[] = { "cat", path, NULL };
+    SESSION *keep = session_init("/bin/cat", anchor);
+    renderer = &render_ansi;
+    renderer->init();
+
+    printf("\n%-10s %8s %10s %14s %14s\n", "panes", "panes", "MB/s",
+	   "cpu ns/byte", "renders/KB");
+    for(int k = 1; k <= PANES_MAX; k *= 2) {
+	unsigned long renders = vscreen_render_calls;
+	double t = now(), cpu = cpu_time();
+	for(int i = 0; i < k; i++) {
+	    if(i > 0 && layout_split(i % 2 == 0) == -1) {
+		fprintf(stderr, "Cannot split pane %d\n", i);
+		exit(EXIT_FAILURE);
+	    }
+	    if(session_init("/bin/cat", argv) == NULL) {
+		fprintf(stderr, "Cannot create session %d\n", i);
+		exit(EXIT_FAILURE);
+	    }
+	}
+	while(session_count > 1) {
+	    mainloop_step(100);
+	    drain_terminal();
+	}
+	double elapsed = now() - t;
+	cpu = cpu_time() - cpu;
+	printf("%-10s %8d %10.1f %14.2f %14.1f\n", "", k,
+	       k * size / elapsed / 1e6, cpu * 1e9 / (k * size),
+	       (vscreen_render_calls - renders) * 1024.0 / (k * size));
+	fflush(stdout);
+    }
+    renderer->fini();
+    renderer = &render_null;
+    unlink(path);
+    fg_session = NULL;
+    session_kill(keep);
+    session_reap();
+    session_sweep();
+}
+
+/*
+ * Run cat on a file of the log workload in PARALLEL_MAX sessions at
+ * once, logging their output in each of the ways listed below, and
+ * report the throughput, and the size of the log files written.  The
+ * log files are removed afterwards.
+ */
+static void run_logging(size_t size) {
+    static struct {
+	char *name, *path, *command;
+	int text;
+    } modes[] = {
+	{ "none", NULL, NULL, 0 },
+	{ "raw", "/tmp/ecran_bench_log.%d", NULL, 0 },
+	{ "text", "/tmp/ecran_bench_log.%d", NULL, 1 },
+	{ "pipe", NULL, "cat >/dev/null", 0 },
+	{ "stuck", NULL, "exec sleep 5", 0 },
+    };
+    char *path = log_file(&size);
+    char *anchor[] = { "cat", NULL };
+    char *argv[] = { "cat", path, NULL };
+    SESSION *keep = session_init("/bin/cat", anchor);
+
+    printf("\n%-10s %8s %8s %10s %10s %10s\n", "logging", "mode",
+	   "sessions", "MB/s", "ns/byte", "logged MB");
+    for(int m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+	log_path = modes[m].path;
+	log_command = modes[m].command;
+	log_text = modes[m].text;
+	int sids[PARALLEL_MAX];
+	double t = now();
+	for(int i = 0; i < PARALLEL_MAX; i++) {
+	    SESSION *session = session_init("/bin/cat", argv);
+	    if(session == NULL) {
+		fprintf(stderr, "Cannot create session %d\n", i);
+		exit(EXIT_FAILURE);
+	    }
+	    sids[i] = session->sid;
+	}
+	while(session_count > 1)
+	    mainloop_step(100);
+	double elapsed = now() - t;
+
+	// The sessions are freed, closing their logs, at the end of the
+	// pass in which they exit; the writer takes a moment to finish.
+	double logged = 0;
+	usleep(100000);
+	for(int i = 0; log_path != NULL && i < PARALLEL_MAX; i++) {
+	    char name[64];
+	    struct stat st;
+	    snprintf(name, sizeof(name), "/tmp/ecran_bench_log.%d", sids[i]);
+	    if(stat(name, &st) == 0)
+		logged += st.st_size;
+	    unlink(name);
+	}
+	printf("%-10s %8s %8d %10.1f %10.2f %10.1f\n", "", modes[m].name,
+	       PARALLEL_MAX, PARALLEL_MAX * size / elapsed / 1e6,
+	       elapsed * 1e9 / (PARALLEL_MAX * size), logged / 1e6);
+	fflush(stdout);
+    }
+    log_path = log_command = NULL;
+    log_text = 0;
+    unlink(path);
+    fg_session = NULL;
+    session_kill(keep);
+    session_reap();
+    session_sweep();
+}
+
+/*
+ * Fill RESIZE_SCREENS screens with the log workload, drag the width of
+ * the one shown from BENCH_COLS to RESIZE_MIN_COLS and halfway back,
+ * drawing a frame at each step, and report the cost of a step, then of
+ * showing each of the others at the final size, then of scrolling each
+ * back through its whole history.
+ */
+static void run_resize(size_t size) {
+    char *buf = malloc(size);
+    size = gen_log(buf, size);
+    VSCREEN *screens[RESIZE_SCREENS];
+    for(int i = 0; i < RESIZE_SCREENS; i++) {
+	screens[i] = vscreen_init();
+	vscreen_write(screens[i], buf, size);
+    }
+    free(buf);
+    int lines = BENCH_LINES - 1, cols = (BENCH_COLS + RESIZE_MIN_COLS) / 2;
+    vscreen_show(screens[0]);
+
+    printf("\n%-10s %8s %8s %14s %14s %14s\n", "resize", "screens",
+	   "steps", "drag us/step", "show us/op", "scroll us/op");
+    int steps = 0;
+    double t = now();
+    for(int c = BENCH_COLS - 1; c >= RESIZE_MIN_COLS; c--, steps++) {
+	vscreen_resize(screens[0], lines, c);
+	vscreen_sync(screens[0]);
+	vscreen_frame();
+    }
+    for(int c = RESIZE_MIN_COLS + 1; c <= cols; c++, steps++) {
+	vscreen_resize(screens[0], lines, c);
+	vscreen_sync(screens[0]);
+	vscreen_frame();
+    }
+    double drag = now() - t;
+
+    t = now();
+    for(int i = 1; i < RESIZE_SCREENS; i++) {
+	vscreen_resize(screens[i], lines, cols);
+	vscreen_show(screens[i]);
+	vscreen_sync(screens[i]);
+	vscreen_frame();
+    }
+    double show = now() - t;
+
+    t = now();
+    for(int i = 0; i < RESIZE_SCREENS; i++) {
+	vscreen_show(screens[i]);
+	vscreen_scroll(screens[i], vscreen_history_lines);
+	vscreen_sync(screens[i]);
+	vscreen_frame();
+    }
+    double scroll = now() - t;
+
+    printf("%-10s %8d %8d %14.1f %14.1f %14.1f\n", "", RESIZE_SCREENS,
+	   steps, drag * 1e6 / steps, show * 1e6 / (RESIZE_SCREENS - 1),
+	   scroll * 1e6 / RESIZE_SCREENS);
+    fflush(stdout);
+    for(int i = 0; i < RESIZE_SCREENS; i++)
+	vscreen_fini(screens[i]);
+}
+
+/*
+ * Fill SEARCH_SCREENS screens with SEARCH_HISTORY lines of the log
+ * workload each, one with an error message a quarter of the way in, and
+ * report the time taken to search them all for it, with the index to be
+ * built and with it built, for text not there, and for the message once
+ * more output has gone into every screen.
+ */
+static void run_search(void) {
+    static const char error[] = "ERROR disk quota exceeded on /var/spool";
+    int history_lines = vscreen_history_lines;
+    long history_bytes = vscreen_history_bytes;
+    vscreen_history_lines = SEARCH_HISTORY;
+    vscreen_history_bytes = (long)SEARCH_HISTORY * BENCH_COLS * sizeof(CELL);
+    size_t size = (size_t)(SEARCH_HISTORY + SEARCH_MORE) * 80;
+    char *buf = malloc(size);
+    size = gen_log(buf, size);
+    size_t quarter = size / 4, more = size / (SEARCH_HISTORY / SEARCH_MORE);
+    while(buf[quarter - 1] != '\n')
+	quarter++;
+    while(buf[more - 1] != '\n')
+	more++;
+
+    VSCREEN *screens[SEARCH_SCREENS];
+    long lines[SEARCH_SCREENS];
+    for(int i = 0; i < SEARCH_SCREENS; i++) {
+	screens[i] = vscreen_init();
+	vscreen_write(screens[i], buf, quarter);
+	if(i == SEARCH_SCREENS / 2)
+	    vscreen_write(screens[i], error, sizeof(error) - 1);
+	vscreen_write(screens[i], buf + quarter, size - quarter);
+    }
+
+    printf("\n%-10s %8s %8s %10s %10s %10s %10s\n", "search", "screens",
+	   "lines", "cold ms", "warm ms", "miss ms", "update ms");
+    double ms[4];
+    const char *text[4] = { error, error, "segmentation fault", error };
+    int found = 0;
+    for(int k = 0; k < 4; k++) {
+	if(k == 3)
+	    for(int i = 0; i < SEARCH_SCREENS; i++)
+		vscreen_write(screens[i], buf, more);
+	for(int i = 0; i < SEARCH_SCREENS; i++)
+	    lines[i] = LONG_MAX;
+	double t = now();
+	search_screens(screens, lines, SEARCH_SCREENS, text[k]);
+	ms[k] = (now() - t) * 1e3;
+	found += lines[SEARCH_SCREENS / 2] >= 0;
+    }
+    printf("%-10s %8d %8d %10.1f %10.1f %10.1f %10.1f%s\n", "",
+	   SEARCH_SCREENS, SEARCH_HISTORY, ms[0], ms[1], ms[2], ms[3],
+	   found == 3 ? "" : "  (not found)");
+    fflush(stdout);
+    for(int i = 0; i < SEARCH_SCREENS; i++)
+	vscreen_fini(screens[i]);
+    free(buf);
+    vscreen_history_lines = history_lines;
+    vscreen_history_bytes = history_bytes;
+}
+
+/*
+ * Fill a screen with SNAPSHOT_HISTORY, then 10 and 100 times as many,
+ * lines of the log workload, on the heap and then in a snapshot file in
+ * a directory of its own, and report the throughput of each, and the
+ * time taken to restore a screen from the snapshot and draw it.  This
+ * comes last, as the attribute table stays mapped from then on.
+ */
+static void run_snapshot(void) {
+    int history_lines = vscreen_history_lines;
+    long history_bytes = vscreen_history_bytes;
+    char dir[] = "/tmp/ecran_snapshot.XXXXXX";
+    if(mkdtemp(dir) == NULL) {
+	perror(dir);
+	exit(EXIT_FAILURE);
+    }
+    snapshot_dir = dir;
+    char *attrs = snapshot_path(-1), *path = snapshot_path(0);
+    char *restored = snapshot_path(1);
+    vscreen_map_attrs(attrs);
+
+    printf("\n%-10s %8s %10s %12s %12s %12s\n", "snapshot", "lines",
+	   "MB", "heap MB/s", "mapped MB/s", "restore us");
+    for(int history = SNAPSHOT_HISTORY; history <= SNAPSHOT_HISTORY * 100;
+	history *= 10) {
+	vscreen_history_lines = history;
+	vscreen_history_bytes = (long)history * BENCH_COLS * sizeof(CELL);
+	size_t size = (size_t)history * 80;
+	char *buf = malloc(size);
+	size = gen_log(buf, size);
+
+	double rate[2];
+	VSCREEN *screens[2];
+	for(int mapped = 0; mapped < 2; mapped++) {
+	    screens[mapped] = vscreen_init();
+	    if(mapped)
+		vscreen_map(screens[mapped], path, NULL);
+	    double t = now();
+	    for(size_t done = 0; done < size; done += BENCH_CHUNK)
+		vscreen_write(screens[mapped], buf + done,
+			      size - done < BENCH_CHUNK ? size - done
+						       : BENCH_CHUNK);
+	    rate[mapped] = size / (now() - t) / 1e6;
+	}
+
+	// The screen in the file is left as it is, as if ecran were killed.
+	double t = now();
+	VSCREEN *vscreen = vscreen_init();
+	int kept = vscreen_map(vscreen, restored, path);
+	vscreen_show(vscreen);
+	vscreen_sync(vscreen);
+	vscreen_frame();
+	double restore = now() - t;
+	drain_terminal();
+
+	printf("%-10s %8d %10.1f %12.1f %12.1f %12.1f%s\n", "", history,
+	       size / 1e6, rate[0], rate[1], restore * 1e6,
+	       kept == 1 ? "" : "  (not restored)");
+	fflush(stdout);
+	vscreen_fini(vscreen);
+	vscreen_fini(screens[0]);
+	vscreen_fini(screens[1]);
+	free(buf);
+    }
+    unlink(attrs);
+    rmdir(dir);
+    free(attrs);
+    free(path);
+    free(restored);
+    snapshot_dir = NULL;
+    vscreen_history_lines = history_lines;
+    vscreen_history_bytes = history_bytes;
+}
+
+/*
+ * Write a file of the log workload, for sessions to run cat on, of up
+ * to *size bytes; *size is set to the size written.  Returns its path.
+ */
+static char *log_file(size_t *size) {
+    static char path[32];
+    strcpy(path, "/tmp/ecran_bench.XXXXXX");
+    int fd = mkstemp(path);
+    char *buf = malloc(*size);
+    *size = gen_log(buf, *size);
+    if(fd == -1 || write(fd, buf, *size) != (ssize_t)*size) {
+	perror(path);
+	exit(EXIT_FAILURE);
+    }
+    close(fd);
+    free(buf);
+    return path;
+}
+
+/*
+ * Return the processor time used by the benchmark so far, by all of
+ * its threads, in seconds.
+ */
+static double cpu_time(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+	   ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+/*
+ * Return the resident set size of the benchmark, in KiB.
+ */
+static long resident_kb(void) {
+    long size, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if(f != NULL) {
+	if(fscanf(f, "%ld %ld", &size, &resident) != 2)
+	    resident = 0;
+	fclose(f);
+    }
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/*
+ * Return the number of file descriptors the benchmark has open.
+ */
+static int open_fds(void) {
+    int n = 0;
+    DIR *dir = opendir("/proc/self/fd");
+    if(dir == NULL)
+	return 0;
+    while(readdir(dir) != NULL)
+	n++;
+    closedir(dir);
+    return n - 3;    // Not counting ".", ".." and the directory itself.
+}
+
+/*
+ * Discard whatever has been written to the terminal, counting it.
+ */
+static void drain_terminal(void) {
+    char buf[65536];
+    ssize_t n;
+    while((n = read(term_fd, buf, sizeof(buf))) > 0)
+	term_bytes += n;
+}
+
+static double now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/*
+ * The workloads.  Each fills a buffer with up to size bytes of output
+ * (as it would arrive from a pty, with CR LF line endings), and returns
+ * the number of bytes generated.  The output is the same on every run.
+ */
+
+static size_t gen_log(char *buf, size_t size) {
+    static const char *levels[] = { "INFO", "INFO", "INFO", "WARN", "DEBUG" };
+    size_t n = 0;
+    unsigned seed = 1;
+    for(int i = 0; n + 128 < size; i++) {
+	seed = seed * 1103515245 + 12345;
+	n += sprintf(buf + n, "2026-10-17 12:%02d:%02d %s worker[%u] processed "
+		     "request id=%08x in %ums\r\n", i / 60 % 60, i % 60,
+		     levels[seed >> 16 & 3], seed >> 8 & 63, seed,
+		     seed >> 20 & 1023);
+    }
+    return n;
+}
+
+static size_t gen_yes(char *buf, size_t size) {
+    size_t n = 0;
+    while(n + 3 <= size) {
+	memcpy(buf + n, "y\r\n", 3);
+	n += 3;
+    }
+    return n;
+}
+
+static size_t gen_progress(char *buf, size_t size) {
+    size_t n = 0;
+    for(int file = 0; n + 256 < size; file++) {
+	for(int pct = 0; pct <= 100 && n + 256 < size; pct++) {
+	    char bar[41];
+	    memset(bar, '#', pct * 40 / 100);
+	    memset(bar + pct * 40 / 100, '.', 40 - pct * 40 / 100);
+	    bar[40] = '\0';
+	    n += sprintf(buf + n, "\rfile%04d.tar.gz [%s] %3d%% %5.1f MB/s",
+			 file, bar, pct, 10 + (file * 7 + pct) % 90 / 10.0);
+	}
+	n += sprintf(buf + n, "\r\n");
+    }
+    return n;
+}
+
+static size_t gen_tui(char *buf, size_t size) {
+    size_t n = 0;
+    for(int frame = 0; n + 16384 < size; frame++) {
+	// Home, a header in reverse video, then one row per process,
+	// each followed by an erase to the end of the line.
+	n += sprintf(buf + n, "\033[H\033[7mtop - 12:%02d:%02d up 3 days, "
+		     "load average: %d.%02d\033[K\033[m\r\n", frame / 60 % 60,
+		     frame % 60, frame % 4, frame * 7 % 100);
+	n += sprintf(buf + n, "\033[1m%7s %-8s %5s %5s %9s  %s\033[m\033[K\r\n",
+		     "PID", "USER", "%CPU", "%MEM", "TIME+", "COMMAND");
+	for(int row = 0; row < BENCH_LINES - 4; row++) {
+	    int cpu = (row * 37 + frame * (row + 3)) % 1000;
+	    n += sprintf(buf + n, "%7d %-8s \033[%dm%3d.%d\033[m %5.1f "
+			 "%6d:%02d  %s\033[K\r\n", 1000 + row * 17,
+			 row % 3 ? "root" : "www-data",
+			 cpu > 800 ? 31 : 32, cpu / 10, cpu % 10,
+			 (row * 13 % 100) / 10.0, (frame + row) / 60,
+			 (frame + row) % 60, row % 2 ? "worker" : "ecran");
+	}
+	n += sprintf(buf + n, "\033[J");
+    }
+    return n;
+}
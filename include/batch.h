@@ -0,0 +1,23 @@
+#ifndef BATCH_H
+#define BATCH_H
+
+/*
+ * Batch mode: running a command in a session with no terminal, and
+ * printing its screen (see batch.c).
+ */
+
+/*
+ * Size of the screen given to the command by default, and the exit
+ * status when it is killed for running too long, as with timeout(1).
+ */
+#define BATCH_LINES 24
+#define BATCH_COLS 80
+#define BATCH_TIMED_OUT 124
+
+extern int batch_lines, batch_cols;
+extern long batch_every, batch_timeout;
+extern int batch_json;
+
+int batch(char *argv[]);
+
+#endif
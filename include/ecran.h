@@ -11,7 +11,30 @@
 #define COMMAND_ESCAPE 0x1   // CTRL-A
 
 
+extern int err;    // Errors are going to a file given with -o.
+
+/*
+ * What is shown in place of the panes, when helpmode is nonzero: the
+ * help screen, or the stats screen.  Both are shown in helpvscreen.
+ */
+#define HELP_SCREEN 1
+#define STATS_SCREEN 2
+
+void initialize(void);
+void initialize_screen(void);
+void finalize(void);
+void mainloop_init(void);
+void mainloop_watch(SESSION *session);
+void mainloop_unwatch(SESSION *session);
+void mainloop_output(SESSION *session);
+void mainloop_listen(int fd);
+void mainloop_detach(void);
 int mainloop(void);
-void do_command(void);
+void mainloop_step(int timeout);
+int do_command(int in);
+void help_leave(void);
+void help_tick(void);
 void do_other_processing(void);
-void set_status(char *status);
\ No newline at end of file
+void set_status(char *status);
+void resize_screen(int lines, int cols);
+void fg(SESSION *session);
\ No newline at end of file
@@ -0,0 +1,35 @@
+#ifndef LAYOUT_H
+#define LAYOUT_H
+
+/*
+ * The layout of the physical screen above the status line: a tree of
+ * panes, each showing a session of its own.
+ */
+
+#include "session.h"
+
+typedef struct pane PANE;
+struct pane {
+    PANE *parent;         // The pane split to make this one, or NULL.
+    PANE *first, *second; // The halves of a pane that has been split,
+    int beside;           //   side by side rather than stacked.
+    int line, col;        // Where the pane is on the physical screen,
+    int lines, cols;      //   and its size (none if it does not fit).
+    SESSION *session;     // Session shown in a pane not split, or NULL.
+};
+
+extern PANE *layout_focus;
+
+void layout_init(void);
+void layout_fini(void);
+void layout_show(SESSION *session);
+int layout_split(int beside);
+int layout_close(void);
+void layout_next(void);
+void layout_release(SESSION *session);
+SESSION *layout_hidden(SESSION *except);
+void layout_resize(void);
+void layout_draw(void);
+void layout_sync(void);
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef LOG_H
+#define LOG_H
+
+/*
+ * Logging of the output of sessions to files, or to commands, by a
+ * writer thread in the background.
+ */
+
+#include <stddef.h>
+
+typedef struct log LOG;
+
+/*
+ * Size of the front buffer of each log, into which output is copied to
+ * wait for the writer.  When it is full, the oldest output in it is
+ * dropped.
+ */
+#define LOG_BUFFER (256 * 1024)
+
+/*
+ * Output in a log waits up to LOG_DELAY milliseconds to be written, so
+ * that output arriving a little at a time is written in batches, unless
+ * LOG_BATCH bytes of it pile up first.
+ */
+#define LOG_BATCH (64 * 1024)
+#define LOG_DELAY 100
+
+/*
+ * Number of rotated files kept of each log (as path.1 up to path.N),
+ * and how long the writer goes on trying to write to commands that
+ * are not reading their logs, when the program exits, in milliseconds.
+ */
+#define LOG_KEEP 5
+#define LOG_LINGER 1000
+
+/*
+ * Recordings (see log_record()) start with RECORD_MAGIC and a byte
+ * giving RECORD_VERSION, then the time the recording was started, in
+ * microseconds since the epoch, as a varint (seven bits to a byte,
+ * lowest first, the top bit set on all but the last).  Records follow,
+ * each a varint of the microseconds since the one before, and a varint
+ * n << 2 | kind, where n is the number of bytes that follow: output;
+ * or a resize, the lines and columns of the screen as two varints; or,
+ * with nothing following, a gap where n bytes of output were dropped,
+ * as the writer fell behind.  No record is of kind 3, so that another
+ * recording can follow in the same file, when a session number is used
+ * again: the 'C' of RECORD_MAGIC would be one.
+ */
+#define RECORD_MAGIC "ECRANREC"
+#define RECORD_VERSION 1
+#define RECORD_OUTPUT 0
+#define RECORD_RESIZE 1
+#define RECORD_GAP 2
+#define RECORD_VARINT 10          // Longest varint, in bytes.
+
+extern char *log_path;
+extern char *log_command;
+extern long log_rotate;
+extern int log_text;
+extern char *log_record_path;
+
+LOG *log_open(int sid);
+LOG *log_record(int sid, int lines, int cols);
+void log_write(LOG *log, const char *buf, size_t n);
+void log_resize(LOG *log, int lines, int cols);
+void log_close(LOG *log);
+void log_tick(void);
+void log_fini(void);
+
+#endif
@@ -0,0 +1,22 @@
+#ifndef POOL_H
+#define POOL_H
+
+/*
+ * A pool of worker threads that drain session ptys and parse their
+ * output, leaving the main thread to handle input and draw.
+ */
+
+#include "session.h"
+
+/*
+ * Largest number of worker threads started when none is asked for.
+ */
+#define POOL_THREADS 8
+
+extern int pool_threads;
+
+int pool_init(void);
+void pool_post(SESSION *session);
+SESSION *pool_collect(void);
+
+#endif
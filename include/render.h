@@ -0,0 +1,55 @@
+#ifndef RENDER_H
+#define RENDER_H
+
+/*
+ * Renderers, which draw on the physical terminal.
+ *
+ * Virtual screens and the status line are drawn by calling through the
+ * renderer in use, in terminal coordinates: the panes showing virtual
+ * screens occupy lines 0 to LINES-2 and the status line is line LINES-1.  Drawing is
+ * staged, and only sent to the terminal when frame() is called.
+ */
+
+#include "vscreen.h"
+
+struct renderer {
+    char *name;
+    void (*init)(void);
+    void (*fini)(void);
+    // Blank a rectangle of the terminal.
+    void (*blank)(int line, int col, int lines, int cols);
+    // Draw n cells starting at line, col, then blank the rest of the
+    // line up to (but not including) column clear_to.
+    void (*put)(int line, int col, const CELL *cells, int n, int clear_to);
+    // Place the cursor, as it is to be left at the end of the frame.
+    void (*cursor)(int line, int col);
+    // Ring the bell, with the next frame.
+    void (*bell)(void);
+    // Send everything staged to the terminal.  Returns 1 if anything
+    // was sent, 0 if there was nothing to send, or -1 if nothing could
+    // be, because the terminal is not taking its output.
+    int (*frame)(void);
+    // Number of bytes of output not yet written, because the terminal
+    // has not been taking them.  Nothing more is drawn until it has.
+    int (*pending)(void);
+    // Forget what is on the terminal, so that the next frame draws
+    // all of it.
+    void (*invalidate)(void);
+    // The terminal has been resized to LINES by COLS.  Everything is
+    // drawn again, and the next frame sends all of it.
+    void (*resize)(void);
+};
+
+extern struct renderer *renderer;
+extern struct renderer render_curses;
+extern struct renderer render_ansi;
+extern struct renderer render_null;
+extern int render_fd;
+extern int render_unicode;
+
+struct renderer *render_find(char *name);
+void render_locale(void);
+uint32_t render_char(const CELL *cells, int i, int n);
+void render_text(int line, int col, char *text, int clear_to);
+
+#endif
@@ -0,0 +1,20 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+/*
+ * Playing back recordings of the output of sessions (see log.c).
+ */
+
+/*
+ * Longest a frame is put off while output is played back without
+ * waiting, in milliseconds, and how often the status line shows how
+ * far the playback has got.
+ */
+#define REPLAY_FRAME 16
+#define REPLAY_STATUS 1000
+
+extern double replay_speed;
+
+int replay(char *path);
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef SCAN_H
+#define SCAN_H
+
+/*
+ * Vectorized scanning primitives used on the output path, and in
+ * searching the scrollback.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+
+size_t scan_printable(const char *buf, size_t len);
+void scan_widen(uint32_t *dst, const char *src, size_t len, uint32_t bits);
+size_t scan_find(const uint32_t *cells, size_t n, uint32_t value,
+		 uint32_t mask);
+
+#endif
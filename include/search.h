@@ -0,0 +1,18 @@
+#ifndef SEARCH_H
+#define SEARCH_H
+
+/*
+ * Searching the scrollback of all of the sessions at once.
+ */
+
+#include "session.h"
+
+/*
+ * Longest text that can be searched for.
+ */
+#define SEARCH_MAX 80
+
+void search_screens(VSCREEN **screens, long *lines, int n, const char *text);
+SESSION *search_next(const char *text, SESSION *from, long *line);
+
+#endif
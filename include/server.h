@@ -0,0 +1,26 @@
+#ifndef SERVER_H
+#define SERVER_H
+
+/*
+ * Running the sessions in a server process, to which clients attach
+ * and from which they detach over a Unix domain socket.
+ */
+
+/*
+ * What a client sends to the server is a series of packets, each a type
+ * byte and a length byte followed by that many bytes: keys typed on the
+ * client's terminal, or the size of the terminal, sent on attaching and
+ * whenever it is resized (lines, then columns, in two bytes each with
+ * the high byte first).  Packets of other types are skipped.
+ */
+#define PACKET_KEYS 0
+#define PACKET_SIZE 1
+#define PACKET_MAX 255
+
+extern int server_mode;
+
+char *server_default_path(void);
+void server_fini(void);
+int client_main(char *path);
+
+#endif
@@ -6,6 +6,9 @@
  */
 
 #include "vscreen.h"
+#include "stats.h"
+
+struct pane;
 
 struct session {
     int sid;           // Index in session table.
@@ -13,24 +16,81 @@ struct session {
     int ptyfd;         // FD for master side of pty.
     int error;         // Whether a read error has occurred.
     VSCREEN *vscreen;  // Associated virtual screen.
+    char *rbuf;        // Buffer for output read from the pty.
+    char *wbuf;        // Ring of input waiting to be written to the pty,
+    unsigned whead;    //   from whead up to wtail (both free-running).
+    unsigned wtail;
+    int wwatch;        // Waiting for the pty to become writable.
+    int paused;        // Input refused until the queue drains.
+    struct session *next, *prev;  // List of all sessions.
+    struct session *pid_next;     // Chain of the pid hash table.
+    int busy;          // Being drained by a worker (see pool.c).
+    int dead;          // Torn down, to be deallocated (see session_sweep()).
+    int drained;       // What the worker's session_parse() returned.
+    unsigned events;   // The epoll events that had it drained.
+    struct session *pool_next;    // Queue of the worker pool.
+    struct pane *pane; // Pane it is shown in, if any (see layout.c).
+    LOG *log;          // Logs of its output, if any (see log.c),
+    LOG *record;       //   and the recording of it, if any.
+    unsigned long output;  // Bytes of output read from the pty so far,
+    unsigned long ticked;  //   as of the last tick of the clock,
+    unsigned long rate;    //   per second before that,
+    unsigned long seen;    //   and when last shown (see status.c).
+    struct counters counters;  // Performance counters (see stats.c).
 };
 typedef struct session SESSION;
 
-#define MAX_SESSIONS 10
-extern SESSION *sessions[];
+/*
+ * Initial sizes of the session table (indexed by sid), the table
+ * indexed by pty file descriptor, and the hash table of session
+ * leaders' process IDs.  Each is doubled as needed.
+ */
+#define SESSION_SLOTS 16
+
+/*
+ * Size of the per-session buffer used to read pty output, which is
+ * filled before it is parsed, and the maximum number of times
+ * session_drain() fills it in one call, so that a session producing
+ * output continuously cannot starve the others.
+ */
+#define SESSION_RBUF_SIZE (64 * 1024)
+#define SESSION_DRAIN_MAX 16
+
+/*
+ * Size of the per-session ring of input waiting for the program to
+ * read it (a power of two), and the default high-water mark at which
+ * further input to the session is refused until the program catches
+ * up.  Input is accepted again once the queue is down to half the
+ * high-water mark.
+ */
+#define SESSION_WBUF_SIZE (64 * 1024)
+#define SESSION_HIGHWATER (16 * 1024)
+extern int session_highwater;
 extern SESSION *fg_session;
+extern SESSION *session_list;
+extern int session_count;
 //extern int err;
-VSCREEN *helpvscreen;
+extern VSCREEN *helpvscreen;
 
 SESSION *session_init(char *path, char *argv[]);
+int session_restore(char *path, char *argv[]);
 void session_setfg(SESSION *session);
+void session_resize(SESSION *session);
 int session_read(SESSION *session, char *buf, int bufsize);
+int session_drain(SESSION *session);
+int session_parse(SESSION *session);
+void session_answer(SESSION *session);
+int session_idle(SESSION *session);
+void session_sweep(void);
 int session_putc(SESSION *session, char c);
+void session_flush(SESSION *session);
 void session_kill(SESSION *session);
 void session_fini(SESSION *session);
+SESSION *session_get(int sid);
+SESSION *session_find_fd(int fd);
+SESSION *session_find_pid(int pid);
 void exit_error();
-void sigchld_handler(int sig);
-void sigalrm_handler(int sig);
+void session_reap(void);
 void help_init();
 void help_fini();
 
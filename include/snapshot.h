@@ -0,0 +1,81 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Snapshots of virtual screens, kept in memory-mapped files so that they
+ * outlive the process (see snapshot.c).
+ */
+
+#include <stdint.h>
+
+/*
+ * What the file holds, and the version of its layout, which is bumped
+ * whenever anything in it changes meaning; a file of any other version
+ * is not used.
+ */
+#define SNAPSHOT_MAGIC "ECRANSNP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_SCREEN 1         // The rows and state of a screen.
+#define SNAPSHOT_ATTRS 2          // The attribute table of the screens.
+#define SNAPSHOT_CLUSTERS 3       // The cluster table of the screens.
+
+/*
+ * The state of a screen besides its rows, as last committed.  Every
+ * field is 32 bits (or 64), so that there is no padding.
+ */
+struct snapshot_state {
+    uint64_t scrolled;
+    int32_t lines, cols;
+    int32_t cur_line, cur_col;
+    int32_t head, history, max_history, reflow;
+    int32_t top, bottom;
+    int32_t wrap_pending, autowrap, origin, insert, graphics;
+    int32_t saved_line, saved_col;
+    uint32_t pen;
+    int32_t fg, bg, flags;
+    int32_t saved_fg, saved_bg, saved_flags;
+};
+
+/*
+ * The header at the start of a snapshot file.  The file holds rows of
+ * stride elements each, at offset data, and (unless info_size is 0)
+ * that many records of line info at offset info.  The state is written
+ * to the two slots in turn, each with a sequence number and checksum,
+ * so that one of them is whole whenever the process stops.
+ */
+struct snapshot_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t kind;
+    uint32_t header_size;
+    uint32_t elem_size;
+    uint32_t info_size;
+    uint32_t stride;
+    uint32_t rows;
+    uint32_t count;               // Entries of an attribute table in use.
+    uint64_t data;
+    uint64_t info;
+    uint64_t size;
+    struct snapshot_slot {
+	uint64_t seq;
+	struct snapshot_state state;
+	uint64_t check;
+    } slot[2];
+};
+
+extern char *snapshot_dir;
+
+char *snapshot_path(int sid);
+int snapshot_lock(void);
+int snapshot_list(int **sids);
+struct snapshot_header *snapshot_create(const char *path, int kind,
+					int elem_size, int stride, int rows,
+					int info_size);
+struct snapshot_header *snapshot_open(const char *path, int kind,
+				      int elem_size, int info_size);
+void snapshot_commit(struct snapshot_header *map,
+		     const struct snapshot_state *state);
+int snapshot_state(struct snapshot_header *map, struct snapshot_state *state);
+void snapshot_close(struct snapshot_header *map);
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef STATS_H
+#define STATS_H
+
+/*
+ * Performance counters, shown on the stats screen and dumped as JSON.
+ */
+
+#include "vscreen.h"
+
+struct session;
+
+/*
+ * Counters kept for each session.  Those of its output are updated by
+ * whichever thread parses the output (see pool.c), with atomic adds,
+ * and the rest by the event loop.
+ */
+struct counters {
+    unsigned long reads;       // read() calls that returned output.
+    unsigned long parse_ns;    // Time spent parsing the output.
+    unsigned long writes;      // Writes of input to the pty,
+    unsigned long written;     //   and the bytes written.
+    unsigned long render_ns;   // Time spent drawing the screen.
+};
+
+/*
+ * Number of buckets of the histogram of the latency from a key being
+ * forwarded to a session to its echo being drawn: bucket 0 counts those
+ * under 2^STATS_MIN_SHIFT microseconds, bucket i those under twice the
+ * bound of bucket i - 1, and the last bucket all the rest.
+ */
+#define STATS_BUCKETS 16
+#define STATS_MIN_SHIFT 6
+
+extern char *stats_path;
+
+unsigned long stats_clock(void);
+void stats_key(struct session *session);
+void stats_frame(int sent, unsigned long ns);
+void stats_forget(struct session *session);
+void stats_write(VSCREEN *vscreen);
+int stats_dump(void);
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef STATUS_H
+#define STATUS_H
+
+/*
+ * The status line, at the bottom of the terminal: what it shows, and
+ * drawing it once per frame when that has changed.
+ */
+
+/*
+ * Longest message kept for the status line, and the template it is
+ * shown with by default: the message, with the clock at the right.
+ */
+#define STATUS_MESSAGE 256
+#define STATUS_FORMAT "%m%=%c"
+
+extern char *status_format;
+
+void status_message(char *message);
+void status_tick(unsigned long seconds);
+void status_invalidate(void);
+void status_render(void);
+int status_size(char *s, unsigned long bytes);
+
+#endif
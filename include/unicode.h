@@ -0,0 +1,28 @@
+#ifndef UNICODE_H
+#define UNICODE_H
+
+/*
+ * Widths of characters on the terminal, and UTF-8 (see unicode.c).
+ */
+
+#include <stdint.h>
+
+/*
+ * Lowest character that may be other than one column wide, and the
+ * character shown in place of output that is not valid UTF-8.
+ */
+#define UNICODE_NARROW 0x300
+#define UNICODE_REPLACEMENT 0xfffd
+
+/*
+ * Longest UTF-8 encoding of a character.
+ */
+#define UTF8_MAX 4
+
+int unicode_width(uint32_t ch);
+int utf8_encode(char *s, uint32_t ch);
+int utf8_length(unsigned char b);
+uint32_t utf8_check(uint32_t ch, int len);
+int utf8_decode(const char *s, int n, uint32_t *ch);
+
+#endif
@@ -5,23 +5,123 @@
  * Data structure maintaining information about a virtual screen.
  */
 
+#include <stdint.h>
 #include <ncurses.h>
+#include "log.h"
+#include "unicode.h"
 
 
 typedef struct vscreen VSCREEN;
 
+/*
+ * A cell of a virtual screen packs a character (a Unicode code point)
+ * and the index of its display attributes in the attribute table into
+ * 32 bits.  A cell of zero is blank.
+ */
+typedef uint32_t CELL;
+#define CELL_CHAR_BITS 21
+#define CELL(ch, attr) ((CELL)(ch) | (CELL)(attr) << CELL_CHAR_BITS)
+#define CELL_CHAR(cell) ((cell) & ((1u << CELL_CHAR_BITS) - 1))
+#define CELL_ATTR(cell) ((cell) >> CELL_CHAR_BITS)
+#define MAX_ATTRS (1 << (32 - CELL_CHAR_BITS))
+
+/*
+ * A character two columns wide takes up two cells, the second of which
+ * holds CELL_WIDE in place of a character.  Either half of one that has
+ * been partly overwritten is shown blank.
+ */
+#define CELL_WIDE ((1u << CELL_CHAR_BITS) - 1)
+
+/*
+ * Characters of no width, such as combining marks, are combined with
+ * the character before them, in its cell.  A cell holding a character
+ * with marks holds CELL_CLUSTER plus the index of the cluster in a
+ * table shared by all virtual screens, as attributes are, in place of
+ * a character.  A cluster is up to CLUSTER_CHARS code points, and its
+ * text up to CELL_TEXT_MAX bytes of UTF-8 (see vscreen_chars()).
+ */
+#define CELL_CLUSTER 0x110000
+#define CLUSTER_CHARS 4
+#define MAX_CLUSTERS 4096
+#define CELL_TEXT_MAX (CLUSTER_CHARS * UTF8_MAX)
+
+/*
+ * Display attributes, as selected by SGR sequences.  Colors are
+ * indexes into the 256-color palette, or COLOR_DEFAULT.  Attributes
+ * are shared by all virtual screens through a table in which each
+ * distinct combination appears once; entry 0 is the default.
+ */
+struct cell_attr {
+    short fg;
+    short bg;
+    unsigned short flags;
+};
+#define COLOR_DEFAULT -1
+#define ATTR_BOLD      0x01
+#define ATTR_DIM       0x02
+#define ATTR_ITALIC    0x04
+#define ATTR_UNDERLINE 0x08
+#define ATTR_BLINK     0x10
+#define ATTR_REVERSE   0x20
+#define ATTR_INVISIBLE 0x40
+
 extern WINDOW *main_screen;
 extern WINDOW *status_screen;
-extern WINDOW *split_screen1;
-extern WINDOW *split_screen2;
-extern WINDOW *help;
-int split_screenmode;
-int helpmode;
+extern int helpmode;
+
+/*
+ * Default limits on the scrollback history kept by each virtual screen,
+ * as a number of lines and as a memory budget in bytes.  Both can be
+ * changed from the command line before any screen is created.
+ */
+#define VSCREEN_HISTORY_LINES 10000
+#define VSCREEN_HISTORY_BYTES (4L * 1024 * 1024)
+extern int vscreen_history_lines;
+extern long vscreen_history_bytes;
+
+/*
+ * Number of spans of screen lines passed to the renderer so far, for
+ * the benchmarks.
+ */
+extern unsigned long vscreen_render_calls;
+
+/*
+ * Limits on the number of parameters of a control sequence, and on the
+ * replies (such as cursor position reports) waiting to be sent back.
+ */
+#define VT_MAX_PARAMS 16
+#define VT_REPLY_SIZE 64
+
+/*
+ * The value of TERM given to programs run on a virtual screen,
+ * naming the terminal that vscreen_putc() emulates.
+ */
+#define VSCREEN_TERM "vt102"
+
 VSCREEN *vscreen_init(void);
+void vscreen_place(VSCREEN *vscreen, int line, int col);
 void vscreen_show(VSCREEN *vscreen);
 void vscreen_sync(VSCREEN *vscreen);
+int vscreen_frame(void);
 
 void vscreen_putc(VSCREEN *vscreen, char c);
+void vscreen_write(VSCREEN *vscreen, const char *buf, size_t len);
+int vscreen_reply(VSCREEN *vscreen, char *buf, int size);
+void vscreen_scroll(VSCREEN *vscreen, int lines);
+int vscreen_resize(VSCREEN *vscreen, int lines, int cols);
+int vscreen_scrolled(VSCREEN *vscreen);
+int vscreen_changed(VSCREEN *vscreen);
+int vscreen_text(VSCREEN *vscreen, int l, char *text);
+void vscreen_cursor(VSCREEN *vscreen, int *line, int *col);
+void vscreen_log(VSCREEN *vscreen, LOG *log);
+long vscreen_search(VSCREEN *vscreen, const char *text, long before);
+void vscreen_reveal(VSCREEN *vscreen, long line);
+int vscreen_map(VSCREEN *vscreen, const char *path, const char *from);
+int vscreen_map_attrs(const char *path);
+int vscreen_map_clusters(const char *path);
 void vscreen_fini(VSCREEN *vscreen);
+int vscreen_attr_index(const struct cell_attr *attr);
+const struct cell_attr *vscreen_attr(int index);
+int vscreen_chars(uint32_t ch, uint32_t *chars);
 
 #endif
@@ -0,0 +1,190 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/wait.h>
+#include "ecran.h"
+#include "layout.h"
+#include "render.h"
+#include "unicode.h"
+#include "batch.h"
+
+/*
+ * Batch mode.
+ *
+ * Given a command after its options, ecran runs it in a session of its
+ * own, on a pty as it would be run from a terminal, but with no
+ * terminal of ecran's own: curses is not started, nothing is drawn, and
+ * there is no event loop.  The command is run with execvp() semantics,
+ * its arguments passed as they are.  Its output is read off the pty a
+ * buffer at a time and written to the virtual screen of the session,
+ * and replies to queries it makes of the terminal are written back, as
+ * the event loop would.  Once it has closed the pty, which it does by
+ * exiting, its screen is printed on stdout, and ecran exits with the
+ * command's exit status, so that a program with a full-screen interface
+ * can be tested by what it leaves on the screen.
+ *
+ * --size LINESxCOLS gives the screen a size other than BATCH_LINES by
+ * BATCH_COLS.  --every N prints the screen every N milliseconds as
+ * well, form feeds between screens.  --timeout N kills the command if
+ * it is still running after N milliseconds, and prints its screen as it
+ * was, ecran exiting with BATCH_TIMED_OUT.  --json prints each screen as
+ * a JSON object on a line of its own, with the time it was taken at in
+ * milliseconds, the size of the screen, the cursor and the text of each
+ * line, and the last with the exit status too:
+ *   {"ms":12,"lines":24,"cols":80,"cursor":[1,0],"screen":["$ ls",...],
+ *    "exit":0,"timed_out":false}
+ * Lines are shown without trailing blanks, in UTF-8, with combining
+ * marks after the characters they were combined with (up to three to a
+ * character, any more being left out).  Starting up and tearing down
+ * cost about as much as starting the command does, so that many can be
+ * run one after another.
+ */
+
+int batch_lines = BATCH_LINES;
+int batch_cols = BATCH_COLS;
+long batch_every;             // How often to print the screen, in ms.
+long batch_timeout;           // How long the command may run, in ms.
+int batch_json;               // Print screens as JSON.
+
+static void print_screen(VSCREEN *vscreen, unsigned long ns, int last,
+			 int status, int timed_out);
+static void print_string(const char *s, int n);
+static unsigned long until(unsigned long now, unsigned long then);
+
+/*
+ * Run a command, given as its arguments, in batch mode, and print its
+ * screen.  Returns the exit status for ecran: the command's, as the
+ * shell would give it, or BATCH_TIMED_OUT.
+ */
+int batch(char *argv[]) {
+    // The screen of the session is the size of a terminal less its
+    // status line.
+    LINES = batch_lines + 1;
+    COLS = batch_cols;
+    renderer = &render_null;
+    layout_init();
+
+    unsigned long start = stats_clock();
+    SESSION *session = session_init(argv[0], argv);
+    if(session == NULL) {
+	perror(argv[0]);
+	return EXIT_FAILURE;
+    }
+    pid_t pid = session->pid;
+    unsigned long every = batch_every * 1000000UL;
+    unsigned long deadline = start + batch_timeout * 1000000UL;
+    unsigned long next = start + every;
+    int timed_out = 0;
+    while(1) {
+	unsigned long now = stats_clock(), wait = -1UL;
+	if(batch_every > 0)
+	    wait = until(now, next);
+	if(batch_timeout > 0 && until(now, deadline) < wait)
+	    wait = until(now, deadline);
+	struct timespec ts = { wait / 1000000000, wait % 1000000000 };
+	struct pollfd pfd = { .fd = session->ptyfd, .events = POLLIN };
+	int r = ppoll(&pfd, 1, wait == -1UL ? NULL : &ts, NULL);
+	if(r == -1 && errno != EINTR)
+	    exit_error();
+	if(r > 0 && session_drain(session) == EOF)
+	    break;
+
+	now = stats_clock();
+	if(batch_every > 0 && now >= next) {
+	    print_screen(session->vscreen, now - start, 0, 0, 0);
+	    // Screens that could not be printed in time are skipped.
+	    while(next <= now)
+		next += every;
+	}
+	if(batch_timeout > 0 && now >= deadline) {
+	    timed_out = 1;
+	    break;
+	}
+    }
+
+    // What was on the screen when the command was killed is printed,
+    // not what it was killed with.
+    unsigned long ns = stats_clock() - start;
+    int status = BATCH_TIMED_OUT, wstatus;
+    if(timed_out) {
+	print_screen(session->vscreen, ns, 1, status, timed_out);
+	session_kill(session);
+	session_sweep();
+	waitpid(pid, NULL, 0);
+    } else {
+	waitpid(pid, &wstatus, 0);
+	status = WIFSIGNALED(wstatus) ? 128 + WTERMSIG(wstatus) :
+	    WEXITSTATUS(wstatus);
+	print_screen(session->vscreen, ns, 1, status, timed_out);
+	session_fini(session);
+    }
+    log_fini();
+    return status;
+}
+
+/*
+ * Helper function to print a screen, taken ns nanoseconds after the
+ * command was started.  The last screen is printed with the exit
+ * status of the command.
+ */
+static void print_screen(VSCREEN *vscreen, unsigned long ns, int last,
+			 int status, int timed_out) {
+    static int printed;
+    char text[batch_cols * CELL_TEXT_MAX];
+    int line, col;
+    vscreen_cursor(vscreen, &line, &col);
+    if(batch_json) {
+	printf("{\"ms\":%lu,\"lines\":%d,\"cols\":%d,\"cursor\":[%d,%d],"
+	       "\"screen\":[", ns / 1000000, batch_lines, batch_cols, line, col);
+	for(int l = 0; l < batch_lines; l++) {
+	    if(l > 0)
+		putchar(',');
+	    print_string(text, vscreen_text(vscreen, l, text));
+	}
+	putchar(']');
+	if(last)
+	    printf(",\"exit\":%d,\"timed_out\":%s", status,
+		   timed_out ? "true" : "false");
+	printf("}\n");
+    } else {
+	if(printed)
+	    printf("\f\n");
+	// Blank lines at the bottom of the screen are left out.
+	int lines = batch_lines;
+	while(lines > 0 && vscreen_text(vscreen, lines - 1, text) == 0)
+	    lines--;
+	for(int l = 0; l < lines; l++) {
+	    fwrite(text, 1, vscreen_text(vscreen, l, text), stdout);
+	    putchar('\n');
+	}
+    }
+    printed = 1;
+    fflush(stdout);
+}
+
+/*
+ * Helper function to print n characters of a line as a JSON string.
+ */
+static void print_string(const char *s, int n) {
+    putchar('"');
+    for(int i = 0; i < n; i++) {
+	if(s[i] == '"' || s[i] == '\\')
+	    putchar('\\');
+	putchar(s[i]);
+    }
+    putchar('"');
+}
+
+/*
+ * Helper function to work out how long it is from now until then, on
+ * the clock of stats_clock(), or zero if then has passed.
+ */
+static unsigned long until(unsigned long now, unsigned long then) {
+    return then > now ? then - now : 0;
+}
@@ -12,93 +12,62 @@
 #include <sys/ioctl.h>
 #include <errno.h>
 #include <string.h>
+#include <limits.h>
 #include "ecran.h"
 #include "session.h"
+#include "layout.h"
+#include "render.h"
+#include "server.h"
+#include "search.h"
+#include "snapshot.h"
+#include "status.h"
+
+int err = 0;
+static int prompt;     // Reading a session number for this command.
+static int number;     // The number read so far, or -1 for none.
+static char text[SEARCH_MAX + 1];     // Text being typed to search for,
+static char searched[SEARCH_MAX + 1]; //   and the text last searched for,
+static int found_sid = -1;            //   found in this session,
+static long found_line;               //   on this line.
 
-static void initialize();
 static void curses_init(void);
 static void curses_fini(void);
-static void finalize(void);
-void fg(SESSION *session);
+static int number_command(int in);
+static int search_command(int in);
+static void switch_command(int sid);
+static void kill_command(int sid);
+static void split_command(int beside);
+static SESSION *new_session(void);
+static char *shell(void);
+static void help_write(void);
+static void help_show(int mode);
 
 void set_status(char *status);
-int err = 0;
-
-int main(int argc, char *argv[]) {
-        int c;
-        char * filename;
-        split_screenmode = 0;
-        helpmode = 0;
-
-        signal(SIGCHLD,sigchld_handler);
-        signal(SIGALRM,sigalrm_handler);
-        alarm(1);
-        initialize();
-
-        while((c = getopt(argc,argv,"o:")) != -1){
-            switch(c){
-                case 'o':
-                filename = optarg;
-                int error = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXG | S_IRWXU | S_IRWXO);
-
-                err = 1;
-                int e;
-
-                if((e = dup2(error, 2)) == -1)
-                    exit_error();
-
-                if(close(error) == -1)
-                    exit_error();
-
-                break;
-
-
-            }
-        }
-
-        char sg[100];
-        if(optind < argc){
-            while(optind< argc){
-                strcat(sg, argv[optind]);
-                strcat(sg, " ");
-                optind++;
-
-            }
-            FILE *fp;
-            fp = popen(sg, "r");
-
-
 
-            int c;
-            while((c = fgetc(fp)) != EOF){
-                vscreen_putc(fg_session->vscreen, c);
-            }
-                vscreen_show(fg_session->vscreen);
-                set_status("");
-
-
-                while(1){
-                    int in = wgetch(main_screen);
-                    if(in == 'q'){
-                        finalize();
-                    }
-        }
-        mainloop();
-    }
-}
+static char *shell_argv[] = { " (ecran session)", NULL };
 
 /*
  * Initialize the program and launch a single session to run the
- * default shell.
+ * default shell, or one for each screen restored from the snapshots
+ * left by an ecran that did not exit cleanly.
  */
-static void initialize() {
-    curses_init();
-    char *path = getenv("SHELL");
-    if(path == NULL)
-	path = "/bin/bash";
+void initialize() {
+    initialize_screen();
+    if(snapshot_dir == NULL || session_restore(shell(), shell_argv) == 0)
+        new_session();
+}
 
-    char *argv[2] = { " (ecran session)", NULL };
-    session_init(path, argv);
+/*
+ * Set up the terminal and the renderer, and lay out the screen, with no
+ * sessions yet.  A server has no terminal of its own, and does without
+ * curses.
+ */
+void initialize_screen(void) {
+    if(!server_mode)
+        curses_init();
+    renderer->init();
+    help_init();
+    layout_init();
 }
 
 /*
@@ -109,12 +78,17 @@ static void initialize() {
  * the original screen contents and terminating normally; the rest is left
  * to be done.
  */
-static void finalize(void) {
-    for(int i = 0; i < MAX_SESSIONS; i++){
-        if(sessions[i] != NULL )
-        session_kill(sessions[i]);
-    }
-    curses_fini();
+void finalize(void) {
+    while(session_list != NULL)
+        session_kill(session_list);
+    session_sweep();
+    log_fini();
+    layout_fini();
+    renderer->fini();
+    if(server_mode)
+        server_fini();
+    else
+        curses_fini();
     help_fini();
 
     exit(EXIT_SUCCESS);
@@ -133,17 +107,15 @@ static void curses_init(void) {
                                  // immediately available.
     if((r = noecho())==ERR)      // Don't echo -- let the pty handle it.
         exit(EXIT_FAILURE);
+    if(has_colors()) {           // Colors for the cell attributes, with
+        start_color();           // the terminal's own colors as default.
+        use_default_colors();
+    }
 
     main_screen = stdscr;
     main_screen = newwin(LINES -1,COLS,0,0);
     status_screen = stdscr;
     status_screen = newwin(1,COLS,LINES-1,0);
-    split_screen1 = newwin(LINES -1,COLS/2,0,0);
-    split_screen2 = newwin(LINES -1,COLS/2,0,COLS/2);
-    help = newwin(LINES -1,COLS,0,0);
-
-    help_init();
-
     //refresh();
     if((r = nodelay(main_screen, TRUE)) == ERR)  // Set non-blocking I/O on input.
         exit(EXIT_FAILURE);
@@ -170,316 +142,398 @@ void curses_fini(void) {
 }
 
 /*
- * Function to read and process a command from the terminal.
- * This function is called from mainloop(), which arranges for non-blocking
- * I/O to be disabled before calling and restored upon return.
- * So within this function terminal input can be collected one character
- * at a time by calling getch(), which will block until input is available.
- * Note that while blocked in getch(), no updates to virtual screens can
- * occur.
+ * Function to process a command from the terminal.
+ * This function is called from mainloop() with each key typed after the
+ * command escape, for as long as it returns nonzero to say that the
+ * command needs another key.  It never waits for input, so that the
+ * virtual screens keep being updated while a command is being typed.
  */
-void do_command() {
+int do_command(int in) {
+    static int killing;    // Waiting for the number of a session to kill.
+    char s[64];
+    // Paging through the scrollback keeps a line of the page before.
+    int page = layout_focus->lines > 1 ? layout_focus->lines - 1 : 1;
+    if(prompt == '/')
+        return search_command(in);
+    if(prompt)
+        return number_command(in);
+    if(killing){
+        killing = 0;
+        if(in == '\''){
+            prompt = 'k';
+            number = -1;
+            set_status("Kill session: ");
+            return 1;
+        }
+        kill_command(in >= '0' && in <= '9' ? in - '0' : -1);
+        return 0;
+    }
     // Quit command: terminates the program cleanly
-    set_status("");
-    int in = wgetch(main_screen);
     if(in == 'q')
 	finalize();
     else if(in == 'n'){
-        //curses_init();
-        char *path = getenv("SHELL");
-        if(path == NULL)
-        path = "/bin/bash";
-
-        char *argv[2] = { " (ecran session)", NULL };
-
-        session_init(path, argv);
-        vscreen_sync(fg_session->vscreen);
-        wrefresh(main_screen);
-        wrefresh(split_screen1);
-        wrefresh(split_screen2);
-
-    }else if(in == '0'){
-        if(sessions[0] != NULL){
-            session_setfg(sessions[0]);
-            set_status("Current Session: Session 0");
-        }else{
-            flash();
-            set_status("Session 0 does not exist");
+        new_session();
+    }else if(in >= '0' && in <= '9'){
+        switch_command(in - '0');
+    }else if(in == '\''){
+        prompt = 's';
+        number = -1;
+        set_status("Switch to session: ");
+        return 1;
+    }else if(in == 'k'){
+        killing = 1;
+        return 1;
+    }else if(in == '/'){
+        prompt = '/';
+        text[0] = '\0';
+        set_status("Search: ");
+        return 1;
+    }else if(in == 's' || in == 'v' || in == '|'){
+        split_command(in != 's');
+    }else if(in == '\t'){
+        layout_next();
+        sprintf(s, "Current Session: Session %d", fg_session->sid);
+        set_status(s);
+    }else if(in == 'x'){
+        if(layout_close() == -1){
+            renderer->bell();
+            set_status("Only one pane");
         }
-
-    }else if(in == '1'){
-        if(sessions[1] != NULL){
-            session_setfg(sessions[1]);
-            set_status("Current Session: Session 1");
-        }else{
-            flash();
-            set_status("Session 1 does not exist");
+    }else if(in == '['){
+        vscreen_scroll(fg_session->vscreen, page);
+    }else if(in == ']'){
+        vscreen_scroll(fg_session->vscreen, -page);
+    }else if(in == 'd'){
+        if(server_mode)
+            mainloop_detach();
+        else{
+            renderer->bell();
+            set_status("Not attached to a server");
         }
-
-    }else if(in == '2'){
-        if(sessions[2] != NULL){
-            session_setfg(sessions[2]);
-            set_status("Current Session: Session 2");
+    }else if(in == 'h'){
+        help_show(HELP_SCREEN);
+    }else if(in == 'i'){
+        help_show(STATS_SCREEN);
+    }else if(in == 'j'){
+        if(stats_path == NULL){
+            renderer->bell();
+            set_status("No stats file given with -J");
+        }else if(stats_dump() == -1){
+            snprintf(s, sizeof(s), "Cannot write stats: %s", strerror(errno));
+            set_status(s);
         }else{
-            flash();
-            set_status("Session 2 does not exist");
+            set_status("Stats written");
         }
+    }else if(in == 27){
+        help_leave();
 
-    }else if(in == '3'){
-        if(sessions[3] != NULL){
-            session_setfg(sessions[3]);
-            set_status("Current Session: Session 3");
-        }else{
-            flash();
-            set_status("Session 3 does not exist");
-        }
+    }else{
+        renderer->bell();
+    }
+    return 0;
+}
 
-    }else if(in == '4'){
-        if(sessions[4] != NULL){
-            session_setfg(sessions[4]);
-            set_status("Current Session: Session 4");
+/*
+ * Helper function to read the number of a session, for sessions past 9,
+ * one key at a time.  The number is ended with Enter, and the command
+ * given with it is carried out; ESC cancels.  Returns nonzero while more
+ * keys are needed.
+ */
+static int number_command(int in){
+    char s[32];
+    if(in == '\r' || in == '\n'){
+        if(prompt == 'k')
+            kill_command(number);
+        else
+            switch_command(number);
+        prompt = 0;
+        return 0;
+    }else if(in == 27){
+        prompt = 0;
+        set_status("");
+        return 0;
+    }else if(in >= '0' && in <= '9' && number < 100000000){
+        number = (number < 0 ? 0 : number * 10) + in - '0';
+    }else if((in == 127 || in == '\b') && number >= 0){
+        number = number >= 10 ? number / 10 : -1;
+    }else{
+        renderer->bell();
+    }
+    sprintf(s, number < 0 ? "%s" : "%s%d",
+            prompt == 'k' ? "Kill session: " : "Switch to session: ", number);
+    set_status(s);
+    return 1;
+}
+
+/*
+ * Helper function to read the text to search the scrollback of all
+ * sessions for, one key at a time, and search when it is ended with
+ * Enter; ESC cancels.  The session with the line found is brought to
+ * the foreground, scrolled back to show it.  Enter alone searches for
+ * the text last searched for again, going on from the line last found.
+ * Returns nonzero while more keys are needed.
+ */
+static int search_command(int in){
+    char s[SEARCH_MAX + 64];
+    int len = strlen(text);
+    if(in == '\r' || in == '\n'){
+        prompt = 0;
+        SESSION *from = session_get(found_sid);
+        long line = found_line;
+        if(len > 0 || from == NULL){
+            if(len > 0)
+                strcpy(searched, text);
+            from = fg_session;
+            line = LONG_MAX;
+        }
+        SESSION *session = searched[0] != '\0' ?
+            search_next(searched, from, &line) : NULL;
+        if(session != NULL){
+            found_sid = session->sid;
+            found_line = line;
+            if(session != fg_session)
+                session_setfg(session);
+            vscreen_reveal(session->vscreen, line);
+            sprintf(s, "Found \"%s\" in session %d", searched, session->sid);
         }else{
-            flash();
-            set_status("Session 4 does not exist");
+            renderer->bell();
+            found_sid = -1;
+            sprintf(s, "Not found: %s", searched);
         }
+        set_status(s);
+        return 0;
+    }else if(in == 27){
+        prompt = 0;
+        set_status("");
+        return 0;
+    }else if(in >= ' ' && in < 127 && len < SEARCH_MAX){
+        text[len++] = in;
+        text[len] = '\0';
+    }else if((in == 127 || in == '\b') && len > 0){
+        text[--len] = '\0';
+    }else{
+        renderer->bell();
+    }
+    sprintf(s, "Search: %s", text);
+    set_status(s);
+    return 1;
+}
 
-    }else if(in == '5'){
-        if(sessions[5] != NULL){
-            session_setfg(sessions[5]);
-            set_status("Current Session: Session 5");
-        }else{
-            flash();
-            set_status("Session 5 does not exist");
+/*
+ * Helper function to bring the session with a given number to the
+ * foreground.
+ */
+static void switch_command(int sid){
+    char s[64];
+    SESSION *session = session_get(sid);
+    if(session != NULL){
+        session_setfg(session);
+        sprintf(s, "Current Session: Session %d", sid);
+    }else{
+        renderer->bell();
+        sprintf(s, "Session %d does not exist", sid);
+    }
+    set_status(s);
+}
 
-        }
+/*
+ * Helper function to carry out the kill command, for the session
+ * whose number was typed after it.
+ */
+static void kill_command(int sid){
+    char s[64];
+    SESSION *session = session_get(sid);
+    if(session != NULL){
+        fg(session);
+        session_kill(session);
+        sprintf(s, "Session %d Killed", sid);
+    }else{
+        renderer->bell();
+        sprintf(s, "Session %d does not exist", sid);
+    }
+    set_status(s);
+}
 
-    }else if(in == '6'){
-        if(sessions[6] != NULL){
-            session_setfg(sessions[6]);
-            set_status("Current Session: Session 6");
-        }else{
-            flash();
-            set_status("Session 6 does not exist");
-        }
+/*
+ * Helper function to carry out the split command: the pane with the
+ * focus is split, and the new half shows a session that is not shown
+ * already, or else a new one.
+ */
+static void split_command(int beside){
+    char s[64];
+    if(layout_split(beside) == -1){
+        renderer->bell();
+        set_status("No room to split");
+        return;
+    }
+    SESSION *session = layout_hidden(NULL);
+    if(session != NULL){
+        session_setfg(session);
+        sprintf(s, "Current Session: Session %d", session->sid);
+        set_status(s);
+    }else if(new_session() == NULL){
+        layout_close();
+    }
+}
 
-    }else if(in == '7'){
-        if(sessions[7] != NULL){
-            session_setfg(sessions[7]);
-            set_status("Current Session: Session 7");
-        }else{
-            flash();
-            set_status("Session 7 does not exist");
-        }
+/*
+ * Helper function to start a new session running the user's shell,
+ * which becomes the foreground session.  Returns NULL if it cannot be
+ * started.
+ */
+static SESSION *new_session(void){
+    return session_init(shell(), shell_argv);
+}
 
-    }else if(in == '8'){
-        if(sessions[8] != NULL){
-            session_setfg(sessions[8]);
-            set_status("Current Session: Session 8");
-        }else{
-            flash();
-            set_status("Session 8 does not exist");
-        }
+/*
+ * Helper function to return the path of the user's shell.
+ */
+static char *shell(void){
+    char *path = getenv("SHELL");
+    if(path == NULL)
+        path = "/bin/bash";
+    return path;
+}
 
-    }else if(in == '9'){
-        if(sessions[9] != NULL){
-            session_setfg(sessions[9]);
-            set_status("Current Session: Session 9");
-        }else{
-            flash();
-            set_status("Session 9 does not exist");
-        }
-    }else if(in == 'k'){
-        int sec = wgetch(main_screen);
-        if(sec == '0'){
-            if(sessions[0] != NULL){
-                fg(sessions[0]);
-                session_kill(sessions[0]);
-                sessions[0] = NULL;
-                set_status("Session 0 Killed");
-
-            }else{
-                flash();
-                set_status("Session 0 does not exist");
-
-            }
-        }else if(sec == '1'){
-            if(sessions[1] != NULL){
-                fg(sessions[1]);
-                session_kill(sessions[1]);
-                sessions[1] = NULL;
-                set_status("Session 1 Killed");
-
-
-            }else{
-                flash();
-                set_status("Session 1 does not exist");
-            }
-
-        }else if(sec == '2'){
-            if(sessions[2] != NULL){
-                fg(sessions[2]);
-                session_kill(sessions[2]);
-                sessions[2] = NULL;
-                set_status("Session 2 Killed");
-
-            }else{
-                flash();
-                set_status("Session 2 does not exist");
-            }
-
-        }else if(sec == '3'){
-            if(sessions[3] != NULL){
-                fg(sessions[3]);
-                session_kill(sessions[3]);
-                sessions[3] = NULL;
-                set_status("Session 3 Killed");
-
-            }else{
-                flash();
-                set_status("Session 3 does not exist");
-            }
-
-        }else if(sec == '4'){
-            if(sessions[4] != NULL){
-                fg(sessions[4]);
-                session_kill(sessions[4]);
-                sessions[4] = NULL;
-                set_status("Session 4 Killed");
-
-            }else{
-                flash();
-                set_status("Session 4 does not exist");
-            }
-
-        }else if(sec == '5'){
-            if(sessions[5] != NULL){
-                fg(sessions[5]);
-                session_kill(sessions[5]);
-                sessions[5] = NULL;
-                set_status("Session 5 Killed");
-
-            }else{
-                flash();
-                set_status("Session 5 does not exist");
-            }
-
-        }else if(sec == '6'){
-            if(sessions[6] != NULL){
-                fg(sessions[6]);
-                session_kill(sessions[6]);
-                sessions[6] = NULL;
-                set_status("Session 6 Killed");
-
-            }else{
-                flash();
-                set_status("Session 6 does not exist");
-            }
-
-        }else if(sec == '7'){
-            if(sessions[7] != NULL){
-                fg(sessions[7]);
-                session_kill(sessions[7]);
-                sessions[7] = NULL;
-                set_status("Session 7 Killed");
-
-
-            }else{
-                flash();
-                set_status("Session 7 does not exist");
-            }
-
-        }else if(sec == '8'){
-            if(sessions[8] != NULL){
-                fg(sessions[8]);
-                session_kill(sessions[8]);
-                sessions[8] = NULL;
-                set_status("Session 8 Killed");
-
-            }else{
-                flash();
-                set_status("Session 8 does not exist");
-            }
-
-        }else if(sec == '9'){
-            if(sessions[9] != NULL){
-                fg(sessions[9]);
-                session_kill(sessions[9]);
-                sessions[9] = NULL;
-                set_status("Session 9 Killed");
-            }else{
-                flash();
-                set_status("Session 9 does not exist");
-            }
-        }else flash();
-    }else if(in == 's'){
-        if(split_screenmode){
-            split_screenmode = 0;
-            session_setfg(fg_session);
-            wrefresh(split_screen1);
-        }else{
-            split_screenmode = 1;
-            session_setfg(fg_session);
-            wrefresh(split_screen1);
-            wrefresh(split_screen2);
-        }
-    }else if(in == 'h'){
-        if(!helpmode){
-            helpmode = 1;
-            vscreen_show(helpvscreen);
-
-            fprintf(stderr, "help\n" );
-
-            wprintw(help, "Help Screen\n");
-            wprintw(help, "----------------------------\n");
-            wprintw(help, "Ecran Can Understand the Following Commands:\n");
-            wprintw(help, "CTRL -a n: Start a new Terminal Session\n");
-            wprintw(help, "CTRL -a 0-9: Swtich to a specific virtual session, if it is active\n");
-            wprintw(help, "CTRL -a k 0-9: Forcibly Terminate an Existing Session\n");
-            wprintw(help, "CTRL -a s: Split the Screen, showing current session in both halves of screen\n");
-            wprintw(help, "CTRL -a h: Display Help Screen\n");
-            wprintw(help, "ESC: Escape from Help Screen\n");
-            wprintw(help, "CTRL -a q: QUIT ECRAN\n");
-            wprintw(help, "Current Sessions that are active: \n");
-            for(int i = 0; i < MAX_SESSIONS; i++){
-                if(sessions[i] != NULL){
-                    char s[1];
-                    sprintf(s,"%i",i);
-                    wprintw(help, s);
-                }
-            }
-            wrefresh(help);
-            vscreen_show(helpvscreen);
-            vscreen_sync(helpvscreen);
+/*
+ * Helper function to fill in the help screen, which is shown like any
+ * other virtual screen.
+ */
+static void help_write(void){
+    static char *text[] = {
+        "Help Screen",
+        "----------------------------",
+        "Ecran Can Understand the Following Commands:",
+        "CTRL -a n: Start a new Terminal Session",
+        "CTRL -a 0-9: Swtich to a specific virtual session, if it is active",
+        "CTRL -a ' number Enter: Switch to any session by its number",
+        "CTRL -a k 0-9: Forcibly Terminate an Existing Session",
+        "CTRL -a k ' number Enter: Terminate any session by its number",
+        "CTRL -a s / v: Split the Pane in Two, Stacked / Side by Side",
+        "CTRL -a Tab: Move to the Next Pane",
+        "CTRL -a x: Close the Pane, Leaving its Session Running",
+        "CTRL -a [ / ]: Page Back / Forward Through Scrollback History",
+        "CTRL -a / text Enter: Search the Scrollback of All Sessions",
+        "CTRL -a / Enter: Search Again, for the Next Line Back",
+        "CTRL -a d: Detach from the server, leaving the sessions running",
+        "CTRL -a h: Display Help Screen",
+        "CTRL -a i: Display Performance Counters",
+        "CTRL -a j: Write Performance Counters as JSON to the -J File",
+        "ESC: Escape from Help Screen",
+        "CTRL -a q: QUIT ECRAN",
+        "Current Sessions that are active: ",
+    };
+    char s[32];
+    vscreen_write(helpvscreen, "\033[H\033[2J", 7);
+    for(int i = 0; i < sizeof(text) / sizeof(text[0]); i++){
+        if(i > 0)
+            vscreen_write(helpvscreen, "\r\n", 2);
+        vscreen_write(helpvscreen, text[i], strlen(text[i]));
+    }
+    for(int i = 0, n = 0; n < session_count; i++){
+        if(session_get(i) != NULL){
+            sprintf(s, n++ ? " %i" : "%i", i);
+            vscreen_write(helpvscreen, s, strlen(s));
         }
+    }
+}
 
 
-    }else if(in == 27){
-        vscreen_putc(helpvscreen, 27);
 
-    }else{
-        flash();
+/*
+ * Helper function to show the help screen or the stats screen, as
+ * mode says, in place of the panes, unless it is already shown.
+ */
+static void help_show(int mode){
+    if(helpmode != mode){
+        helpmode = mode;
+        if(mode == HELP_SCREEN)
+            help_write();
+        else
+            stats_write(helpvscreen);
+        vscreen_show(helpvscreen);
     }
+}
 
+/*
+ * Bring the stats screen up to date, if it is shown.  Called from the
+ * event loop on each tick of the clock.
+ */
+void help_tick(void){
+    if(helpmode == STATS_SCREEN)
+        stats_write(helpvscreen);
 }
 
+/*
+ * Leave the help screen, showing the panes again.
+ */
+void help_leave(void){
+    if(helpmode){
+        helpmode = 0;
+        layout_draw();
+    }
+}
 
+/*
+ * Adapt to the terminal having been resized to lines by cols: curses
+ * (if in use) and the renderer are told, and the panes (or the help
+ * screen) are fitted to the new size and drawn again.  The size is
+ * shown on the status line.
+ */
+void resize_screen(int lines, int cols){
+    char s[32];
+    if(lines < 2)
+        lines = 2;
+    if(cols < 1)
+        cols = 1;
+    if(lines != LINES || cols != COLS){
+        if(server_mode){
+            LINES = lines;
+            COLS = cols;
+        }else{
+            resizeterm(lines, cols);
+            wresize(main_screen, LINES - 1, COLS);
+            wresize(status_screen, 1, COLS);
+            mvwin(status_screen, LINES - 1, 0);
+        }
+        renderer->resize();
+        vscreen_resize(helpvscreen, LINES - 1, COLS);
+        if(helpmode == HELP_SCREEN)
+            help_write();
+        help_tick();
+    }
+    if(helpmode)
+        vscreen_show(helpvscreen);
+    layout_resize();
+    status_invalidate();
+    sprintf(s, "%dx%d", COLS, LINES);
+    set_status(s);
+}
 
+/*
+ * Replace the message shown on the status line.  The change is drawn,
+ * and sent to the terminal, with the next frame (see status.c).
+ */
 void set_status(char *status){
-    wclear(status_screen);
-    wprintw(status_screen, status);
-    wrefresh(status_screen);
+    status_message(status);
 }
 
+/*
+ * Hook called once per pass of mainloop() to take care of any
+ * deferred processing, such as deallocating the sessions that have
+ * been killed or have exited.
+ */
+void do_other_processing(void){
+    session_sweep();
+}
+
+/*
+ * Before a session is killed, show another one in the pane it is in,
+ * or close the pane, if need be (see layout_release()).  Killing the
+ * last session ends the program.
+ */
 void fg(SESSION *session){
-    if(session == fg_session){
-        for(int i = 0; i < MAX_SESSIONS; i++){
-            if(sessions[i] != NULL && sessions[i] != session){
-                session_setfg(sessions[i]);
-                return;
-            }
-        }
-        finalize();
-    }
+    layout_release(session);
 }
 
 
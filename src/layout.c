@@ -0,0 +1,362 @@
+#include <stdlib.h>
+#include "ecran.h"
+#include "layout.h"
+#include "render.h"
+
+/*
+ * The layout of the physical screen.
+ *
+ * The physical screen above the status line is divided into panes.
+ * Any pane can be split in two, stacked or side by side, and its
+ * halves split in turn, so the panes form a binary tree: a pane that
+ * has been split has its halves as children, and one that has not
+ * shows the virtual screen of a session, at the size of the pane.  A
+ * session is shown in at most one pane.  The halves of a split are
+ * separated by a line of '-' or a column of '|', and share what is left
+ * evenly; when there is not room for both, the second gets nothing and
+ * is not drawn.
+ *
+ * The pane with the focus shows the foreground session, which gets the
+ * keys typed.  Each pane is drawn from the virtual screen of its own
+ * session, which keeps its own damage, so a frame draws the lines that
+ * have changed in each pane once, and nothing else.  Sessions not shown
+ * in any pane just keep their virtual screens up to date, and are only
+ * resized when they are next shown.
+ */
+
+PANE *layout_focus;       // The pane showing the foreground session.
+static PANE *root;        // The pane that is the whole screen.
+
+static PANE *new_pane(PANE *parent);
+static void free_pane(PANE *pane);
+static void replace(PANE *pane, PANE *by);
+static void place(PANE *pane, int line, int col, int lines, int cols);
+static void draw(PANE *pane);
+static void show(PANE *pane);
+static void sync(PANE *pane);
+static void sync_session(SESSION *session);
+static void bind(PANE *pane, SESSION *session);
+static void focus(PANE *pane);
+static void remove_pane(PANE *pane);
+static PANE *first_leaf(PANE *pane);
+
+/*
+ * Lay out the screen as a single pane, with nothing shown in it yet.
+ */
+void layout_init(void) {
+    root = layout_focus = new_pane(NULL);
+    place(root, 0, 0, LINES - 1, COLS);
+}
+
+/*
+ * Free the panes, leaving the sessions as they are.
+ */
+void layout_fini(void) {
+    free_pane(root);
+    root = layout_focus = NULL;
+}
+
+/*
+ * Make a session the foreground session: if it is shown in a pane, that
+ * pane gets the focus, and if not, it is shown in place of the session
+ * in the pane with the focus, which goes into the background.
+ */
+void layout_show(SESSION *session) {
+    if(session->pane != NULL)
+        focus(session->pane);
+    else
+        bind(layout_focus, session);
+    fg_session = session;
+}
+
+/*
+ * Split the pane with the focus in two, stacked or side by side, and
+ * give the focus to the second half, which is left empty for a session
+ * to be shown in.  Returns -1 if the pane is too small to split.
+ */
+int layout_split(int beside) {
+    PANE *pane = layout_focus;
+    if((beside ? pane->cols : pane->lines) < 3)
+        return -1;
+    PANE *split = new_pane(pane->parent);
+    replace(pane, split);
+    split->beside = beside;
+    split->first = pane;
+    split->second = new_pane(split);
+    pane->parent = split;
+    place(split, pane->line, pane->col, pane->lines, pane->cols);
+    focus(split->second);
+    draw(split);
+    return 0;
+}
+
+/*
+ * Close the pane with the focus, giving its room back to the other
+ * half of the split that made it.  Its session carries on in the
+ * background.  Returns -1 if it is the only pane.
+ */
+int layout_close(void) {
+    if(layout_focus == root)
+        return -1;
+    remove_pane(layout_focus);
+    return 0;
+}
+
+/*
+ * Give the focus to the next pane, left to right and top to bottom,
+ * going round to the first after the last.
+ */
+void layout_next(void) {
+    PANE *pane = layout_focus;
+    while(pane->parent != NULL && pane == pane->parent->second)
+        pane = pane->parent;
+    focus(first_leaf(pane->parent != NULL ? pane->parent->second : root));
+}
+
+/*
+ * Take a session that is going away out of the pane it is shown in, if
+ * any.  Another session is shown in its place, if there is one not
+ * shown already; otherwise the pane is closed, unless it is the last,
+ * in which case the program ends.
+ */
+void layout_release(SESSION *session) {
+    PANE *pane = session->pane;
+    if(pane == NULL)
+        return;
+    SESSION *other = layout_hidden(session);
+    if(other != NULL)
+        bind(pane, other);
+    else if(pane != root)
+        remove_pane(pane);
+    else
+        finalize();
+    fg_session = layout_focus->session;
+}
+
+/*
+ * Return a session, other than except, that is not shown in any pane,
+ * the most recent first.  Returns NULL if there is none.
+ */
+SESSION *layout_hidden(SESSION *except) {
+    for(SESSION *session = session_list; session != NULL;
+        session = session->next)
+        if(session->pane == NULL && session != except)
+            return session;
+    return NULL;
+}
+
+/*
+ * Fit the panes to the physical screen, which has been resized, and
+ * draw them again, resizing the sessions shown.
+ */
+void layout_resize(void) {
+    place(root, 0, 0, LINES - 1, COLS);
+    layout_draw();
+}
+
+/*
+ * Draw all of the panes again, as when the help screen is put away.
+ */
+void layout_draw(void) {
+    if(!helpmode)
+        draw(root);
+}
+
+/*
+ * Draw what has changed in each pane since the last frame, and leave
+ * the cursor where it is in the pane with the focus.  Called from the
+ * event loop before each frame.
+ */
+void layout_sync(void) {
+    if(helpmode)
+        return;
+    sync(root);
+    if(layout_focus->session != NULL && layout_focus->lines > 0 &&
+       layout_focus->cols > 0)
+        sync_session(layout_focus->session);
+}
+
+/*
+ * Helper function to allocate a pane that has not been split, showing
+ * nothing.
+ */
+static PANE *new_pane(PANE *parent) {
+    PANE *pane = calloc(1, sizeof(PANE));
+    if(pane == NULL)
+        exit_error();
+    pane->parent = parent;
+    return pane;
+}
+
+/*
+ * Helper function to free a pane and its halves.
+ */
+static void free_pane(PANE *pane) {
+    if(pane == NULL)
+        return;
+    if(pane->session != NULL)
+        pane->session->pane = NULL;
+    free_pane(pane->first);
+    free_pane(pane->second);
+    free(pane);
+}
+
+/*
+ * Helper function to put a pane where another one is in the tree.
+ */
+static void replace(PANE *pane, PANE *by) {
+    if(pane->parent == NULL)
+        root = by;
+    else if(pane->parent->first == pane)
+        pane->parent->first = by;
+    else
+        pane->parent->second = by;
+}
+
+/*
+ * Helper function to give a pane its place on the physical screen, and
+ * share it out between its halves.
+ */
+static void place(PANE *pane, int line, int col, int lines, int cols) {
+    pane->line = line;
+    pane->col = col;
+    pane->lines = lines;
+    pane->cols = cols;
+    if(pane->first == NULL)
+        return;
+    int room = pane->beside ? cols : lines;
+    int first = room >= 3 ? room / 2 : room;
+    int second = room >= 3 ? room - first - 1 : 0;
+    if(pane->beside) {
+        place(pane->first, line, col, lines, first);
+        place(pane->second, line, col + first + 1, lines, second);
+    } else {
+        place(pane->first, line, col, first, cols);
+        place(pane->second, line + first + 1, col, second, cols);
+    }
+}
+
+/*
+ * Helper function to draw a pane in full: the separators between its
+ * halves, and what is shown in each.
+ */
+static void draw(PANE *pane) {
+    if(pane->lines == 0 || pane->cols == 0)
+        return;
+    if(pane->first == NULL) {
+        show(pane);
+        return;
+    }
+    PANE *second = pane->second;
+    if(second->lines > 0 && second->cols > 0) {
+        CELL bar[pane->cols];
+        if(pane->beside) {
+            bar[0] = CELL('|', 0);
+            for(int l = 0; l < pane->lines; l++)
+                renderer->put(pane->line + l, second->col - 1, bar, 1,
+                              second->col);
+        } else {
+            for(int c = 0; c < pane->cols; c++)
+                bar[c] = CELL('-', 0);
+            renderer->put(second->line - 1, pane->col, bar, pane->cols,
+                          pane->col + pane->cols);
+        }
+    }
+    draw(pane->first);
+    draw(second);
+}
+
+/*
+ * Helper function to show the session in a pane that has not been
+ * split, first fitting its virtual screen to the pane.  An empty pane
+ * is blanked.
+ */
+static void show(PANE *pane) {
+    if(pane->lines == 0 || pane->cols == 0)
+        return;
+    if(pane->session == NULL) {
+        renderer->blank(pane->line, pane->col, pane->lines, pane->cols);
+        return;
+    }
+    VSCREEN *vscreen = pane->session->vscreen;
+    session_resize(pane->session);
+    vscreen_place(vscreen, pane->line, pane->col);
+    vscreen_show(vscreen);
+}
+
+/*
+ * Helper function to draw what has changed in the panes in a pane,
+ * apart from the one with the focus.
+ */
+static void sync(PANE *pane) {
+    if(pane->first != NULL) {
+        sync(pane->first);
+        sync(pane->second);
+    } else if(pane != layout_focus && pane->session != NULL &&
+              pane->lines > 0 && pane->cols > 0 &&
+              vscreen_changed(pane->session->vscreen)) {
+        sync_session(pane->session);
+    }
+}
+
+/*
+ * Helper function to draw what has changed on the screen of a session,
+ * counting the time it takes (see stats.c).
+ */
+static void sync_session(SESSION *session) {
+    unsigned long t = stats_clock();
+    vscreen_sync(session->vscreen);
+    session->counters.render_ns += stats_clock() - t;
+}
+
+/*
+ * Helper function to show a session in a pane, in place of whatever
+ * session was shown there.
+ */
+static void bind(PANE *pane, SESSION *session) {
+    if(pane->session != NULL)
+        pane->session->pane = NULL;
+    pane->session = session;
+    session->pane = pane;
+    show(pane);
+}
+
+/*
+ * Helper function to give the focus to a pane, making the session
+ * shown in it the foreground session.
+ */
+static void focus(PANE *pane) {
+    layout_focus = pane;
+    fg_session = pane->session;
+}
+
+/*
+ * Helper function to take a pane that has not been split out of the
+ * tree, along with the split that made it, whose room goes to the
+ * other half.  If the pane had the focus, the first pane in the other
+ * half gets it.
+ */
+static void remove_pane(PANE *pane) {
+    PANE *split = pane->parent;
+    PANE *other = split->first == pane ? split->second : split->first;
+    replace(split, other);
+    other->parent = split->parent;
+    if(pane->session != NULL)
+        pane->session->pane = NULL;
+    if(layout_focus == pane)
+        focus(first_leaf(other));
+    place(other, split->line, split->col, split->lines, split->cols);
+    free(pane);
+    free(split);
+    draw(other);
+}
+
+/*
+ * Helper function to find the first pane, left to right and top to
+ * bottom, that has not been split within a pane.
+ */
+static PANE *first_leaf(PANE *pane) {
+    while(pane->first != NULL)
+        pane = pane->first;
+    return pane;
+}
@@ -0,0 +1,756 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include "ecran.h"
+#include "log.h"
+
+/*
+ * Logging of session output.
+ *
+ * Given -L, the output of each session is logged to a file, named by
+ * the path given with any "%d" in it replaced by the number of the
+ * session (or with the number appended, after a dot, if there is no
+ * "%d").  Given -P, it is piped to a command, run with sh -c, with the
+ * number of the session as $1.  Either way, what is logged is the raw
+ * output of the program in the session, or given -T, the text of each
+ * line as it scrolls off the top of the screen, and of the lines left
+ * on the screen when the session ends (see vscreen_log()).
+ *
+ * Output is logged by whichever thread parses it, which only copies it
+ * into the front of a pair of buffers of the log.  A writer thread in
+ * the background swaps the front buffer for the back one when it has
+ * written out the back one, so neither the event loop nor the workers
+ * ever wait for a disk or a command.  A log is put on the writer's
+ * queue when output arrives for it while it is idle.  The writer takes
+ * the whole queue at once, and keeps writing out each log until there
+ * is nothing more in it, but only after waiting LOG_DELAY milliseconds,
+ * so that output arriving a line at a time costs one write (and one
+ * wakeup of the writer, through an eventfd) per batch rather than per
+ * line.  It is woken to write at once when LOG_BATCH bytes have piled
+ * up in a log, or a log is closed.
+ *
+ * Commands are written to through non-blocking pipes, and a command
+ * that does not read its log as fast as it is written does not hold
+ * up the writer, which goes on with the other logs, watching the pipe
+ * until it can take more.  Meanwhile the front buffer fills up, and
+ * once it is full, the oldest output in it is dropped to make room for
+ * the newest.  (The same goes for a file, should a disk ever fall so
+ * far behind.)  A line noting how much output was dropped is logged in
+ * its place.  A command that exits is written no more.
+ *
+ * Given -R, log files are rotated by size: once a file has reached the
+ * size given, it is renamed with ".1" appended (what was ".1" becoming
+ * ".2", and so on, up to LOG_KEEP files), and a new file is started.
+ * Should the writer fail to start one, or to write a file at all, the
+ * status line says so (see log_tick()).
+ *
+ * Given --record, the raw output of each session is also recorded, to
+ * a file named as for -L, with the time at which each read of its pty
+ * returned it, and the size of its screen whenever that changes, in the
+ * format described in log.h, for ecran --replay (see replay.c) to play
+ * back.  A recording is a log like any other, written by the writer,
+ * except that it is never rotated, and that when the front buffer is
+ * full, it is the newest output that is dropped, whole reads of it at
+ * a time, so that what is recorded can still be read; a gap is
+ * recorded in place of what was dropped.
+ */
+
+char *log_path;           // Pattern of the log files' paths, or NULL.
+char *log_command;        // Command logs are piped to, or NULL.
+long log_rotate;          // Size at which files are rotated, or 0.
+int log_text;             // Log the text of lines, not raw output.
+char *log_record_path;    // Pattern of the recordings' paths, or NULL.
+
+struct log {
+    int fd;               // File or pipe written to, or -1 if broken.
+    int pipe;             // The fd is a pipe to a command.
+    char *path;           // Path of the file.
+    off_t size;           // Size of the file so far.
+    char *front;          // Ring of LOG_BUFFER bytes of output waiting
+    size_t head, len;     //   for the writer: len bytes from head.
+    unsigned long dropped;    // Bytes dropped from the front since.
+    char *back;           // The front buffer last taken by the writer,
+    size_t back_head, back_len;   //   with the bytes not yet written.
+    char note[64];        // A note of output dropped, to be written
+    int note_len;         //   before the back buffer.
+    int queued;           // On the writer's queue, or being written.
+    int urgent;           // The writer has been woken to write it.
+    int blocked;          // The pipe has no room.
+    int closing;          // The session has gone.
+    int record;           // It is a recording.
+    unsigned long last_us;    // When the last record was made,
+    unsigned long gap;    //   and the bytes of output dropped since.
+    struct log *next;     // The other logs of the session.
+    struct log *queue_next;   // Queue of the writer.
+    pthread_mutex_t lock;
+};
+
+static pthread_t thread;
+static int started;
+static int wake_fd = -1;
+static int stopping;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static LOG *queue;        // Logs posted since the writer last looked.
+static int urgent;        // Some log is to be written at once.
+static int sleeping;      // The writer is waiting for a log to be posted.
+static int failed;        // Error of the last file the writer failed at.
+
+static LOG *new_log(int fd, int pipe, char *path);
+static char *file_path(char *pattern, int sid);
+static void start_writer(void);
+static int lock_front(LOG *log);
+static void unlock_front(LOG *log);
+static void put(LOG *log, const void *buf, size_t n);
+static void add_record(LOG *log, int kind, unsigned long n,
+		       const void *data, size_t len);
+static int varint(unsigned char *p, unsigned long value);
+static unsigned long clock_us(clockid_t clock);
+static int spawn_command(int sid);
+static void post(LOG *log, int now);
+static void *writer(void *arg);
+static int service(LOG *log);
+static void take_front(LOG *log);
+static void rotate(LOG *log);
+static void finish(LOG *log);
+
+/*
+ * Start logging the output of the session with a given number, as the
+ * command line asks.  Returns the logs of the session, chained through
+ * their next fields, or NULL if there are none.  The writer thread is
+ * started with the first log, which must be after the signals handled
+ * by the main loop have been blocked, as for pool_init().
+ */
+LOG *log_open(int sid) {
+    LOG *logs = NULL;
+    char s[64];
+    if(log_command != NULL) {
+	int fd = spawn_command(sid);
+	if(fd == -1)
+	    set_status("Cannot start log command");
+	else
+	    logs = new_log(fd, 1, NULL);
+    }
+    if(log_path != NULL) {
+	char *path = file_path(log_path, sid);
+	int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+	if(fd == -1) {
+	    snprintf(s, sizeof(s), "Cannot open log: %s", strerror(errno));
+	    set_status(s);
+	    free(path);
+	} else {
+	    LOG *log = new_log(fd, 0, path);
+	    struct stat st;
+	    if(fstat(fd, &st) == 0)
+		log->size = st.st_size;
+	    log->next = logs;
+	    logs = log;
+	}
+    }
+    if(logs != NULL)
+	start_writer();
+    return logs;
+}
+
+/*
+ * Start recording the output of the session with a given number, whose
+ * screen is lines by columns, as the command line asks.  Returns the
+ * recording, or NULL if there is none.
+ */
+LOG *log_record(int sid, int lines, int cols) {
+    if(log_record_path == NULL)
+	return NULL;
+    char *path = file_path(log_record_path, sid);
+    int fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if(fd == -1) {
+	char s[64];
+	snprintf(s, sizeof(s), "Cannot record: %s", strerror(errno));
+	set_status(s);
+	free(path);
+	return NULL;
+    }
+    LOG *log = new_log(fd, 0, path);
+    log->record = 1;
+    start_writer();
+
+    unsigned char head[sizeof(RECORD_MAGIC) + RECORD_VARINT];
+    int n = sizeof(RECORD_MAGIC) - 1;
+    memcpy(head, RECORD_MAGIC, n);
+    head[n++] = RECORD_VERSION;
+    n += varint(head + n, clock_us(CLOCK_REALTIME));
+    if(lock_front(log)) {
+	log->last_us = clock_us(CLOCK_MONOTONIC);
+	put(log, head, n);
+	unlock_front(log);
+    }
+    log_resize(log, lines, cols);
+    return log;
+}
+
+/*
+ * Log n bytes of output to each of a chain of logs.  This only copies
+ * them into the front buffer of each, dropping the oldest output there
+ * if it is full, and never waits for the writer.  A recording takes
+ * them as a record of their own.
+ */
+void log_write(LOG *log, const char *buf, size_t n) {
+    for(; log != NULL; log = log->next) {
+	if(!lock_front(log))
+	    continue;
+	if(log->record)
+	    add_record(log, RECORD_OUTPUT, n, buf, n);
+	else
+	    put(log, buf, n);
+	unlock_front(log);
+    }
+}
+
+/*
+ * Note in each of a chain of logs that are recordings that the screen
+ * has been resized to lines by cols.  Other logs are left as they are.
+ */
+void log_resize(LOG *log, int lines, int cols) {
+    for(; log != NULL; log = log->next) {
+	if(!log->record || !lock_front(log))
+	    continue;
+	unsigned char size[2 * RECORD_VARINT];
+	int n = varint(size, lines);
+	n += varint(size + n, cols);
+	add_record(log, RECORD_RESIZE, n, size, n);
+	unlock_front(log);
+    }
+}
+
+/*
+ * Stop logging to a chain of logs.  Whatever is still waiting in them
+ * is written out by the writer, which then closes and frees them.
+ * Nothing must be logged to them once this has been called.
+ */
+void log_close(LOG *log) {
+    while(log != NULL) {
+	LOG *next = log->next;
+	pthread_mutex_lock(&log->lock);
+	log->closing = 1;
+	int idle = !log->queued;
+	log->queued = 1;
+	pthread_mutex_unlock(&log->lock);
+	post(idle ? log : NULL, 1);
+	log = next;
+    }
+}
+
+/*
+ * Say on the status line if the writer has failed to write a log file,
+ * or to start a new one, since this was last called.  The writer cannot
+ * say so itself, as only the event loop may set the status.  Called on
+ * each tick of the status line clock.
+ */
+void log_tick(void) {
+    int error = __atomic_exchange_n(&failed, 0, __ATOMIC_RELAXED);
+    if(error != 0) {
+	char s[64];
+	snprintf(s, sizeof(s), "Cannot write log: %s", strerror(error));
+	set_status(s);
+    }
+}
+
+/*
+ * Wait for the writer to write out what is waiting in the logs, giving
+ * up after LOG_LINGER milliseconds on commands that are not reading
+ * them, as the program exits.
+ */
+void log_fini(void) {
+    if(!started)
+	return;
+    __atomic_store_n(&stopping, 1, __ATOMIC_RELEASE);
+    post(NULL, 1);
+    pthread_join(thread, NULL);
+    started = 0;
+}
+
+/*
+ * Helper function to allocate a log writing to a file descriptor.  The
+ * buffers are only allocated once there is something to log.
+ */
+static LOG *new_log(int fd, int pipe, char *path) {
+    LOG *log = calloc(1, sizeof(LOG));
+    if(log == NULL)
+	exit_error();
+    log->fd = fd;
+    log->pipe = pipe;
+    log->path = path;
+    pthread_mutex_init(&log->lock, NULL);
+    return log;
+}
+
+/*
+ * Helper function to make the path of the log file (or recording) of a
+ * session from a pattern, log_path (or log_record_path).  Returns it in
+ * a newly allocated string.
+ */
+static char *file_path(char *pattern, int sid) {
+    char num[16];
+    int len = snprintf(num, sizeof(num), "%d", sid);
+    int count = 0;
+    for(char *p = pattern; (p = strstr(p, "%d")) != NULL; p += 2)
+	count++;
+    char *path = malloc(strlen(pattern) + (count ? count : 1) * len + 2);
+    if(path == NULL)
+	exit_error();
+    char *q = path;
+    for(char *p = pattern; *p != '\0'; ) {
+	if(p[0] == '%' && p[1] == 'd') {
+	    q = stpcpy(q, num);
+	    p += 2;
+	} else {
+	    *q++ = *p++;
+	}
+    }
+    *q = '\0';
+    if(count == 0)
+	sprintf(q, ".%s", num);
+    return path;
+}
+
+/*
+ * Helper function to start log_command for the session with a given
+ * number, reading from a pipe, with its output thrown away.  It is
+ * reaped like any other child that is not a session leader (see
+ * session_reap()).  Returns the non-blocking write end of the pipe, or
+ * -1 if the command cannot be started.
+ */
+static int spawn_command(int sid) {
+    int fds[2];
+    if(pipe2(fds, O_CLOEXEC) == -1)
+	return -1;
+    char num[16];
+    snprintf(num, sizeof(num), "%d", sid);
+    char *argv[] = { "sh", "-c", log_command, "ecran-log", num, NULL };
+
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t mask;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK |
+			     POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_adddup2(&actions, fds[0], 0);
+    posix_spawn_file_actions_addopen(&actions, 1, "/dev/null", O_WRONLY, 0);
+    pid_t pid;
+    int error = posix_spawn(&pid, "/bin/sh", &actions, &attr, argv, environ);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    close(fds[0]);
+    if(error != 0) {
+	close(fds[1]);
+	return -1;
+    }
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+    return fds[1];
+}
+
+/*
+ * Helper function to start the writer thread, unless it has been
+ * started already.  This must be after the signals handled by the main
+ * loop have been blocked, as for pool_init().
+ */
+static void start_writer(void) {
+    if(started)
+	return;
+    if((wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1 ||
+       pthread_create(&thread, NULL, writer, NULL) != 0)
+	exit_error();
+    started = 1;
+}
+
+/*
+ * Helper function to lock a log to add output to its front buffer,
+ * allocating the buffer if need be.  Returns zero, with the log left
+ * unlocked, if nothing can be added, because the log is broken.
+ */
+static int lock_front(LOG *log) {
+    pthread_mutex_lock(&log->lock);
+    if(log->front == NULL && log->fd != -1)
+	log->front = malloc(LOG_BUFFER);
+    if(log->fd == -1 || log->front == NULL) {
+	pthread_mutex_unlock(&log->lock);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * Helper function to unlock a log once output has been added to its
+ * front buffer, putting it on the writer's queue if it was idle, and
+ * having it written at once if LOG_BATCH bytes have piled up.
+ */
+static void unlock_front(LOG *log) {
+    int idle = !log->queued;
+    int full = log->len >= LOG_BATCH && !log->urgent;
+    log->queued = 1;
+    log->urgent |= full;
+    pthread_mutex_unlock(&log->lock);
+    if(idle || full)
+	post(idle ? log : NULL, full);
+}
+
+/*
+ * Helper function to copy n bytes into the front buffer of a log,
+ * dropping the oldest output there if it is full.  Called with the log
+ * locked.
+ */
+static void put(LOG *log, const void *buf, size_t n) {
+    const char *p = buf;
+    if(n > LOG_BUFFER) {
+	log->dropped += n - LOG_BUFFER;
+	p += n - LOG_BUFFER;
+	n = LOG_BUFFER;
+    }
+    if(log->len + n > LOG_BUFFER) {
+	size_t over = log->len + n - LOG_BUFFER;
+	log->head = (log->head + over) % LOG_BUFFER;
+	log->len -= over;
+	log->dropped += over;
+    }
+    size_t tail = (log->head + log->len) % LOG_BUFFER;
+    size_t first = LOG_BUFFER - tail < n ? LOG_BUFFER - tail : n;
+    memcpy(log->front + tail, p, first);
+    memcpy(log->front, p + first, n - first);
+    log->len += n;
+}
+
+/*
+ * Helper function to add a record of a given kind and size to a
+ * recording, followed by len bytes of data, stamped with the time since
+ * the last.  A record that does not fit in the front buffer is dropped
+ * whole, and a gap recorded before the next one that does, for the
+ * output dropped meanwhile.  Called with the log locked.
+ */
+static void add_record(LOG *log, int kind, unsigned long n,
+		       const void *data, size_t len) {
+    unsigned char head[4 * RECORD_VARINT];
+    unsigned long now = clock_us(CLOCK_MONOTONIC);
+    int h = 0;
+    if(log->gap > 0) {
+	h += varint(head + h, 0);
+	h += varint(head + h, log->gap << 2 | RECORD_GAP);
+    }
+    h += varint(head + h, now - log->last_us);
+    h += varint(head + h, n << 2 | kind);
+    if(log->len + h + len > LOG_BUFFER) {
+	if(kind == RECORD_OUTPUT)
+	    log->gap += n;
+	return;
+    }
+    put(log, head, h);
+    put(log, data, len);
+    log->gap = 0;
+    log->last_us = now;
+}
+
+/*
+ * Helper function to write a number as a varint.  Returns the number
+ * of bytes written, at most RECORD_VARINT.
+ */
+static int varint(unsigned char *p, unsigned long value) {
+    int n = 0;
+    while(value >= 0x80) {
+	p[n++] = value | 0x80;
+	value >>= 7;
+    }
+    p[n++] = value;
+    return n;
+}
+
+/*
+ * Helper function to return the time on a clock, in microseconds.
+ */
+static unsigned long clock_us(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+/*
+ * Helper function to put a log (unless it is NULL) on the writer's
+ * queue.  The writer is woken if it is waiting for a log to be posted,
+ * and told to write at once if now is set.
+ */
+static void post(LOG *log, int now) {
+    uint64_t one = 1;
+    pthread_mutex_lock(&queue_lock);
+    if(log != NULL) {
+	log->queue_next = queue;
+	queue = log;
+    }
+    urgent |= now;
+    int wake = now || sleeping;
+    sleeping = 0;
+    pthread_mutex_unlock(&queue_lock);
+    if(wake)
+	write(wake_fd, &one, sizeof(one));
+}
+
+/*
+ * Helper function run by the writer thread.  The logs it is writing
+ * are kept on a list of its own.  Those left on it after a round of
+ * writing are pipes that have no room, which are polled along with the
+ * eventfd until they have, and logs waiting for LOG_DELAY to be up.
+ */
+static void *writer(void *arg) {
+    LOG *active = NULL;
+    struct pollfd *fds = NULL;
+    int max_fds = 0, due = 0;
+    struct timespec deadline = { 0, 0 };
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &mask, NULL);
+
+    while(1) {
+	pthread_mutex_lock(&queue_lock);
+	LOG *posted = queue;
+	queue = NULL;
+	due |= urgent;
+	urgent = 0;
+	pthread_mutex_unlock(&queue_lock);
+	while(posted != NULL) {
+	    LOG *next = posted->queue_next;
+	    posted->queue_next = active;
+	    active = posted;
+	    posted = next;
+	}
+
+	int stop = __atomic_load_n(&stopping, __ATOMIC_ACQUIRE);
+	int n = 1, waiting = 0;
+	for(LOG **link = &active; *link != NULL; ) {
+	    LOG *log = *link;
+	    if(!log->blocked && (due || stop) && !service(log)) {
+		*link = log->queue_next;
+	    } else {
+		waiting |= !log->blocked;
+		link = &log->queue_next;
+		n++;
+	    }
+	}
+	due = 0;
+
+	int timeout = waiting ? LOG_DELAY : -1;
+	if(stop) {
+	    struct timespec now;
+	    clock_gettime(CLOCK_MONOTONIC, &now);
+	    if(deadline.tv_sec == 0) {
+		deadline = now;
+		deadline.tv_sec += LOG_LINGER / 1000;
+		deadline.tv_nsec += LOG_LINGER % 1000 * 1000000L;
+	    }
+	    timeout = (deadline.tv_sec - now.tv_sec) * 1000 +
+		      (deadline.tv_nsec - now.tv_nsec) / 1000000;
+	    // Logs may have been posted since the queue was taken.
+	    pthread_mutex_lock(&queue_lock);
+	    int more = queue != NULL;
+	    pthread_mutex_unlock(&queue_lock);
+	    if((active == NULL && !more) || timeout <= 0)
+		break;
+	    if(more)
+		continue;
+	} else if(!waiting) {
+	    // Nothing to write until a log is posted, unless one was
+	    // while writing, which is then left for LOG_DELAY.
+	    pthread_mutex_lock(&queue_lock);
+	    if(queue == NULL)
+		sleeping = 1;
+	    else
+		timeout = LOG_DELAY;
+	    pthread_mutex_unlock(&queue_lock);
+	}
+
+	if(n > max_fds) {
+	    max_fds = n * 2;
+	    if((fds = realloc(fds, max_fds * sizeof(struct pollfd))) == NULL)
+		break;
+	}
+	fds[0].fd = wake_fd;
+	fds[0].events = POLLIN;
+	n = 1;
+	for(LOG *log = active; log != NULL; log = log->queue_next) {
+	    fds[n].fd = log->blocked ? log->fd : -1;
+	    fds[n++].events = POLLOUT;
+	}
+	int r = poll(fds, n, timeout);
+	if(r == 0)
+	    due = 1;
+	if(r > 0) {
+	    uint64_t count;
+	    read(wake_fd, &count, sizeof(count));
+	    n = 1;
+	    for(LOG *log = active; log != NULL; log = log->queue_next) {
+		if(fds[n++].revents) {
+		    log->blocked = 0;
+		    due = 1;
+		}
+	    }
+	}
+	pthread_mutex_lock(&queue_lock);
+	sleeping = 0;
+	pthread_mutex_unlock(&queue_lock);
+    }
+    free(fds);
+    return NULL;
+}
+
+/*
+ * Helper function to write out what is waiting in a log, taking the
+ * front buffer as many times as it fills in the meantime.  Returns
+ * nonzero if a pipe to a command has no room for the rest, and zero
+ * once there is nothing left to write (freeing the log if it has been
+ * closed).
+ */
+static int service(LOG *log) {
+    while(1) {
+	if(log->note_len == 0 && log->back_len == 0) {
+	    pthread_mutex_lock(&log->lock);
+	    if(log->len == 0 && log->dropped == 0) {
+		int closing = log->closing;
+		log->queued = 0;
+		pthread_mutex_unlock(&log->lock);
+		if(closing)
+		    finish(log);
+		return 0;
+	    }
+	    take_front(log);
+	    pthread_mutex_unlock(&log->lock);
+	}
+	if(log->fd == -1) {
+	    log->note_len = log->back_len = 0;
+	    continue;
+	}
+
+	size_t first = LOG_BUFFER - log->back_head;
+	if(first > log->back_len)
+	    first = log->back_len;
+	struct iovec iov[3] = {
+	    { log->note, log->note_len },
+	    { log->back + log->back_head, first },
+	    { log->back, log->back_len - first },
+	};
+	ssize_t w = writev(log->fd, iov, 3);
+	if(w == -1) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno == EAGAIN) {
+		log->blocked = 1;
+		return 1;
+	    }
+	    // The command has exited, or the disk has failed.
+	    if(!log->pipe)
+		__atomic_store_n(&failed, errno, __ATOMIC_RELAXED);
+	    pthread_mutex_lock(&log->lock);
+	    close(log->fd);
+	    log->fd = -1;
+	    pthread_mutex_unlock(&log->lock);
+	    continue;
+	}
+
+	size_t done = w;
+	if(done < log->note_len) {
+	    memmove(log->note, log->note + done, log->note_len - done);
+	    log->note_len -= done;
+	    continue;
+	}
+	done -= log->note_len;
+	log->note_len = 0;
+	log->back_head = (log->back_head + done) % LOG_BUFFER;
+	log->back_len -= done;
+	if(!log->pipe && !log->record) {
+	    log->size += w;
+	    if(log_rotate > 0 && log->size >= log_rotate)
+		rotate(log);
+	}
+    }
+}
+
+/*
+ * Helper function to swap the front buffer of a log for the back one,
+ * which has been written out, noting any output dropped.  Called with
+ * the log locked.
+ */
+static void take_front(LOG *log) {
+    char *buf = log->back;
+    log->back = log->front;
+    log->back_head = log->head;
+    log->back_len = log->len;
+    log->front = buf;
+    log->head = log->len = 0;
+    log->urgent = 0;
+    if(log->dropped > 0) {
+	log->note_len = snprintf(log->note, sizeof(log->note),
+				 "\n[ecran: %lu bytes of output dropped]\n",
+				 log->dropped);
+	log->dropped = 0;
+    }
+}
+
+/*
+ * Helper function to rotate the file of a log: the older files are
+ * renamed up a number, the oldest being overwritten, and the file
+ * becomes path.1, with a new file started at path.  The new file is
+ * made before anything is renamed, so that if it cannot be, the log
+ * goes on in the file it was in, until another log_rotate bytes have
+ * been written to it, and the failure is noted for log_tick().
+ */
+static void rotate(LOG *log) {
+    size_t len = strlen(log->path);
+    char from[len + 16], to[len + 16];
+    snprintf(from, sizeof(from), "%s.new", log->path);
+    int fd = open(from, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		  0600);
+    log->size = 0;
+    if(fd == -1) {
+	__atomic_store_n(&failed, errno, __ATOMIC_RELAXED);
+	return;
+    }
+    for(int i = LOG_KEEP - 1; i >= 1; i--) {
+	snprintf(from, sizeof(from), "%s.%d", log->path, i);
+	snprintf(to, sizeof(to), "%s.%d", log->path, i + 1);
+	rename(from, to);
+    }
+    snprintf(to, sizeof(to), "%s.1", log->path);
+    rename(log->path, to);
+    snprintf(from, sizeof(from), "%s.new", log->path);
+    rename(from, log->path);
+    pthread_mutex_lock(&log->lock);
+    close(log->fd);
+    log->fd = fd;
+    pthread_mutex_unlock(&log->lock);
+}
+
+/*
+ * Helper function to close and free a log that has been written out.
+ */
+static void finish(LOG *log) {
+    if(log->fd != -1)
+	close(log->fd);
+    free(log->front);
+    free(log->back);
+    free(log->path);
+    pthread_mutex_destroy(&log->lock);
+    free(log);
+}
@@ -0,0 +1,184 @@
+/*
+ * Ecran: A program that supports the multiplexing
+ * of multiple virtual terminal sessions onto a single physical terminal.
+ *
+ * Command line processing.  The rest of the program lives in the other
+ * source files, so that it can be linked into the benchmarks as well.
+ */
+
+#include <unistd.h>
+#include <getopt.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <ncurses.h>
+#include <fcntl.h>
+#include <string.h>
+#include "ecran.h"
+#include "session.h"
+#include "render.h"
+#include "server.h"
+#include "pool.h"
+#include "log.h"
+#include "snapshot.h"
+#include "status.h"
+#include "replay.h"
+#include "batch.h"
+
+int main(int argc, char *argv[]) {
+        int c;
+        char * filename;
+        int attach = 0;
+        char *path = server_default_path();
+        char *replay_path = NULL;
+        helpmode = 0;
+        render_locale();
+
+        // Options with no single letter to spare for them.
+        enum { RECORD = 256, REPLAY, SPEED, SIZE, EVERY, TIMEOUT, JSON };
+        static struct option long_options[] = {
+            { "record",  required_argument, NULL, RECORD },
+            { "replay",  required_argument, NULL, REPLAY },
+            { "speed",   required_argument, NULL, SPEED },
+            { "size",    required_argument, NULL, SIZE },
+            { "every",   required_argument, NULL, EVERY },
+            { "timeout", required_argument, NULL, TIMEOUT },
+            { "json",    no_argument,       NULL, JSON },
+            { NULL, 0, NULL, 0 }
+        };
+
+        // Options stop at the command to run in batch mode, if any, so
+        // that its own options are left to it.
+        while((c = getopt_long(argc,argv,"+o:l:m:w:r:AS:j:L:P:R:TM:F:J:",
+                               long_options, NULL)) != -1){
+            switch(c){
+                case 'o':
+                filename = optarg;
+                int error = open(filename, O_WRONLY | O_CREAT | O_TRUNC, S_IRWXG | S_IRWXU | S_IRWXO);
+
+                err = 1;
+                int e;
+
+                if((e = dup2(error, 2)) == -1)
+                    exit_error();
+
+                if(close(error) == -1)
+                    exit_error();
+
+                break;
+
+                case 'l':
+                vscreen_history_lines = atoi(optarg);
+                break;
+
+                case 'm':
+                vscreen_history_bytes = atol(optarg) * 1024;
+                break;
+
+                case 'w':
+                session_highwater = atoi(optarg);
+                if(session_highwater < 1)
+                    session_highwater = 1;
+                if(session_highwater > SESSION_WBUF_SIZE)
+                    session_highwater = SESSION_WBUF_SIZE;
+                break;
+
+                case 'j':
+                pool_threads = atoi(optarg);
+                if(pool_threads < 0)
+                    pool_threads = 0;
+                break;
+
+                case 'L':
+                log_path = optarg;
+                break;
+
+                case 'P':
+                log_command = optarg;
+                break;
+
+                case 'R':
+                log_rotate = atol(optarg) * 1024;
+                break;
+
+                case 'T':
+                log_text = 1;
+                break;
+
+                case 'M':
+                snapshot_dir = optarg;
+                break;
+
+                case 'F':
+                status_format = optarg;
+                break;
+
+                case 'J':
+                stats_path = optarg;
+                break;
+
+                case RECORD:
+                log_record_path = optarg;
+                break;
+
+                case REPLAY:
+                replay_path = optarg;
+                break;
+
+                case SPEED:
+                replay_speed = strcmp(optarg, "max") == 0 ? 0 : strtod(optarg, NULL);
+                if(replay_speed <= 0 && strcmp(optarg, "max") != 0){
+                    fprintf(stderr, "Bad speed: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+                case SIZE:
+                if(sscanf(optarg, "%dx%d", &batch_lines, &batch_cols) != 2 ||
+                   batch_lines < 1 || batch_cols < 1){
+                    fprintf(stderr, "Bad size: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+                case EVERY:
+                batch_every = atol(optarg);
+                break;
+
+                case TIMEOUT:
+                batch_timeout = atol(optarg);
+                break;
+
+                case JSON:
+                batch_json = 1;
+                break;
+
+                case 'A':
+                attach = 1;
+                break;
+
+                case 'S':
+                path = optarg;
+                break;
+
+                case 'r':
+                if((renderer = render_find(optarg)) == NULL){
+                    fprintf(stderr, "Unknown renderer: %s\n", optarg);
+                    exit(EXIT_FAILURE);
+                }
+                break;
+
+
+            }
+        }
+
+        if(attach)
+            return client_main(path);
+        if(replay_path != NULL)
+            return replay(replay_path);
+        if(optind < argc)
+            return batch(argv + optind);
+
+        mainloop_init();
+        initialize();
+        mainloop();
+}
@@ -1,13 +1,161 @@
+#define _GNU_SOURCE
+
 #include <unistd.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <errno.h>
 #include <ncurses.h>
-#include <sys/signal.h>
-#include <sys/select.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
 
 #include "ecran.h"
+#include "layout.h"
+#include "render.h"
+#include "server.h"
+#include "pool.h"
+#include "status.h"
+
+#define MAX_EVENTS 32
+
+/*
+ * Size of the buffer for input read from an attached client.
+ */
+#define CLIENT_INPUT_SIZE 4096
+
+/*
+ * Number of ticks of the status line clock for which terminal input
+ * is held back when the foreground session stops reading its input,
+ * before keys for it are refused instead so that commands can be used.
+ */
+#define HOLD_TICKS 2
+
+/*
+ * The event loop is built on a single epoll instance, with which
+ * every file descriptor of interest is registered exactly once:
+ * the terminal (stdin), the master side of each session pty,
+ * a timerfd that drives the status line clock, and a signalfd
+ * through which SIGCHLD, SIGWINCH and SIGUSR1 (which asks for the
+ * performance counters to be dumped) are delivered synchronously.
+ * A server has no terminal: in place of stdin it watches its listening
+ * socket, and the connection of the client attached to it, if any,
+ * which is both where input comes from and where the renderer draws.
+ * With a worker pool, the ptys are watched one shot at a time, and an
+ * eventfd tells of sessions the workers have finished draining.
+ * The epoll data of the fixed descriptors points at the static
+ * variables holding them; for ptys it points at the session.
+ */
+static int epoll_fd = -1;
+static int stdin_fd = STDIN_FILENO;
+static int clock_fd = -1;
+static int signal_fd = -1;
+static int listen_fd = -1;
+static int client_fd = -1;
+static int pool_fd = -1;
+static int input_held;    // Terminal input left unread for now.
+static int held_ticks;    // Clock ticks the foreground has been paused.
+static int command;       // Keys of a command still to come.
+static int output_held;   // The client is not taking the frames drawn.
+
+static unsigned char client_input[CLIENT_INPUT_SIZE];
+static int client_pos, client_len;
+static int client_keys;   // Keys of the client's packet still to come.
+
+static void watch(int fd, void *ptr);
+static void input_events(void);
+static void hold_input(int hold);
+static void clock_arm(void);
+static void attach(void);
+static int next_key(void);
+static void unget_key(int c);
+static void handle_input(void);
+static void handle_signals(void);
+static void handle_session(SESSION *session, uint32_t events);
+static void handle_pool(void);
+static void pty_events(SESSION *session, int op);
+
+/*
+ * Set up the event loop.  This must be called before any session
+ * is created, because the signals that are delivered through the
+ * signalfd have to be blocked before the first child is started
+ * (session_init() has them unblocked again in the child).
+ */
+void mainloop_init(void) {
+    sigset_t mask;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGCHLD);
+    sigaddset(&mask, SIGWINCH);
+    sigaddset(&mask, SIGUSR1);
+    if(sigprocmask(SIG_BLOCK, &mask, NULL) == -1)
+	exit_error();
+
+    if((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) == -1)
+	exit_error();
+    if((signal_fd = signalfd(-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC)) == -1)
+	exit_error();
+    if((clock_fd = timerfd_create(CLOCK_REALTIME,
+				  TFD_NONBLOCK | TFD_CLOEXEC)) == -1)
+	exit_error();
+    clock_arm();
+
+    if(!server_mode)
+	watch(stdin_fd, &stdin_fd);
+    watch(signal_fd, &signal_fd);
+    watch(clock_fd, &clock_fd);
+    if((pool_fd = pool_init()) != -1)
+	watch(pool_fd, &pool_fd);
+}
+
+/*
+ * Register the pty of a newly created session with the event loop.
+ */
+void mainloop_watch(SESSION *session) {
+    pty_events(session, EPOLL_CTL_ADD);
+}
+
+/*
+ * Start or stop waiting for the pty of a session to become writable,
+ * which is done while input queued for the session cannot all be
+ * written (as session->wwatch says).
+ */
+void mainloop_output(SESSION *session) {
+    pty_events(session, EPOLL_CTL_MOD);
+}
 
+/*
+ * Register the listening socket of a server, on which clients attach.
+ */
+void mainloop_listen(int fd) {
+    listen_fd = fd;
+    watch(listen_fd, &listen_fd);
+}
+
+/*
+ * Let go of the attached client, if any.  The sessions carry on, but
+ * nothing is drawn until another client attaches.
+ */
+void mainloop_detach(void) {
+    if(client_fd < 0)
+	return;
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, client_fd, NULL);
+    close(client_fd);
+    client_fd = render_fd = -1;
+    client_pos = client_len = client_keys = 0;
+    input_held = held_ticks = command = output_held = 0;
+}
 
-static int setfds(fd_set *fds);
+/*
+ * Remove the pty of a session from the event loop.  This must be done
+ * before the session is deallocated.
+ */
+void mainloop_unwatch(SESSION *session) {
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, session->ptyfd, NULL);
+}
 
 /*
  * This function encapsulates the technicalities of non-blocking I/O,
@@ -15,77 +163,367 @@ static int setfds(fd_set *fds);
  * and forth between the physical terminal and the virtual sessions
  * without the possibility of "hanging" due to trying to read from a
  * file descriptor that does not currently have available data.
+ * The loop sleeps in epoll_wait() until one of the registered
+ * descriptors is ready, so an idle ecran causes no wakeups apart
+ * from the once-a-second tick of the status line clock.
  */
 int mainloop(void) {
-    struct timeval tv;
-    fd_set fds;
+    while(1)
+	mainloop_step(-1);
+    // NOT REACHED
+}
+
+/*
+ * Make one pass of the event loop: wait up to timeout milliseconds
+ * (forever if negative) for events, handle them, and draw the frame.
+ */
+void mainloop_step(int timeout) {
+    struct epoll_event events[MAX_EVENTS];
+    int attached = 0;
+
+    int n = epoll_wait(epoll_fd, events, MAX_EVENTS, timeout);
+    if(n == -1) {
+	if(errno == EINTR)
+	    return;
+	exit_error();
+    }
+    for(int i = 0; i < n; i++) {
+	void *ptr = events[i].data.ptr;
+	if(ptr == &clock_fd) {
+	    uint64_t expirations;
+	    if(read(clock_fd, &expirations, sizeof(expirations)) > 0) {
+		status_tick(expirations);
+		help_tick();
+		log_tick();
+	    }
+	    if(input_held)
+		held_ticks++;
+	} else if(ptr == &signal_fd) {
+	    handle_signals();
+	} else if(ptr == &pool_fd) {
+	    handle_pool();
+	} else if(ptr == &listen_fd) {
+	    attach();
+	    attached = 1;
+	} else if(ptr == &client_fd) {
+	    // Events later in this batch for &client_fd after an attach
+	    // are about the client just detached, not the new one.
+	    if(attached)
+		continue;
+	    if(events[i].events & (EPOLLHUP | EPOLLERR))
+		mainloop_detach();
+	    else if(events[i].events & EPOLLIN)
+		handle_input();
+	} else if(ptr == &stdin_fd) {
+	    handle_input();
+	} else if(!((SESSION *)ptr)->dead) {
+	    // Sessions killed or exited while handling this batch stay
+	    // allocated until the end of the pass, so that any events
+	    // still to come for them can be recognized and skipped.
+	    handle_session(ptr, events[i].events);
+	}
+    }
+
+    // Hook called to do any other processing (such as dealing with
+    // terminated sessions) that must be taken care of.
+    do_other_processing();
+
+    // Input held back for a paused foreground session is taken up
+    // again once the session catches up, or is switched away from,
+    // or has been paused for too long.
+    if(fg_session == NULL || !fg_session->paused)
+	held_ticks = 0;
+    if(input_held && (held_ticks == 0 || held_ticks >= HOLD_TICKS)) {
+	hold_input(0);
+	handle_input();
+    }
+
+    // Only the sessions shown in panes are drawn.  The others just
+    // keep their virtual screens up to date, and are drawn in full
+    // when they are shown in a pane.
+    unsigned long t = stats_clock();
+    layout_sync();
+    status_render();
+
+    // Everything drawn while handling this batch of events goes
+    // out to the terminal as one update.  A client that is not
+    // taking its output is watched until it is ready for more.
+    int sent = vscreen_frame();
+    stats_frame(sent, stats_clock() - t);
+    if(client_fd >= 0 && (renderer->pending() > 0) != output_held) {
+	output_held = !output_held;
+	input_events();
+    }
+}
 
+/*
+ * Helper function to register a file descriptor for input events.
+ */
+static void watch(int fd, void *ptr) {
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = ptr;
+    if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1)
+	exit_error();
+}
+
+/*
+ * Helper function to update the events watched for on the terminal,
+ * or the attached client.
+ */
+static void input_events(void) {
+    struct epoll_event ev;
+    ev.events = input_held ? 0 : EPOLLIN;
+    if(server_mode) {
+	if(client_fd < 0)
+	    return;
+	if(output_held)
+	    ev.events |= EPOLLOUT;
+	ev.data.ptr = &client_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, client_fd, &ev);
+    } else {
+	ev.data.ptr = &stdin_fd;
+	epoll_ctl(epoll_fd, EPOLL_CTL_MOD, stdin_fd, &ev);
+    }
+}
+
+/*
+ * Helper function to stop or resume watching the terminal for input.
+ */
+static void hold_input(int hold) {
+    input_held = hold;
+    input_events();
+}
+
+/*
+ * Helper function to start the status line clock, ticking on each
+ * whole second of wall-clock time.
+ */
+static void clock_arm(void) {
+    struct itimerspec its;
+    clock_gettime(CLOCK_REALTIME, &its.it_value);
+    its.it_value.tv_sec++;
+    its.it_value.tv_nsec = 0;
+    its.it_interval.tv_sec = 1;
+    its.it_interval.tv_nsec = 0;
+    if(timerfd_settime(clock_fd, TFD_TIMER_ABSTIME, &its, NULL) == -1)
+	exit_error();
+}
+
+/*
+ * Helper function to accept a client connecting to a server.  A client
+ * already attached is detached, so that a session left attached on a
+ * dead connection can be taken over.  The new client is sent a full
+ * frame, and after that only what changes.
+ */
+static void attach(void) {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd == -1)
+	return;
+    mainloop_detach();
+    client_fd = render_fd = fd;
+    watch(client_fd, &client_fd);
+    renderer->invalidate();
+    set_status("Attached");
+}
+
+/*
+ * Helper function to read a key typed on the terminal, or by the
+ * attached client.  Returns ERR if there are none to be had yet.
+ * The client's keys come in packets (see server.h), and the other
+ * packets it sends are acted on as they are come across.
+ */
+static int next_key(void) {
+    if(!server_mode)
+	return wgetch(main_screen);
     while(1) {
-	int c = wgetch(main_screen);
-	if(c != ERR) {
-	    // If command escape -- process command
-	    if(c == COMMAND_ESCAPE) {
-		// Temporarily disable non-blocking I/O to make it
-		// easier to collect the rest of the command.
-		nodelay(main_screen, FALSE);
-		do_command();
-		// Restore non-blocking I/O before returing.
-		nodelay(main_screen, TRUE);
-	    } else {
-		// Write char to pty of foreground session -- as if typed.
-		session_putc(fg_session, c);
+	unsigned char *p = client_input + client_pos;
+	int avail = client_len - client_pos;
+	if(client_keys > 0 && avail > 0) {
+	    client_keys--;
+	    client_pos++;
+	    return *p;
+	}
+	if(client_keys == 0 && avail >= 2 &&
+	   (p[0] == PACKET_KEYS || avail >= 2 + p[1])) {
+	    client_pos += 2;
+	    if(p[0] == PACKET_KEYS) {
+		client_keys = p[1];
+		continue;
 	    }
+	    if(p[0] == PACKET_SIZE && p[1] >= 4)
+		resize_screen(p[2] << 8 | p[3], p[4] << 8 | p[5]);
+	    client_pos += p[1];
+	    continue;
 	}
 
-	// Hook called to do any other processing (such as dealing with
-	// terminated sessions) that must be taken care of.
-	do_other_processing();
-
-	// Check each session to see if there is output to read.
-	// Maybe we only really have to do this for foreground session.
-	// But we still need to use select to be responsive to command escapes.
-	tv.tv_sec = 0;
-	tv.tv_usec = 10000;
-	FD_ZERO(&fds);
-	int nfds = setfds(&fds);
-	int s;
-	if((s = select(nfds, &fds, NULL, NULL, &tv)) > 0) {
-	    for(int i = 0; i < MAX_SESSIONS; i++) {
-		SESSION *session = sessions[i];
-		if(session != NULL && FD_ISSET(session->ptyfd, &fds)) {
-		    char buf[100];
-		    int n = session_read(session, buf, sizeof(buf));
-		    if(n == EOF) {
-			// This can occur if the session leader terminates,
-			// leaving no process on the slave side of the pty.
-			// To avoid spinning until the session has been
-			// properly cleaned up, we set an error flag so that
-			// this session will be ignored by select().
-			session->error = 1;
-		    } else {
-			for(char *bp = buf; n > 0; n--) {
-			    vscreen_putc(session->vscreen, *bp++);
-			    vscreen_sync(session->vscreen);
-			}
-		    }
+	// The rest of the packet is still to come.
+	if(client_fd < 0)
+	    return ERR;
+	memmove(client_input, p, avail);
+	client_pos = 0;
+	client_len = avail;
+	ssize_t n = read(client_fd, client_input + avail,
+			 sizeof(client_input) - avail);
+	if(n <= 0) {
+	    if(n == 0 || (errno != EAGAIN && errno != EINTR))
+		mainloop_detach();
+	    return ERR;
+	}
+	client_len += n;
+    }
+}
+
+/*
+ * Helper function to put back the key last read by next_key().
+ */
+static void unget_key(int c) {
+    if(server_mode) {
+	client_pos--;
+	client_keys++;
+    } else {
+	ungetch(c);
+    }
+}
+
+/*
+ * Helper function to consume all pending input from the terminal.
+ * Keys typed for the foreground session are queued, and written to its
+ * pty together once all the pending input has been read, so that text
+ * pasted into the terminal goes to the session in a few large writes.
+ * If the session stops reading, so that its input is paused, the rest
+ * of the terminal input is left unread until it catches up; only if
+ * that takes more than HOLD_TICKS seconds are its keys refused, so
+ * that the user can still give commands.
+ */
+static void handle_input(void) {
+    int c;
+    int refused = 0;
+    while((c = next_key()) != ERR) {
+	if(command) {
+	    // The rest of a command.
+	    command = do_command(c);
+	} else if(c == COMMAND_ESCAPE) {
+	    // If command escape -- process command.  Keys typed before
+	    // the command go to the session they were typed for, before
+	    // it can be switched or killed.
+	    session_flush(fg_session);
+	    set_status("");
+	    command = 1;
+	} else if(helpmode && c == 27) {
+	    // ESC dismisses the help screen.
+	    help_leave();
+	} else {
+	    // Typing returns the view from any scrollback to the screen.
+	    int back = vscreen_scrolled(fg_session->vscreen);
+	    if(back > 0)
+		vscreen_scroll(fg_session->vscreen, -back);
+	    // Queue char for pty of foreground session -- as if typed.
+	    if(session_putc(fg_session, c) == EOF) {
+		if(held_ticks < HOLD_TICKS) {
+		    unget_key(c);
+		    hold_input(1);
+		    break;
 		}
+		refused = 1;
 	    }
 	}
     }
-    // NOT REACHED
+    if(refused)
+	renderer->bell();
+    if(fg_session != NULL)
+	session_flush(fg_session);
+}
+
+/*
+ * Helper function to act on the signals queued on the signalfd.
+ */
+static void handle_signals(void) {
+    struct signalfd_siginfo si;
+    while(read(signal_fd, &si, sizeof(si)) == sizeof(si)) {
+	if(si.ssi_signo == SIGCHLD) {
+	    session_reap();
+	} else if(si.ssi_signo == SIGWINCH && !server_mode) {
+	    struct winsize ws;
+	    if(ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == 0)
+		resize_screen(ws.ws_row, ws.ws_col);
+	} else if(si.ssi_signo == SIGUSR1) {
+	    stats_dump();
+	}
+    }
 }
 
 /*
- * Helper function to initialize a set of file descriptors for select().
+ * Helper function to transfer available output from a session pty
+ * to its virtual screen.  The physical screen is brought up to date
+ * once the whole batch of events has been handled.
  */
-int setfds(fd_set *fds) {
-    int max = -1;
-    for(int i = 0; i < MAX_SESSIONS; i++) {
-	SESSION *session = sessions[i];
-	if(session != NULL && !session->error) {
-	    FD_SET(session->ptyfd, fds);
-	    max = session->ptyfd;
+static void handle_session(SESSION *session, uint32_t events) {
+    if(events & EPOLLOUT)
+	session_flush(session);
+    if(pool_fd != -1) {
+	// Output is left to a worker, and the pty watched again once
+	// it is done.  Until then, only input is written to it.
+	if(session->busy)
+	    return;
+	if(events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+	    session->events = events;
+	    pool_post(session);
+	} else {
+	    pty_events(session, EPOLL_CTL_MOD);
 	}
+	return;
     }
-    return max+1;
+    int n = session_drain(session);
+    if(n == EOF || (n == 0 && (events & (EPOLLHUP | EPOLLERR)))) {
+	// This can occur if the session leader terminates,
+	// leaving no process on the slave side of the pty.
+	// To avoid spinning until the leader has been reaped
+	// and the session torn down (see session_reap()), we set
+	// an error flag and stop watching the pty.
+	session->error = 1;
+	mainloop_unwatch(session);
+    }
+}
+
+/*
+ * Helper function to take back the sessions that the workers have
+ * finished draining, finishing off what handle_session() does without
+ * a worker pool.
+ */
+static void handle_pool(void) {
+    SESSION *next;
+    for(SESSION *session = pool_collect(); session != NULL; session = next) {
+	next = session->pool_next;
+	if(session_idle(session))
+	    continue;
+	session_answer(session);
+	int n = session->drained;
+	if(n == EOF || (n == 0 && (session->events & (EPOLLHUP | EPOLLERR)))) {
+	    session->error = 1;
+	    mainloop_unwatch(session);
+	} else {
+	    pty_events(session, EPOLL_CTL_MOD);
+	}
+    }
+}
+
+/*
+ * Helper function to register or update the events watched for on the
+ * pty of a session: output, and whether it is writable while input
+ * is waiting to be written.  With a worker pool, each event ends the
+ * watch until the session is watched again.
+ */
+static void pty_events(SESSION *session, int op) {
+    struct epoll_event ev;
+    // Without an event loop, the session is driven by batch mode.
+    if(epoll_fd == -1)
+	return;
+    ev.events = session->wwatch ? EPOLLIN | EPOLLOUT : EPOLLIN;
+    if(pool_fd != -1)
+	ev.events |= EPOLLONESHOT;
+    ev.data.ptr = session;
+    if(epoll_ctl(epoll_fd, op, session->ptyfd, &ev) == -1 &&
+       op == EPOLL_CTL_ADD)
+	exit_error();
 }
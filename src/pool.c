@@ -0,0 +1,119 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "ecran.h"
+#include "pool.h"
+
+/*
+ * The worker pool.
+ *
+ * When a session pty has output, the main loop stops watching it and
+ * posts the session to the pool.  The first idle worker takes it,
+ * drains the pty into the session's virtual screen with session_parse(),
+ * and hands it back.  Only one worker has a session at a time, and the
+ * main thread leaves its pty and read buffer alone until it is handed
+ * back; the virtual screen has a lock of its own, held by the worker
+ * only while parsing a slice of output, and by the main thread only
+ * while copying out what it is about to draw (see vscreen_sync()).
+ *
+ * Sessions are posted on a queue under a lock, which is held for no
+ * more than a few instructions.  They are handed back on a lock-free
+ * stack, which the main thread empties in one go after an eventfd that
+ * it watches has woken it.
+ */
+
+int pool_threads = -1;            // Number of workers, or -1 to choose.
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t posted = PTHREAD_COND_INITIALIZER;
+static SESSION *queue_head, *queue_tail;   // Sessions to be drained.
+static SESSION *done;                      // Sessions drained.
+static int done_fd = -1;
+
+static void *worker(void *arg);
+
+/*
+ * Start the workers, one fewer than the number of processors (up to
+ * POOL_THREADS) unless a number has been set in pool_threads.  With
+ * no workers, sessions are drained by the main thread.  This must be
+ * called with the signals handled by the main loop already blocked,
+ * so that the workers block them as well.  Returns the descriptor to
+ * watch for sessions being handed back, or -1 if there are no workers.
+ */
+int pool_init(void) {
+    if(pool_threads < 0) {
+	long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	pool_threads = cpus - 1 < POOL_THREADS ? cpus - 1 : POOL_THREADS;
+	if(pool_threads < 0)
+	    pool_threads = 0;
+    }
+    if(pool_threads == 0)
+	return -1;
+    if((done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+	exit_error();
+    for(int i = 0; i < pool_threads; i++) {
+	pthread_t thread;
+	if(pthread_create(&thread, NULL, worker, NULL) != 0)
+	    exit_error();
+	pthread_detach(thread);
+    }
+    return done_fd;
+}
+
+/*
+ * Hand a session whose pty has output to the workers.
+ */
+void pool_post(SESSION *session) {
+    session->busy = 1;
+    session->pool_next = NULL;
+    pthread_mutex_lock(&lock);
+    if(queue_tail != NULL)
+	queue_tail->pool_next = session;
+    else
+	queue_head = session;
+    queue_tail = session;
+    pthread_cond_signal(&posted);
+    pthread_mutex_unlock(&lock);
+}
+
+/*
+ * Take back the sessions the workers are done with, as a list linked
+ * through pool_next, in no particular order.  Their busy flags are
+ * left for the caller to clear.
+ */
+SESSION *pool_collect(void) {
+    uint64_t count;
+    if(read(done_fd, &count, sizeof(count)) == -1)
+	return NULL;
+    return __atomic_exchange_n(&done, NULL, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Helper function run by each worker thread.
+ */
+static void *worker(void *arg) {
+    uint64_t one = 1;
+    while(1) {
+	pthread_mutex_lock(&lock);
+	while(queue_head == NULL)
+	    pthread_cond_wait(&posted, &lock);
+	SESSION *session = queue_head;
+	if((queue_head = session->pool_next) == NULL)
+	    queue_tail = NULL;
+	pthread_mutex_unlock(&lock);
+
+	session->drained = session_parse(session);
+
+	session->pool_next = __atomic_load_n(&done, __ATOMIC_RELAXED);
+	while(!__atomic_compare_exchange_n(&done, &session->pool_next, session,
+					   1, __ATOMIC_RELEASE,
+					   __ATOMIC_RELAXED))
+	    ;
+	write(done_fd, &one, sizeof(one));
+    }
+    return NULL;
+}
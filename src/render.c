@@ -0,0 +1,145 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <locale.h>
+#include <langinfo.h>
+#include "render.h"
+#include "unicode.h"
+
+/*
+ * Selection of the renderer, and drawing helpers common to all of them.
+ * The renderers themselves live in render_curses.c and render_ansi.c,
+ * apart from the null renderer below, which draws nothing at all and
+ * serves to measure the cost of everything up to the renderer.
+ */
+
+struct renderer *renderer = &render_curses;
+
+/*
+ * File descriptor to which renderers that do their own output write.
+ */
+int render_fd = STDOUT_FILENO;
+
+/*
+ * Whether the terminal takes UTF-8, so that characters past ASCII can
+ * be drawn as they are.
+ */
+int render_unicode;
+
+static uint32_t base_char(uint32_t ch);
+
+static struct renderer *renderers[] = {
+    &render_curses, &render_ansi, &render_null
+};
+#define NUM_RENDERERS (sizeof(renderers) / sizeof(renderers[0]))
+
+/*
+ * Find a renderer by name.  Returns NULL if there is none by that name.
+ */
+struct renderer *render_find(char *name) {
+    for(int i = 0; i < NUM_RENDERERS; i++)
+	if(strcmp(renderers[i]->name, name) == 0)
+	    return renderers[i];
+    return NULL;
+}
+
+/*
+ * Take the character set of the terminal from the locale, as curses
+ * does.  Until this is called, characters past ASCII are drawn as '?'.
+ */
+void render_locale(void) {
+    setlocale(LC_CTYPE, "");
+    render_unicode = strcmp(nl_langinfo(CODESET), "UTF-8") == 0;
+}
+
+/*
+ * Return the character to draw for cell i of n cells that are drawn
+ * together.  Blank cells, either half of a wide character whose other
+ * half is not there, and control characters are drawn as spaces or
+ * '?', and characters past ASCII as '?' unless the terminal takes
+ * UTF-8.  The second half of a wide character drawn whole is not
+ * drawn, and 0 is returned for it.  A cluster is returned as it is, to
+ * be drawn as the code points vscreen_chars() gives for it, unless the
+ * terminal does not take UTF-8, when its marks are left out.
+ */
+uint32_t render_char(const CELL *cells, int i, int n) {
+    uint32_t ch = CELL_CHAR(cells[i]);
+    if(ch >= ' ' && ch <= '~')
+	return ch;
+    if(ch == 0)
+	return ' ';
+    if(ch == CELL_WIDE)
+	return render_unicode && i > 0 &&
+	    unicode_width(base_char(CELL_CHAR(cells[i - 1]))) == 2 ? 0 : ' ';
+    uint32_t base = base_char(ch);
+    if(base < ' ' || (base > '~' && (base < 0xa0 || !render_unicode)))
+	return '?';
+    if(!render_unicode)
+	return base;
+    if(unicode_width(base) == 2 &&
+       (i + 1 == n || CELL_CHAR(cells[i + 1]) != CELL_WIDE))
+	return ' ';
+    return ch;
+}
+
+/*
+ * Draw a string in the default attributes, as for the status line,
+ * blanking the rest of the line up to column clear_to.  Whatever does
+ * not fit on the line is cut off.
+ */
+void render_text(int line, int col, char *text, int clear_to) {
+    if(col < 0 || col >= COLS)
+	return;
+    CELL cells[COLS];
+    int n = 0;
+    while(text[n] != '\0' && col + n < COLS) {
+	cells[n] = CELL((unsigned char)text[n], 0);
+	n++;
+    }
+    renderer->put(line, col, cells, n, clear_to);
+}
+
+/*
+ * Helper function to return the character of a cell, or the first of a
+ * cluster, by which it is drawn as wide as it is.
+ */
+static uint32_t base_char(uint32_t ch) {
+    uint32_t chars[CLUSTER_CHARS];
+    vscreen_chars(ch, chars);
+    return chars[0];
+}
+
+static void null_init(void) {
+}
+
+static void null_blank(int line, int col, int lines, int cols) {
+}
+
+static void null_put(int line, int col, const CELL *cells, int n,
+		     int clear_to) {
+}
+
+static void null_cursor(int line, int col) {
+}
+
+static int null_frame(void) {
+    return 0;
+}
+
+static int null_pending(void) {
+    return 0;
+}
+
+struct renderer render_null = {
+    .name = "null",
+    .init = null_init,
+    .fini = null_init,
+    .blank = null_blank,
+    .put = null_put,
+    .cursor = null_cursor,
+    .bell = null_init,
+    .frame = null_frame,
+    .pending = null_pending,
+    .invalidate = null_init,
+    .resize = null_init,
+};
@@ -0,0 +1,507 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdarg.h>
+#include "ecran.h"
+#include "render.h"
+#include "unicode.h"
+
+/*
+ * The direct ANSI renderer.  What the terminal is to show is staged in
+ * one grid of cells, and what it does show is remembered in another.
+ * Each frame, the lines that have been drawn on are compared with what
+ * is on the terminal, and only the cells that differ are sent, together
+ * with the cursor movements and SGR sequences needed to place them.
+ * When the screen as a whole has scrolled, that is done with a single
+ * scroll of the terminal before the comparison.  The output of a frame
+ * is collected in one buffer and written with a single write(), between
+ * the begin and end markers of synchronized output (mode 2026), so that
+ * terminals that know the mode show each frame all at once.
+ *
+ * The terminal may be a client attached to a server (see server.c),
+ * which is written to without blocking.  While it is not taking its
+ * output, frames are not drawn; changes keep accumulating in the staged
+ * grid, and are sent together once it has caught up.
+ *
+ * This assumes an ANSI (ECMA-48) terminal with 256 colors, such as
+ * xterm, whatever the terminal description says.  Characters past
+ * ASCII are sent in UTF-8 if the locale says the terminal takes it
+ * (see render_char()).
+ */
+
+/*
+ * Length of the longest run of unchanged cells that is written out
+ * again, rather than moved over, when it lies between changed cells.
+ */
+#define MAX_GAP 4
+
+/*
+ * Length of the shortest run of the same cell that is written with a
+ * repeat (REP), where the terminal has it.
+ */
+#define MIN_REPEAT 6
+
+/*
+ * Number of lines a frame must draw before it is sent between the
+ * synchronized output markers.  Smaller frames (even with a scroll,
+ * which the terminal does at once) are over too quickly to be seen
+ * half drawn, and are sent as they are.
+ */
+#define SYNC_LINES 3
+
+static int lines, cols;
+static CELL *back;               // What the terminal is to show.
+static CELL *front;              // What the terminal shows.
+static unsigned char *touched;   // Lines of back drawn on since the last frame.
+static int need_clear;           // Clear the terminal before the next frame.
+static int cursor_line, cursor_col;
+static int term_line, term_col;  // Where the terminal cursor is, or -1.
+static int term_attr;            // The attributes the terminal has set, or -1.
+static int have_rep;             // The terminal can repeat a character.
+
+static int ring;                 // Ring the bell with the next frame.
+
+static char *out;
+static size_t out_len, out_size;
+static size_t out_done;          // Bytes of the output already written.
+
+static void alloc_grids(void);
+static void scroll_screen(void);
+static int draw_line(int l);
+static void move_to(int l, int c);
+static void set_attr(int index);
+static void emit(const char *s, size_t n);
+static void emitf(const char *fmt, ...);
+static void flush_out(void);
+static uint64_t hash_line(const CELL *line);
+
+static void ansi_invalidate(void);
+
+/*
+ * Start with the terminal cleared.  If curses is in use (to read
+ * input) it has drawn on the terminal while starting up, and is given
+ * the chance to finish doing so first, so that it has nothing left to
+ * draw later.
+ */
+static void ansi_init(void) {
+    if(main_screen != NULL) {
+	wnoutrefresh(main_screen);
+	wnoutrefresh(status_screen);
+	doupdate();
+    }
+    alloc_grids();
+    char *rep = tigetstr("rep");
+    have_rep = rep != NULL && rep != (char *)-1;
+    ansi_invalidate();
+}
+
+/*
+ * The grids are made the new size, and the terminal cleared with the
+ * next frame.  Output not yet written when the terminal was resized
+ * still goes out first, so that no sequence is left cut short.
+ */
+static void ansi_resize(void) {
+    free(back);
+    free(front);
+    free(touched);
+    alloc_grids();
+    memset(touched, 1, lines);
+    need_clear = 1;
+    term_line = term_col = -1;
+}
+
+static void ansi_fini(void) {
+    free(back);
+    free(front);
+    free(touched);
+    free(out);
+    back = front = NULL;
+    touched = NULL;
+    out = NULL;
+    out_len = out_size = out_done = 0;
+}
+
+static void ansi_blank(int line, int col, int nlines, int ncols) {
+    if(col + ncols > cols)
+	ncols = cols - col;
+    for(int l = line; l < line + nlines && l < lines; l++) {
+	memset(back + (size_t)l * cols + col, 0, ncols * sizeof(CELL));
+	touched[l] = 1;
+    }
+}
+
+static void ansi_put(int line, int col, const CELL *cells, int n,
+		     int clear_to) {
+    if(line < 0 || line >= lines || col >= cols)
+	return;
+    CELL *b = back + (size_t)line * cols;
+    if(col + n > cols)
+	n = cols - col;
+    if(clear_to > cols)
+	clear_to = cols;
+    memcpy(b + col, cells, n * sizeof(CELL));
+    if(col + n < clear_to)
+	memset(b + col + n, 0, (clear_to - col - n) * sizeof(CELL));
+    touched[line] = 1;
+}
+
+static void ansi_cursor(int line, int col) {
+    cursor_line = line;
+    cursor_col = col;
+}
+
+static void ansi_bell(void) {
+    ring = 1;
+}
+
+static int ansi_frame(void) {
+    static const char begin[] = "\033[?2026h", end[] = "\033[?2026l";
+    int changed = 0;
+    if(render_fd < 0)
+	return -1;
+    if(out_done < out_len) {
+	flush_out();
+	if(out_done < out_len)
+	    return -1;
+    }
+    out_len = out_done = 0;
+    emit(begin, sizeof(begin) - 1);
+    if(ring) {
+	ring = 0;
+	emit("\a", 1);
+    }
+    if(need_clear) {
+	need_clear = 0;
+	set_attr(0);
+	emit("\033[H\033[2J", 7);
+	term_line = term_col = 0;
+	memset(front, 0, (size_t)lines * cols * sizeof(CELL));
+	changed = lines;
+    }
+    scroll_screen();
+    for(int l = 0; l < lines; l++) {
+	if(touched[l]) {
+	    touched[l] = 0;
+	    changed += draw_line(l);
+	}
+    }
+    move_to(cursor_line, cursor_col);
+    if(out_len == sizeof(begin) - 1) {
+	out_len = 0;
+	return 0;
+    }
+    if(changed >= SYNC_LINES)
+	emit(end, sizeof(end) - 1);
+    else
+	out_done = sizeof(begin) - 1;
+    flush_out();
+    return 1;
+}
+
+static int ansi_pending(void) {
+    return out_len - out_done;
+}
+
+/*
+ * Anything could be on the terminal, so it is cleared and all of it
+ * drawn again.  This makes a full frame as short as the terminal can be
+ * told it: blank cells cost nothing, and runs of the same cell little.
+ */
+static void ansi_invalidate(void) {
+    out_len = out_done = 0;
+    memset(touched, 1, lines);
+    need_clear = 1;
+    term_line = term_col = -1;
+    term_attr = -1;
+}
+
+struct renderer render_ansi = {
+    .name = "ansi",
+    .init = ansi_init,
+    .fini = ansi_fini,
+    .blank = ansi_blank,
+    .put = ansi_put,
+    .cursor = ansi_cursor,
+    .bell = ansi_bell,
+    .frame = ansi_frame,
+    .pending = ansi_pending,
+    .invalidate = ansi_invalidate,
+    .resize = ansi_resize,
+};
+
+/*
+ * Helper function to allocate the grids for a terminal of LINES by COLS.
+ */
+static void alloc_grids(void) {
+    lines = LINES;
+    cols = COLS;
+    back = calloc(sizeof(CELL), (size_t)lines * cols);
+    front = calloc(sizeof(CELL), (size_t)lines * cols);
+    touched = calloc(1, lines);
+    if(back == NULL || front == NULL || touched == NULL)
+	exit_error();
+}
+
+/*
+ * Helper function to look for the screen (the lines above the status
+ * line) having scrolled up or down as a whole, as it does when a program
+ * writes out lines faster than frames are drawn.  Lines are compared by
+ * hash, and if more of them are found some distance from where they are
+ * on the terminal than are found where they are, the terminal is made to
+ * scroll by that distance.  Blank lines are left out of the count, since
+ * they match wherever they are.
+ */
+static void scroll_screen(void) {
+    int n = lines - 1;
+    int count = 0;
+    for(int l = 0; l < n; l++)
+	count += touched[l] && memcmp(back + (size_t)l * cols,
+				      front + (size_t)l * cols,
+				      cols * sizeof(CELL)) != 0;
+    if(n < 4 || count < n / 2)
+	return;
+
+    uint64_t bh[n], fh[n];
+    uint64_t blank = hash_line(NULL);
+    for(int l = 0; l < n; l++) {
+	bh[l] = hash_line(back + (size_t)l * cols);
+	fh[l] = hash_line(front + (size_t)l * cols);
+    }
+    int best = 0, best_k = 0;
+    for(int l = 0; l < n; l++)
+	best += bh[l] == fh[l] && bh[l] != blank;
+    for(int k = 1; k <= n / 2; k++) {
+	int up = 0, down = 0;
+	for(int l = 0; l + k < n; l++) {
+	    up += bh[l] == fh[l + k] && bh[l] != blank;
+	    down += bh[l + k] == fh[l] && fh[l] != blank;
+	}
+	if(up > best) {
+	    best = up;
+	    best_k = k;
+	}
+	if(down > best) {
+	    best = down;
+	    best_k = -k;
+	}
+    }
+    if(best_k == 0)
+	return;
+
+    // Lines scrolled in are blanked in the current background color.
+    int k = best_k > 0 ? best_k : -best_k;
+    set_attr(0);
+    emitf("\033[1;%dr\033[%d%c\033[r", n, k, best_k > 0 ? 'S' : 'T');
+    term_line = term_col = 0;
+    size_t row = (size_t)cols * sizeof(CELL);
+    if(best_k > 0) {
+	memmove(front, front + (size_t)k * cols, (n - k) * row);
+	memset(front + (size_t)(n - k) * cols, 0, k * row);
+    } else {
+	memmove(front + (size_t)k * cols, front, (n - k) * row);
+	memset(front, 0, k * row);
+    }
+    memset(touched, 1, n);
+}
+
+/*
+ * Helper function to send the cells of line l that differ from what is
+ * on the terminal.  Blank cells at the end of the line are cleared with
+ * a single erase, if anything is there to be erased.  Returns whether
+ * anything was sent.
+ */
+static int draw_line(int l) {
+    CELL *b = back + (size_t)l * cols;
+    CELL *f = front + (size_t)l * cols;
+    int end = cols;
+    while(end > 0 && b[end - 1] == 0)
+	end--;
+
+    size_t start = out_len;
+    int c = 0;
+    while(c < end) {
+	if(b[c] == f[c]) {
+	    c++;
+	    continue;
+	}
+	move_to(l, c);
+	while(c < end) {
+	    if(b[c] == f[c]) {
+		// A short run of unchanged cells is cheaper to write out
+		// again than to move over.
+		int k = c;
+		while(k < end && b[k] == f[k] && k - c < MAX_GAP)
+		    k++;
+		if(k == end || k - c == MAX_GAP)
+		    break;
+	    }
+	    CELL cell = b[c];
+	    uint32_t ch = render_char(b, c, cols);
+	    c++;
+	    // The second half of a wide character was drawn with it.
+	    if(ch == 0)
+		continue;
+	    set_attr(CELL_ATTR(cell));
+	    char s[CELL_TEXT_MAX];
+	    int len = 1;
+	    s[0] = ch;
+	    if(ch >= 0x80) {
+		uint32_t chars[CLUSTER_CHARS];
+		int k = vscreen_chars(ch, chars);
+		len = 0;
+		for(int j = 0; j < k; j++)
+		    len += utf8_encode(s + len, chars[j]);
+	    }
+	    emit(s, len);
+	    // REP repeats the last character, which for a cluster is not
+	    // the whole of it on every terminal.
+	    if(have_rep && ch < CELL_CLUSTER) {
+		int k = c;
+		while(k < end && b[k] == cell)
+		    k++;
+		if(k - c >= MIN_REPEAT) {
+		    emitf("\033[%db", k - c);
+		    c = k;
+		}
+	    }
+	}
+	// After the last column the terminal is waiting to wrap, and
+	// where the cursor is depends on the terminal.
+	term_col = c < cols ? c : -1;
+    }
+
+    int stale = end;
+    while(stale < cols && f[stale] == 0)
+	stale++;
+    if(stale < cols) {
+	move_to(l, end);
+	set_attr(0);
+	emit("\033[K", 3);
+    }
+    memcpy(f, b, cols * sizeof(CELL));
+    return out_len > start;
+}
+
+/*
+ * Helper function to move the terminal cursor, by the shortest of the
+ * sequences that will do.
+ */
+static void move_to(int l, int c) {
+    if(l == term_line && c == term_col)
+	return;
+    if(c == 0 && l == term_line + 1 && term_line >= 0)
+	emit("\r\n", 2);
+    else if(c == 0 && l == term_line)
+	emit("\r", 1);
+    else if(c == term_col - 1 && l == term_line)
+	emit("\b", 1);
+    else if(l == term_line && term_col >= 0)
+	emitf("\033[%dG", c + 1);
+    else if(c == 0)
+	emitf("\033[%dH", l + 1);
+    else
+	emitf("\033[%d;%dH", l + 1, c + 1);
+    term_line = l;
+    term_col = c;
+}
+
+/*
+ * Helper function to set the attributes of the cells that follow,
+ * from scratch, since it is never longer than turning some off.
+ */
+static void set_attr(int index) {
+    static const struct { int flag, sgr; } flags[] = {
+	{ ATTR_BOLD, 1 }, { ATTR_DIM, 2 }, { ATTR_ITALIC, 3 },
+	{ ATTR_UNDERLINE, 4 }, { ATTR_BLINK, 5 }, { ATTR_REVERSE, 7 },
+	{ ATTR_INVISIBLE, 8 },
+    };
+    if(index == term_attr)
+	return;
+    term_attr = index;
+    if(index == 0) {
+	emit("\033[m", 3);
+	return;
+    }
+
+    const struct cell_attr *a = vscreen_attr(index);
+    char sgr[64];
+    int n = sprintf(sgr, "\033[0");
+    for(int i = 0; i < sizeof(flags) / sizeof(flags[0]); i++)
+	if(a->flags & flags[i].flag)
+	    n += sprintf(sgr + n, ";%d", flags[i].sgr);
+    int colors[2] = { a->fg, a->bg };
+    for(int i = 0; i < 2; i++) {
+	int c = colors[i];
+	if(c == COLOR_DEFAULT)
+	    continue;
+	if(c < 8)
+	    n += sprintf(sgr + n, ";%d", (i ? 40 : 30) + c);
+	else if(c < 16)
+	    n += sprintf(sgr + n, ";%d", (i ? 100 : 90) + c - 8);
+	else
+	    n += sprintf(sgr + n, ";%d;5;%d", i ? 48 : 38, c);
+    }
+    sgr[n++] = 'm';
+    emit(sgr, n);
+}
+
+/*
+ * Helper functions to add to the output of the current frame.
+ */
+static void emit(const char *s, size_t n) {
+    if(out_len + n > out_size) {
+	size_t size = out_size ? out_size : 16384;
+	while(size < out_len + n)
+	    size *= 2;
+	char *p = realloc(out, size);
+	if(p == NULL)
+	    exit_error();
+	out = p;
+	out_size = size;
+    }
+    memcpy(out + out_len, s, n);
+    out_len += n;
+}
+
+static void emitf(const char *fmt, ...) {
+    char buf[64];
+    va_list args;
+    va_start(args, fmt);
+    int n = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    emit(buf, n);
+}
+
+/*
+ * Helper function to write out as much of the frame as the terminal
+ * will take.  On an error the rest of the frame is dropped.
+ */
+static void flush_out(void) {
+    while(out_done < out_len) {
+	ssize_t n = write(render_fd, out + out_done, out_len - out_done);
+	if(n == -1) {
+	    if(errno == EINTR)
+		continue;
+	    if(errno != EAGAIN)
+		out_done = out_len;
+	    break;
+	}
+	out_done += n;
+    }
+}
+
+/*
+ * Helper function to hash the cells of a line, with NULL standing for
+ * a blank line.  FNV-1a, a cell at a time.
+ */
+static uint64_t hash_line(const CELL *line) {
+    uint64_t h = 14695981039346656037ULL;
+    for(int c = 0; c < cols; c++) {
+	h ^= line != NULL ? line[c] : 0;
+	h *= 1099511628211ULL;
+    }
+    return h;
+}
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <wchar.h>
+#include <ncurses.h>
+#include "render.h"
+
+/*
+ * The curses renderer.  The virtual screen is drawn in main_screen and
+ * the status line in status_screen, and curses works out what has to be
+ * sent to the terminal to bring it up to date, using whatever the
+ * terminal description offers (such as scrolling regions) to keep that
+ * short.  Cells are drawn as characters (chtype) where they are all
+ * ASCII, as most are, and otherwise as wide characters (cchar_t), for
+ * which ncursesw is needed.
+ */
+
+static int cursor_line, cursor_col;
+static int staged;    // Anything drawn since the last frame.
+
+static WINDOW *window_at(int line, int *row);
+static void clear_row(WINDOW *win, int row, int col, int to);
+static int color_pair(int fg, int bg);
+static chtype attr_chtype(int index);
+static void put_wide(WINDOW *win, const CELL *cells, int n);
+
+static void curses_init(void) {
+}
+
+static void curses_fini(void) {
+}
+
+static void curses_blank(int line, int col, int lines, int cols) {
+    staged = 1;
+    for(int l = line; l < line + lines; l++) {
+	int row;
+	WINDOW *win = window_at(l, &row);
+	clear_row(win, row, col, col + cols);
+    }
+}
+
+static void curses_put(int line, int col, const CELL *cells, int n,
+		       int clear_to) {
+    int row;
+    staged = 1;
+    WINDOW *win = window_at(line, &row);
+    chtype text[n + 1];
+    int i;
+    for(i = 0; i < n; i++) {
+	uint32_t ch = render_char(cells, i, n);
+	if(ch > '~' || ch == 0)
+	    break;
+	text[i] = ch | attr_chtype(CELL_ATTR(cells[i]));
+    }
+    text[i] = 0;
+    // waddchnstr() neither moves the cursor nor wraps, so
+    // the bottom-right cell can be written like any other.
+    wmove(win, row, col);
+    if(i == n)
+	waddchnstr(win, text, n);
+    else
+	put_wide(win, cells, n);
+    if(col + n < clear_to)
+	clear_row(win, row, col + n, clear_to);
+}
+
+static void curses_cursor(int line, int col) {
+    staged |= line != cursor_line || col != cursor_col;
+    cursor_line = line;
+    cursor_col = col;
+}
+
+static void curses_bell(void) {
+    staged = 1;
+    flash();
+}
+
+/*
+ * The main window is staged last, so the cursor is left where it
+ * belongs.  Curses works out for itself whether anything it was given
+ * to draw is not on the terminal already.
+ */
+static int curses_frame(void) {
+    int sent = staged;
+    staged = 0;
+    wnoutrefresh(status_screen);
+    wmove(main_screen, cursor_line, cursor_col);
+    wnoutrefresh(main_screen);
+    doupdate();
+    return sent;
+}
+
+/*
+ * Curses writes to the terminal as it pleases.
+ */
+static int curses_pending(void) {
+    return 0;
+}
+
+static void curses_invalidate(void) {
+    clearok(curscr, TRUE);
+}
+
+/*
+ * Curses has been told the new size, and the windows resized, by
+ * resize_screen().
+ */
+static void curses_resize(void) {
+}
+
+struct renderer render_curses = {
+    .name = "curses",
+    .init = curses_init,
+    .fini = curses_fini,
+    .blank = curses_blank,
+    .put = curses_put,
+    .cursor = curses_cursor,
+    .bell = curses_bell,
+    .frame = curses_frame,
+    .pending = curses_pending,
+    .invalidate = curses_invalidate,
+    .resize = curses_resize,
+};
+
+/*
+ * Helper function to find the window holding a line of the terminal,
+ * and the row of that window it is in.
+ */
+static WINDOW *window_at(int line, int *row) {
+    if(line < LINES - 1) {
+	*row = line;
+	return main_screen;
+    }
+    *row = 0;
+    return status_screen;
+}
+
+/*
+ * Helper function to blank columns col up to (but not including) to
+ * of a row of a window.
+ */
+static void clear_row(WINDOW *win, int row, int col, int to) {
+    wmove(win, row, col);
+    if(to >= getmaxx(win))
+	wclrtoeol(win);
+    else
+	for(int c = col; c < to; c++)
+	    waddch(win, ' ');
+}
+
+/*
+ * Helper function to find the color pair for a foreground and
+ * background color, allocating one if need be.  On terminals with
+ * fewer than 256 colors, colors are reduced to the nearest of the
+ * ones the terminal has.  Returns pair 0 (the default colors) once
+ * the terminal has run out of pairs.
+ */
+static int color_pair(int fg, int bg) {
+    static short pair_fg[256], pair_bg[256];
+    static int num_pairs = 1;
+    int colors[2] = { fg, bg };
+    for(int i = 0; i < 2; i++) {
+	int c = colors[i];
+	if(c == COLOR_DEFAULT || COLORS >= 256 || (c < 16 && c < COLORS))
+	    continue;
+	if(c < 16) {
+	    c -= 8;
+	} else if(c < 232) {
+	    // The 6x6x6 color cube: keep the components that are lit.
+	    c -= 16;
+	    c = (c / 36 >= 3 ? COLOR_RED : 0) |
+		(c / 6 % 6 >= 3 ? COLOR_GREEN : 0) |
+		(c % 6 >= 3 ? COLOR_BLUE : 0);
+	} else {
+	    c = c < 244 ? COLOR_BLACK : COLOR_WHITE;
+	}
+	colors[i] = c;
+    }
+    fg = colors[0];
+    bg = colors[1];
+    if(fg == COLOR_DEFAULT && bg == COLOR_DEFAULT)
+	return 0;
+
+    for(int p = 1; p < num_pairs; p++)
+	if(pair_fg[p] == fg && pair_bg[p] == bg)
+	    return p;
+    if(num_pairs >= 256 || num_pairs >= COLOR_PAIRS)
+	return 0;
+    if(init_pair(num_pairs, fg, bg) == ERR)
+	return 0;
+    pair_fg[num_pairs] = fg;
+    pair_bg[num_pairs] = bg;
+    return num_pairs++;
+}
+
+/*
+ * Helper function to translate an entry of the attribute table into
+ * curses attributes.  The translation is made once per entry.
+ */
+static chtype attr_chtype(int index) {
+    static chtype cache[MAX_ATTRS];
+    static unsigned char cached[MAX_ATTRS];
+    if(cached[index])
+	return cache[index];
+
+    const struct cell_attr *a = vscreen_attr(index);
+    chtype ch = 0;
+    if(a->flags & ATTR_BOLD)
+	ch |= A_BOLD;
+    if(a->flags & ATTR_DIM)
+	ch |= A_DIM;
+    if(a->flags & ATTR_ITALIC)
+	ch |= A_ITALIC;
+    if(a->flags & ATTR_UNDERLINE)
+	ch |= A_UNDERLINE;
+    if(a->flags & ATTR_BLINK)
+	ch |= A_BLINK;
+    if(a->flags & ATTR_REVERSE)
+	ch |= A_REVERSE;
+    if(a->flags & ATTR_INVISIBLE)
+	ch |= A_INVIS;
+    if(has_colors())
+	ch |= COLOR_PAIR(color_pair(a->fg, a->bg));
+    cache[index] = ch;
+    cached[index] = 1;
+    return ch;
+}
+
+/*
+ * Helper function to draw n cells at the cursor position of a window as
+ * wide characters, a wide character taking up two columns, and a
+ * cluster drawn as one, marks and all.
+ */
+static void put_wide(WINDOW *win, const CELL *cells, int n) {
+    cchar_t text[n];
+    int len = 0;
+    for(int i = 0; i < n; i++) {
+	uint32_t chars[CLUSTER_CHARS];
+	wchar_t ch[CLUSTER_CHARS + 1] = { 0 };
+	int k = vscreen_chars(render_char(cells, i, n), chars);
+	if(chars[0] == 0)
+	    continue;
+	for(int j = 0; j < k; j++)
+	    ch[j] = chars[j];
+	chtype attr = attr_chtype(CELL_ATTR(cells[i]));
+	setcchar(&text[len++], ch, attr & ~A_COLOR, PAIR_NUMBER(attr), NULL);
+    }
+    wadd_wchnstr(win, text, len);
+}
@@ -0,0 +1,286 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ecran.h"
+#include "log.h"
+#include "render.h"
+#include "status.h"
+#include "replay.h"
+
+/*
+ * Playback of recordings.
+ *
+ * ecran --replay file plays back a recording made with --record (see
+ * log.c): the output recorded is written to a virtual screen with
+ * vscreen_write(), as it was when it was read from the pty of the
+ * session, the screen is resized when the session's was, and it is all
+ * drawn by the renderer in use, as the event loop draws it (a screen
+ * recorded larger than the terminal is cut down to fit it).  Given
+ * --speed N, the output is played N times as fast as it was recorded
+ * (by default, as fast); given --speed max, as fast as it can be, with
+ * a frame drawn after each read of the recording, as the event loop
+ * draws one after each pass, so that the playback of a recording made
+ * in the wild doubles as a benchmark.  Otherwise a frame is drawn when
+ * the playback waits for the time of the next read, and at least every
+ * REPLAY_FRAME milliseconds.  Typing q stops the playback.  Once it is
+ * over (unless at max speed), what was played is left on the screen
+ * until q is typed.  Then the time the playback took is printed, with
+ * how fast it went.
+ */
+
+double replay_speed = 1;         // How much faster to play, or 0 for max.
+
+/*
+ * What is left of the recording being played, and what has been made
+ * of it so far.
+ */
+struct playback {
+    char *path;
+    const unsigned char *p, *end;
+    VSCREEN *vscreen;
+    unsigned long recorded_us;   // Time of the last record played.
+    unsigned long bytes, reads, gaps, frames;
+    unsigned long elapsed_ns;    // Time the playback took.
+};
+
+static struct playback playback;
+
+static int header(struct playback *pb);
+static void begin(struct playback *pb);
+static int read_varint(struct playback *pb, unsigned long *value);
+static int wait_until(struct playback *pb, unsigned long ns);
+static int quit_typed(void);
+static void draw(struct playback *pb);
+static void show_progress(struct playback *pb);
+static void summary(void);
+
+/*
+ * Play back the recording in a file, and exit.  Returns only if the
+ * file cannot be read, or is not a recording, having said so.
+ */
+int replay(char *path) {
+    struct playback *pb = &playback;
+    size_t magic = sizeof(RECORD_MAGIC) - 1;
+    struct stat st;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if(fd == -1 || fstat(fd, &st) == -1) {
+	perror(path);
+	return EXIT_FAILURE;
+    }
+    const unsigned char *data = MAP_FAILED;
+    if(st.st_size > magic)
+	data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(data != MAP_FAILED) {
+	pb->p = data;
+	pb->end = data + st.st_size;
+    }
+    // The header is read before the terminal is taken over, so that a
+    // file cut short in it is turned away like any other.
+    if(data == MAP_FAILED || !header(pb)) {
+	fprintf(stderr, "%s: Not a recording ecran can play\n", path);
+	return EXIT_FAILURE;
+    }
+    madvise((void *)data, st.st_size, MADV_SEQUENTIAL);
+    pb->path = path;
+
+    initialize_screen();
+    atexit(summary);
+    begin(pb);
+    unsigned long start = stats_clock(), drawn = start, shown = 0;
+    int stopped = 0;
+    while(pb->p < pb->end && !stopped) {
+	// A header in place of a record starts another recording.
+	if(pb->end - pb->p > magic && memcmp(pb->p, RECORD_MAGIC, magic) == 0) {
+	    if(!header(pb))
+		break;
+	    begin(pb);
+	    continue;
+	}
+	unsigned long delta, tag;
+	if(!read_varint(pb, &delta) || !read_varint(pb, &tag))
+	    break;
+	unsigned long n = tag >> 2;
+	int kind = tag & 3;
+	pb->recorded_us += delta;
+	if(kind == RECORD_GAP) {
+	    pb->gaps += n;
+	    continue;
+	}
+	if(n > pb->end - pb->p)
+	    break;
+	const unsigned char *body = pb->p;
+	pb->p += n;
+
+	if(replay_speed > 0)
+	    stopped = wait_until(pb, start + pb->recorded_us * 1000 /
+				 replay_speed);
+	if(kind == RECORD_OUTPUT) {
+	    char reply[VT_REPLY_SIZE];
+	    vscreen_write(pb->vscreen, (const char *)body, n);
+	    // Nothing is listening for replies.
+	    vscreen_reply(pb->vscreen, reply, sizeof(reply));
+	    pb->bytes += n;
+	    pb->reads++;
+	} else if(kind == RECORD_RESIZE) {
+	    unsigned long lines, cols;
+	    const unsigned char *next = pb->p;
+	    pb->p = body;
+	    // The screen cannot be made larger than the terminal.
+	    if(read_varint(pb, &lines) && read_varint(pb, &cols) &&
+	       lines > 0 && cols > 0 &&
+	       vscreen_resize(pb->vscreen, lines < LINES - 1 ? lines : LINES - 1,
+			      cols < COLS ? cols : COLS)) {
+		renderer->blank(0, 0, LINES - 1, COLS);
+		vscreen_show(pb->vscreen);
+	    }
+	    pb->p = next;
+	}
+
+	unsigned long now = stats_clock();
+	if(replay_speed == 0 || now - drawn >= REPLAY_FRAME * 1000000UL) {
+	    if(now - shown >= REPLAY_STATUS * 1000000UL) {
+		show_progress(pb);
+		shown = now;
+	    }
+	    draw(pb);
+	    drawn = now;
+	    stopped = quit_typed();
+	}
+    }
+    pb->elapsed_ns = stats_clock() - start;
+
+    if(replay_speed > 0 && !stopped) {
+	set_status("Replay over: q to quit");
+	draw(pb);
+	while(!quit_typed())
+	    poll(&(struct pollfd){ .fd = STDIN_FILENO, .events = POLLIN }, 1,
+		 -1);
+    }
+    finalize();
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Helper function to read the header of a recording.  Returns zero if
+ * it is not the header of a recording, or is cut short.
+ */
+static int header(struct playback *pb) {
+    size_t magic = sizeof(RECORD_MAGIC) - 1;
+    unsigned long started;
+    if(pb->end - pb->p <= magic || memcmp(pb->p, RECORD_MAGIC, magic) != 0 ||
+       pb->p[magic] != RECORD_VERSION)
+	return 0;
+    pb->p += magic + 1;
+    return read_varint(pb, &started);
+}
+
+/*
+ * Helper function to start playing a recording, once its header has
+ * been read, on a virtual screen of its own.
+ */
+static void begin(struct playback *pb) {
+    if(pb->vscreen != NULL)
+	vscreen_fini(pb->vscreen);
+    pb->vscreen = vscreen_init();
+    renderer->blank(0, 0, LINES - 1, COLS);
+    vscreen_show(pb->vscreen);
+}
+
+/*
+ * Helper function to read a varint from the recording.  Returns zero if
+ * the recording ends before it does.
+ */
+static int read_varint(struct playback *pb, unsigned long *value) {
+    *value = 0;
+    for(int shift = 0; pb->p < pb->end && shift < 7 * RECORD_VARINT;
+	shift += 7) {
+	unsigned char c = *pb->p++;
+	*value |= (unsigned long)(c & 0x7f) << shift;
+	if(!(c & 0x80))
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Helper function to wait until the time on the monotonic clock is ns
+ * (see stats_clock()), drawing what has been played so far first, if
+ * there is time.  Returns nonzero if q was typed meanwhile.
+ */
+static int wait_until(struct playback *pb, unsigned long ns) {
+    unsigned long now = stats_clock();
+    if(now >= ns)
+	return 0;
+    show_progress(pb);
+    draw(pb);
+    while((now = stats_clock()) < ns) {
+	struct timespec ts = { (ns - now) / 1000000000,
+			       (ns - now) % 1000000000 };
+	struct pollfd pfd = { .fd = STDIN_FILENO, .events = POLLIN };
+	if(ppoll(&pfd, 1, &ts, NULL) > 0 && quit_typed())
+	    return 1;
+    }
+    return 0;
+}
+
+/*
+ * Helper function to read the keys typed so far.  Returns nonzero if
+ * one of them was q.
+ */
+static int quit_typed(void) {
+    int c;
+    while((c = wgetch(main_screen)) != ERR)
+	if(c == 'q')
+	    return 1;
+    return 0;
+}
+
+/*
+ * Helper function to draw a frame of what has been played so far.
+ */
+static void draw(struct playback *pb) {
+    if(pb->vscreen == NULL)
+	return;
+    vscreen_sync(pb->vscreen);
+    status_render();
+    vscreen_frame();
+    pb->frames++;
+}
+
+/*
+ * Helper function to show how far the playback has got on the status
+ * line.
+ */
+static void show_progress(struct playback *pb) {
+    char s[64], speed[16] = "max";
+    if(replay_speed > 0)
+	snprintf(speed, sizeof(speed), "x%g", replay_speed);
+    snprintf(s, sizeof(s), "Replay %s: %.1fs in, q to quit", speed,
+	     pb->recorded_us / 1e6);
+    set_status(s);
+}
+
+/*
+ * Helper function to print how long the playback took, once the
+ * terminal has been restored as the program exits.
+ */
+static void summary(void) {
+    struct playback *pb = &playback;
+    double secs = pb->elapsed_ns / 1e9;
+    printf("%s: %lu bytes in %lu reads, recorded over %.3f s, "
+	   "played in %.3f s (%.1f MB/s), %lu frames", pb->path, pb->bytes,
+	   pb->reads, pb->recorded_us / 1e6, secs,
+	   secs > 0 ? pb->bytes / secs / 1e6 : 0.0, pb->frames);
+    if(pb->gaps > 0)
+	printf(", %lu bytes missing", pb->gaps);
+    printf("\n");
+}
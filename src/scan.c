@@ -0,0 +1,203 @@
+/*
+ * Vectorized scanning of session output.
+ *
+ * Most output is plain text, so the virtual screen copies runs of
+ * printable characters in bulk and only feeds the bytes between runs
+ * to the escape sequence parser.  Finding where a run ends is done
+ * here, 32 bytes at a time with AVX2 where the CPU has it, otherwise
+ * 16 at a time with SSE2, and one at a time on other architectures.
+ * The implementation is chosen on first use.  Copying a run into the
+ * 32-bit cells of a screen is likewise done 16 bytes at a time.
+ * Searching the cells of a screen for a character (see vscreen_search())
+ * is done 8 or 4 cells at a time in the same way.
+ */
+
+#include <stdint.h>
+#include "scan.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+static size_t scan_printable_scalar(const char *buf, size_t len);
+static size_t scan_printable_init(const char *buf, size_t len);
+
+static size_t scan_find_scalar(const uint32_t *cells, size_t n,
+			       uint32_t value, uint32_t mask);
+static size_t scan_find_init(const uint32_t *cells, size_t n,
+			     uint32_t value, uint32_t mask);
+
+static size_t (*scan_printable_impl)(const char *, size_t) =
+    scan_printable_init;
+static size_t (*scan_find_impl)(const uint32_t *, size_t, uint32_t,
+				uint32_t) = scan_find_init;
+
+/*
+ * Return the length of the run of printable ASCII characters
+ * (0x20 through 0x7e) at the start of a buffer.
+ */
+size_t scan_printable(const char *buf, size_t len) {
+    return scan_printable_impl(buf, len);
+}
+
+/*
+ * Helper function to test a single byte.
+ */
+static inline int printable(unsigned char b) {
+    return b >= 0x20 && b < 0x7f;
+}
+
+static size_t scan_printable_scalar(const char *buf, size_t len) {
+    size_t i = 0;
+    while(i < len && printable(buf[i]))
+	i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+/*
+ * As signed bytes, everything from 0x80 up is negative, so a byte is
+ * unprintable exactly when it is less than 0x20 or equal to 0x7f.
+ */
+__attribute__((target("sse2")))
+static size_t scan_printable_sse2(const char *buf, size_t len) {
+    const __m128i space = _mm_set1_epi8(0x20);
+    const __m128i del = _mm_set1_epi8(0x7f);
+    size_t i = 0;
+    for(; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(buf + i));
+	__m128i bad = _mm_or_si128(_mm_cmplt_epi8(v, space),
+				   _mm_cmpeq_epi8(v, del));
+	unsigned mask = _mm_movemask_epi8(bad);
+	if(mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_printable_scalar(buf + i, len - i);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_printable_avx2(const char *buf, size_t len) {
+    const __m256i space = _mm256_set1_epi8(0x1f);
+    const __m256i del = _mm256_set1_epi8(0x7f);
+    size_t i = 0;
+    for(; i + 32 <= len; i += 32) {
+	__m256i v = _mm256_loadu_si256((const __m256i *)(buf + i));
+	__m256i bad = _mm256_or_si256(_mm256_cmpgt_epi8(space, v),
+				      _mm256_cmpeq_epi8(v, del));
+	unsigned mask = _mm256_movemask_epi8(bad);
+	if(mask)
+	    return i + __builtin_ctz(mask);
+    }
+    return i + scan_printable_sse2(buf + i, len - i);
+}
+#endif
+
+/*
+ * Helper function to pick the best implementation for this CPU the
+ * first time a scan is made.
+ */
+static size_t scan_printable_init(const char *buf, size_t len) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+	scan_printable_impl = scan_printable_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+	scan_printable_impl = scan_printable_sse2;
+    else
+#endif
+	scan_printable_impl = scan_printable_scalar;
+    return scan_printable_impl(buf, len);
+}
+
+/*
+ * Return the index of the first of n cells that has the given value in
+ * the bits set in mask, or n if there is none.
+ */
+size_t scan_find(const uint32_t *cells, size_t n, uint32_t value,
+		 uint32_t mask) {
+    return scan_find_impl(cells, n, value, mask);
+}
+
+static size_t scan_find_scalar(const uint32_t *cells, size_t n,
+			       uint32_t value, uint32_t mask) {
+    size_t i = 0;
+    while(i < n && (cells[i] & mask) != value)
+	i++;
+    return i;
+}
+
+#ifdef SCAN_X86
+__attribute__((target("sse2")))
+static size_t scan_find_sse2(const uint32_t *cells, size_t n,
+			     uint32_t value, uint32_t mask) {
+    const __m128i v = _mm_set1_epi32(value);
+    const __m128i m = _mm_set1_epi32(mask);
+    size_t i = 0;
+    for(; i + 4 <= n; i += 4) {
+	__m128i c = _mm_loadu_si128((const __m128i *)(cells + i));
+	__m128i eq = _mm_cmpeq_epi32(_mm_and_si128(c, m), v);
+	unsigned hit = _mm_movemask_ps(_mm_castsi128_ps(eq));
+	if(hit)
+	    return i + __builtin_ctz(hit);
+    }
+    return i + scan_find_scalar(cells + i, n - i, value, mask);
+}
+
+__attribute__((target("avx2")))
+static size_t scan_find_avx2(const uint32_t *cells, size_t n,
+			     uint32_t value, uint32_t mask) {
+    const __m256i v = _mm256_set1_epi32(value);
+    const __m256i m = _mm256_set1_epi32(mask);
+    size_t i = 0;
+    for(; i + 8 <= n; i += 8) {
+	__m256i c = _mm256_loadu_si256((const __m256i *)(cells + i));
+	__m256i eq = _mm256_cmpeq_epi32(_mm256_and_si256(c, m), v);
+	unsigned hit = _mm256_movemask_ps(_mm256_castsi256_ps(eq));
+	if(hit)
+	    return i + __builtin_ctz(hit);
+    }
+    return i + scan_find_sse2(cells + i, n - i, value, mask);
+}
+#endif
+
+/*
+ * As scan_printable_init(), for scan_find().
+ */
+static size_t scan_find_init(const uint32_t *cells, size_t n,
+			     uint32_t value, uint32_t mask) {
+#ifdef SCAN_X86
+    __builtin_cpu_init();
+    if(__builtin_cpu_supports("avx2"))
+	scan_find_impl = scan_find_avx2;
+    else if(__builtin_cpu_supports("sse2"))
+	scan_find_impl = scan_find_sse2;
+    else
+#endif
+	scan_find_impl = scan_find_scalar;
+    return scan_find_impl(cells, n, value, mask);
+}
+
+/*
+ * Widen len bytes of ASCII text into 32-bit cells, combining each
+ * with the given attribute bits.
+ */
+void scan_widen(uint32_t *dst, const char *src, size_t len, uint32_t bits) {
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i or = _mm_set1_epi32(bits);
+    for(; i + 16 <= len; i += 16) {
+	__m128i v = _mm_loadu_si128((const __m128i *)(src + i));
+	__m128i lo = _mm_unpacklo_epi8(v, zero);
+	__m128i hi = _mm_unpackhi_epi8(v, zero);
+	__m128i *d = (__m128i *)(dst + i);
+	_mm_storeu_si128(d, _mm_or_si128(_mm_unpacklo_epi16(lo, zero), or));
+	_mm_storeu_si128(d + 1, _mm_or_si128(_mm_unpackhi_epi16(lo, zero), or));
+	_mm_storeu_si128(d + 2, _mm_or_si128(_mm_unpacklo_epi16(hi, zero), or));
+	_mm_storeu_si128(d + 3, _mm_or_si128(_mm_unpackhi_epi16(hi, zero), or));
+    }
+#endif
+    for(; i < len; i++)
+	dst[i] = (unsigned char)src[i] | bits;
+}
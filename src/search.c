@@ -0,0 +1,101 @@
+#include <stdlib.h>
+#include <limits.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "ecran.h"
+#include "search.h"
+
+/*
+ * Searching the scrollback.
+ *
+ * A search looks through the history and screen of every session for
+ * the newest line with some text on it (see vscreen_search(), which
+ * keeps an index of each history to skip most of it).  The screens are
+ * searched in parallel, one to a thread, with as many threads as there
+ * are processors, the main thread among them; each takes the next
+ * screen not yet taken until there are none left.  The main loop waits
+ * for the search to finish, which it does well within a second even
+ * through millions of lines.
+ */
+
+struct search {
+    VSCREEN **screens;
+    long *lines;
+    int n;
+    const char *text;
+    int next;             // Next screen to be taken.
+};
+
+static void *searcher(void *arg);
+
+/*
+ * Search n screens at once for text, going back in each from the line
+ * given for it in lines, which is replaced by the line found, or -1.
+ */
+void search_screens(VSCREEN **screens, long *lines, int n, const char *text) {
+    struct search search = { screens, lines, n, text, 0 };
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = (cpus < n ? cpus : n) - 1;
+    pthread_t thread[threads > 0 ? threads : 1];
+    int started = 0;
+    while(started < threads &&
+	  pthread_create(&thread[started], NULL, searcher, &search) == 0)
+	started++;
+    searcher(&search);
+    for(int i = 0; i < started; i++)
+	pthread_join(thread[i], NULL);
+}
+
+/*
+ * Find the next line with text on it: in session from, going back from
+ * *line (LONG_MAX to start with its newest), and failing that the
+ * newest in each session after it in the list in turn, and in from
+ * again from its newest line.  Returns the session, with *line set to
+ * the number of the line in it, or NULL if text is nowhere.
+ */
+SESSION *search_next(const char *text, SESSION *from, long *line) {
+    int n = 0;
+    for(SESSION *session = session_list; session != NULL;
+	session = session->next)
+	n++;
+    SESSION *sessions[n];
+    VSCREEN *screens[n];
+    long lines[n];
+    SESSION *session = from;
+    for(int i = 0; i < n; i++) {
+	sessions[i] = session;
+	screens[i] = session->vscreen;
+	lines[i] = i == 0 ? *line : LONG_MAX;
+	if((session = session->next) == NULL)
+	    session = session_list;
+    }
+    search_screens(screens, lines, n, text);
+    for(int i = 0; i < n; i++) {
+	if(lines[i] >= 0) {
+	    *line = lines[i];
+	    return sessions[i];
+	}
+    }
+    if(*line != LONG_MAX) {
+	lines[0] = LONG_MAX;
+	search_screens(screens, lines, 1, text);
+	if(lines[0] >= 0) {
+	    *line = lines[0];
+	    return from;
+	}
+    }
+    return NULL;
+}
+
+/*
+ * Helper function run by each thread searching.
+ */
+static void *searcher(void *arg) {
+    struct search *search = arg;
+    int i;
+    while((i = __atomic_fetch_add(&search->next, 1, __ATOMIC_RELAXED)) <
+	  search->n)
+	search->lines[i] = vscreen_search(search->screens[i], search->text,
+					  search->lines[i]);
+    return NULL;
+}
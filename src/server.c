@@ -0,0 +1,321 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <poll.h>
+#include <termios.h>
+#include <sys/ioctl.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "ecran.h"
+#include "render.h"
+#include "server.h"
+#include <term.h>    // After the above, for the macros it defines.
+
+/*
+ * Detaching and reattaching.
+ *
+ * Run with -A, ecran is a thin client of a server process that owns the
+ * sessions, and which it starts if none is running.  The client only
+ * relays bytes: keys typed on its terminal go to the server over a Unix
+ * domain socket, and what the server draws comes back the same way, to
+ * be written to the terminal as it is.  (The keys go in packets, so that
+ * the client can also tell the server when its terminal is resized.)
+ * The server draws with the ANSI
+ * renderer, which sends a client that attaches one full frame (the
+ * screen cleared, then only the cells that are not blank, with runs of
+ * the same cell repeated rather than written out), and after that only
+ * the cells that change.  The scrollback stays with the server.
+ *
+ * The server never waits for a client: its connection is non-blocking,
+ * and while the client is not taking what is drawn, frames are skipped
+ * rather than queued, so the sessions keep being drained whatever the
+ * client does.  When the connection closes, or the client detaches with
+ * ^A d, the sessions carry on until a client attaches again.
+ */
+
+int server_mode;
+static char *socket_path;
+
+static int server_listen(char *path);
+static void server_start(char *path);
+static void server_main(int fd, int nlines, int ncols);
+static int client_connect(char *path);
+static void relay(int from, int to, int keys, int *attached);
+static void send_size(int fd, int *attached);
+static int write_all(int fd, const unsigned char *buf, size_t n);
+static void note_resize(int sig);
+
+static volatile sig_atomic_t resized;   // The terminal has been resized.
+
+/*
+ * Return the path of the socket that clients attach on when none is
+ * given, in the user's runtime directory if there is one.
+ */
+char *server_default_path(void) {
+    static char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    char *dir = getenv("XDG_RUNTIME_DIR");
+    if(dir != NULL && *dir != '\0')
+	snprintf(path, sizeof(path), "%s/ecran.sock", dir);
+    else
+	snprintf(path, sizeof(path), "/tmp/ecran-%d.sock", (int)getuid());
+    return path;
+}
+
+/*
+ * Clean up after the server, as it exits.
+ */
+void server_fini(void) {
+    if(socket_path != NULL)
+	unlink(socket_path);
+}
+
+/*
+ * Attach to the server listening on a socket, starting one if there is
+ * none, and relay between it and the terminal until the connection is
+ * closed.  Returns the exit status for the client.
+ */
+int client_main(char *path) {
+    int fd = client_connect(path);
+    if(fd == -1) {
+	server_start(path);
+	fd = client_connect(path);
+    }
+    if(fd == -1) {
+	fprintf(stderr, "ecran: cannot attach to %s: %s\n", path,
+		strerror(errno));
+	return EXIT_FAILURE;
+    }
+
+    // The terminal is handed over to the server as it is: raw, and
+    // switched to the alternate screen, as curses would have it.
+    struct termios saved, raw;
+    int tty = tcgetattr(STDIN_FILENO, &saved) == 0;
+    if(tty) {
+	raw = saved;
+	cfmakeraw(&raw);
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw);
+    }
+    static const char enter[] = "\033[?1049h", leave[] = "\033[?1049l\033[m";
+    write(STDOUT_FILENO, enter, sizeof(enter) - 1);
+
+    // SIGWINCH is only let through while waiting for input, so that
+    // the size is sent between packets of keys.
+    sigset_t mask, waiting;
+    sigemptyset(&mask);
+    sigaddset(&mask, SIGWINCH);
+    sigprocmask(SIG_BLOCK, &mask, &waiting);
+    sigdelset(&waiting, SIGWINCH);
+    struct sigaction sa = { .sa_handler = note_resize };
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGWINCH, &sa, NULL);
+
+    int attached = 1;
+    send_size(fd, &attached);
+    while(attached) {
+	struct pollfd fds[2] = {
+	    { .fd = STDIN_FILENO, .events = POLLIN },
+	    { .fd = fd, .events = POLLIN },
+	};
+	int n = ppoll(fds, 2, NULL, &waiting);
+	if(resized) {
+	    resized = 0;
+	    send_size(fd, &attached);
+	}
+	if(n == -1) {
+	    if(errno == EINTR)
+		continue;
+	    break;
+	}
+	if(attached && fds[1].revents)
+	    relay(fd, STDOUT_FILENO, 0, &attached);
+	if(attached && fds[0].revents)
+	    relay(STDIN_FILENO, fd, 1, &attached);
+    }
+
+    write(STDOUT_FILENO, leave, sizeof(leave) - 1);
+    if(tty)
+	tcsetattr(STDIN_FILENO, TCSAFLUSH, &saved);
+    printf("[detached from %s]\n", path);
+    return EXIT_SUCCESS;
+}
+
+/*
+ * Helper function to pass on whatever can be read from one descriptor
+ * to another, as packets of keys if keys is set.  Clears *attached when
+ * either end has closed.
+ */
+static void relay(int from, int to, int keys, int *attached) {
+    unsigned char buf[65536], packets[65536 + 2 * (65536 / PACKET_MAX + 1)];
+    ssize_t n = read(from, buf, sizeof(buf));
+    if(n <= 0) {
+	if(n == 0 || errno != EINTR)
+	    *attached = 0;
+	return;
+    }
+    if(!keys) {
+	if(write_all(to, buf, n) == -1)
+	    *attached = 0;
+	return;
+    }
+    size_t len = 0;
+    for(ssize_t i = 0; i < n; i += PACKET_MAX) {
+	int k = n - i < PACKET_MAX ? n - i : PACKET_MAX;
+	packets[len++] = PACKET_KEYS;
+	packets[len++] = k;
+	memcpy(packets + len, buf + i, k);
+	len += k;
+    }
+    if(write_all(to, packets, len) == -1)
+	*attached = 0;
+}
+
+/*
+ * Helper function to send the server the size of the terminal, if
+ * there is one.  Clears *attached if the server has gone.
+ */
+static void send_size(int fd, int *attached) {
+    struct winsize ws;
+    if(ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1)
+	return;
+    unsigned char packet[] = { PACKET_SIZE, 4, ws.ws_row >> 8, ws.ws_row,
+			       ws.ws_col >> 8, ws.ws_col };
+    if(write_all(fd, packet, sizeof(packet)) == -1)
+	*attached = 0;
+}
+
+/*
+ * Helper function to write all of a buffer, however many writes that
+ * takes.  Returns -1 if it cannot be done.
+ */
+static int write_all(int fd, const unsigned char *buf, size_t n) {
+    for(size_t done = 0; done < n; ) {
+	ssize_t w = write(fd, buf + done, n - done);
+	if(w == -1) {
+	    if(errno == EINTR)
+		continue;
+	    return -1;
+	}
+	done += w;
+    }
+    return 0;
+}
+
+/*
+ * Signal handler noting that the terminal has been resized.
+ */
+static void note_resize(int sig) {
+    resized = 1;
+}
+
+/*
+ * Helper function to connect to a server.  Returns -1 if none is
+ * listening on the socket.
+ */
+static int client_connect(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+	return -1;
+    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+	int e = errno;
+	close(fd);
+	errno = e;
+	return -1;
+    }
+    return fd;
+}
+
+/*
+ * Helper function to create the socket a server listens on.  Nothing is
+ * listening on the path (see client_main()), so anything there is left
+ * over from a server that has gone, and is removed.  Only the user can
+ * connect.
+ */
+static int server_listen(char *path) {
+    struct sockaddr_un addr = { .sun_family = AF_UNIX };
+    strncpy(addr.sun_path, path, sizeof(addr.sun_path) - 1);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(fd == -1)
+	return -1;
+    unlink(path);
+    mode_t mask = umask(077);
+    int r = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    umask(mask);
+    if(r == -1 || listen(fd, 4) == -1) {
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+/*
+ * Helper function to start a server in the background, with screens
+ * the size of the terminal the client is on.  The socket is listening
+ * before this returns, so the client can connect straight away.  The
+ * server forks twice, so that it is not left a child of the client.
+ */
+static void server_start(char *path) {
+    struct winsize ws;
+    if(ioctl(STDIN_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_row < 2 ||
+       ws.ws_col < 1) {
+	ws.ws_row = 24;
+	ws.ws_col = 80;
+    }
+    int fd = server_listen(path);
+    if(fd == -1)
+	return;
+    pid_t pid = fork();
+    if(pid == -1) {
+	close(fd);
+	return;
+    }
+    if(pid > 0) {
+	close(fd);
+	waitpid(pid, NULL, 0);
+	return;
+    }
+    setsid();
+    if(fork() != 0)
+	_exit(EXIT_SUCCESS);
+    socket_path = strdup(path);
+    server_main(fd, ws.ws_row, ws.ws_col);
+}
+
+/*
+ * Helper function to run the server.  It keeps nothing of the terminal
+ * it was started from (unless errors are going to a file given with
+ * -o), but the description of the terminal named by TERM is loaded for
+ * the renderer to consult.
+ */
+static void server_main(int fd, int nlines, int ncols) {
+    int null = open("/dev/null", O_RDWR);
+    dup2(null, STDIN_FILENO);
+    dup2(null, STDOUT_FILENO);
+    if(!err)
+	dup2(null, STDERR_FILENO);
+    if(null > STDERR_FILENO)
+	close(null);
+    signal(SIGPIPE, SIG_IGN);
+    int e;
+    setupterm(NULL, STDOUT_FILENO, &e);
+
+    server_mode = 1;
+    LINES = nlines;
+    COLS = ncols;
+    renderer = &render_ansi;
+    render_fd = -1;
+    mainloop_init();
+    mainloop_listen(fd);
+    initialize();
+    mainloop();
+}
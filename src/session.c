@@ -5,11 +5,12 @@
  * and a process that is the session leader.  Output from the
  * pty goes to the virtual screen, which can be one of several
  * virtual screens multiplexed onto the physical screen.
- * At any given time there is a particular session that is
- * designated the "foreground" session.  The contents of the
- * virtual screen associated with the foreground session is what
- * is shown on the physical screen.  Input from the physical
- * keyboard is directed to the pty for the foreground session.
+ * The physical screen is divided into panes (see layout.c), each
+ * showing the contents of the virtual screen of one session.  At any
+ * given time there is a particular session that is designated the
+ * "foreground" session, the one shown in the pane with the focus.
+ * Input from the physical keyboard is directed to the pty for the
+ * foreground session.
  */
 
 #define _GNU_SOURCE
@@ -17,6 +18,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <unistd.h>
@@ -27,111 +29,240 @@
 
 #include <errno.h>
 #include "session.h"
+#include "layout.h"
+#include "render.h"
+#include "snapshot.h"
 #include <signal.h>
 #include <sys/wait.h>
+#include <spawn.h>
 
 
-SESSION *sessions[MAX_SESSIONS];  // Table of existing sessions
 SESSION *fg_session;              // Current foreground session
+SESSION *session_list;            // All sessions, most recent first
+int session_count;                // Number of sessions
+int session_highwater = SESSION_HIGHWATER;
 void exit_error();
-void sigchld_handler(int sig);
-void sigalrm_handler(int sig);
-void set(char* s);
+static int queue(SESSION *session, const char *buf, int n);
+static void enter(SESSION *session);
+static void leave(SESSION *session);
+static void teardown(SESSION *session);
+static SESSION *start(char *path, char *argv[], int from);
+static SESSION *graveyard;        // Sessions torn down, to be deallocated
+static void *grow(void *table, size_t elem, int *size, int min);
 VSCREEN *helpvscreen;
 int t = 0;
+
 /*
- * Initialize a new session whose session leader runs a specified command.
- * If the command is NULL, then the session leader runs a shell.
- * The new session becomes the foreground session.
+ * The session registry.  Sessions are numbered (their sid) by their
+ * slot in a table that is doubled whenever it fills, and the numbers of
+ * sessions that have gone are handed out again, most recently freed
+ * first, from a stack of free slots.  Sessions can also be looked up by
+ * the file descriptor of their pty, in a table indexed by descriptor,
+ * and by the process ID of their session leader, in a hash table with
+ * chaining.  All three lookups take constant time, however many
+ * sessions there are.
  */
-SESSION *session_init(char *path, char *argv[]) {
-    int error;
-
-    for(int i = 0; i < MAX_SESSIONS; i++) {
-
-	if(sessions[i] == NULL) {
-	    int mfd = posix_openpt(O_RDWR | O_NOCTTY);
-	    if(mfd == -1)
-		      return NULL; // No more ptys
-	    if(unlockpt(mfd) == -1)
-            exit_error();
-
-	    char *sname = ptsname(mfd);
-        if(sname == NULL)
-            exit_error();
-	    // Set nonblocking I/O on master side of pty
-	    if((error = fcntl(mfd, F_SETFL, O_NONBLOCK)) == -1)
-            exit_error();
-
-	    SESSION *session = calloc(sizeof(SESSION), 1);
-	    sessions[i] = session;
-	    session->sid = i;
-	    session->vscreen = vscreen_init();
-	    session->ptyfd = mfd;
+static SESSION **sessions;        // Table of sessions, indexed by sid
+static int num_slots, used_slots;
+static int *free_slots;           // Stack of free slots below used_slots
+static int num_free;
+static SESSION **by_fd;
+static int num_fds;
+static SESSION **by_pid;
+static int num_buckets;
 
-	    // Fork process to be leader of new session.
-	    if((session->pid = fork()) == 0) {
-		// Open slave side of pty, create new session,
-		// and set pty as controlling terminal.
-        int sfd = open(sname, O_RDWR);
-        if(sfd == -1)
-            exit_error();
+#define PID_HASH(pid) ((unsigned)(pid) * 2654435761u)
 
+/*
+ * Initialize a new session whose session leader runs a specified command,
+ * looked for on the PATH if it has no slash in it, as by execvp(); its
+ * arguments are passed as they are, with no shell to parse them.  The
+ * new session becomes the foreground session.  Returns NULL, with errno
+ * set, if no more ptys can be had or the command cannot be run.
+ */
+SESSION *session_init(char *path, char *argv[]) {
+    return start(path, argv, -1);
+}
 
-        if((error = setsid()) == -1)
-            exit_error();
-        if((error = ioctl(sfd, TIOCSCTTY, 0)) == -1)
-            exit_error();
-
-        dup2(sfd,2);
-
-		if((putenv("TERM=dumb")))
-            exit_error();
-
-        if((error = dup2(sfd,0)) == -1){
-            exit_error();
-        }
-
-        if((error = dup2(sfd,1)) == -1){
-            exit_error();
-        }
-
-        if((error = close(sfd)) == -1){
-            exit_error();
-        }
-        if((error = close(mfd)) == -1){
-            exit_error();
-        }
-        if((error = execv(path, argv)) == -1)
-            exit_error();
+/*
+ * Start a session running a specified command for each screen left in
+ * the snapshot directory by an ecran that did not exit cleanly, showing
+ * the screen as it was, history and all (see vscreen_map()).  The
+ * sessions are numbered afresh, in the order of their old numbers, and
+ * the last becomes the foreground session.  Returns the number of
+ * sessions started.  If another ecran is using the directory, its
+ * screens are left alone: a single session is started, and no
+ * snapshots are kept.
+ */
+int session_restore(char *path, char *argv[]) {
+    mkdir(snapshot_dir, 0700);
+    if(!snapshot_lock()) {
+	snapshot_dir = NULL;
+	if(start(path, argv, -1) == NULL)
+	    return 0;
+	set_status("Snapshots in use by another ecran");
+	return 1;
+    }
+    char *attrs = snapshot_path(-1), *clusters = snapshot_path(-2);
+    int kept = vscreen_map_attrs(attrs);
+    if(kept != -1) {
+	int clusters_kept = vscreen_map_clusters(clusters);
+	kept = clusters_kept == -1 ? -1 : kept && clusters_kept;
+    }
+    free(attrs);
+    free(clusters);
+    if(kept == -1) {
+	snapshot_dir = NULL;
+	set_status("Cannot keep snapshots");
+	return 0;
+    }
+    int *sids, n = snapshot_list(&sids), restored = 0;
+    for(int i = 0; i < n; i++) {
+	// Screens are no use without the tables their cells refer to.
+	if(!kept) {
+	    char *old = snapshot_path(sids[i]);
+	    unlink(old);
+	    free(old);
+	} else if(start(path, argv, sids[i]) != NULL) {
+	    restored++;
+	}
+    }
+    free(sids);
+    if(restored > 0)
+	set_status("Sessions restored");
+    return restored;
+}
 
-	    }else if (session->pid <0){
-            exit_error();
-        }else{
-            set_status("New Session Made");
-            session_setfg(session);
-            return session;
-        }
+/*
+ * Helper function to start a session for session_init(), keeping its
+ * screen in a snapshot file if there is a snapshot directory, restored
+ * from the snapshot of the screen of session from, unless that is -1.
+ */
+static SESSION *start(char *path, char *argv[], int from) {
+    int error;
 
-	    }else{
-            set_status("No More Sessions Available");
-        }
+    int mfd = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if(mfd == -1) {
+	set_status("No More Sessions Available");
+	return NULL;
+    }
+    if(unlockpt(mfd) == -1)
+        exit_error();
+
+    char *sname = ptsname(mfd);
+    if(sname == NULL)
+	exit_error();
+    // Set nonblocking I/O on master side of pty
+    if((error = fcntl(mfd, F_SETFL, O_NONBLOCK)) == -1)
+        exit_error();
+    // Tell the pty the size of the virtual screen, which is
+    // that of the physical screen less the status line.
+    struct winsize ws = { .ws_row = LINES - 1, .ws_col = COLS };
+    if((error = ioctl(mfd, TIOCSWINSZ, &ws)) == -1)
+        exit_error();
+
+    SESSION *session = calloc(sizeof(SESSION), 1);
+    if(session == NULL)
+	exit_error();
+    session->vscreen = vscreen_init();
+    session->rbuf = malloc(SESSION_RBUF_SIZE);
+    session->wbuf = malloc(SESSION_WBUF_SIZE);
+    if(session->rbuf == NULL || session->wbuf == NULL)
+	exit_error();
+    session->ptyfd = mfd;
+
+    // Spawn the process to be leader of the new session.  It is
+    // spawned rather than forked, so that starting a session costs the
+    // same however large ecran has grown.  The slave side of the pty,
+    // opened once the process is in a session of its own, becomes its
+    // controlling terminal.  The parent blocks the signals it receives
+    // through the event loop, and a server ignores SIGPIPE; the session
+    // leader should see them normally.
+    posix_spawnattr_t attr;
+    posix_spawn_file_actions_t actions;
+    sigset_t mask;
+    posix_spawnattr_init(&attr);
+    posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSID |
+			     POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+    sigemptyset(&mask);
+    posix_spawnattr_setsigmask(&attr, &mask);
+    sigaddset(&mask, SIGPIPE);
+    posix_spawnattr_setsigdefault(&attr, &mask);
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, sname, O_RDWR, 0);
+    posix_spawn_file_actions_adddup2(&actions, 0, 1);
+    posix_spawn_file_actions_adddup2(&actions, 0, 2);
+
+    int n = 0;
+    while(environ[n] != NULL)
+	n++;
+    char *env[n + 2];
+    int e = 0;
+    for(int i = 0; i < n; i++)
+	if(strncmp(environ[i], "TERM=", 5) != 0)
+	    env[e++] = environ[i];
+    env[e++] = "TERM=" VSCREEN_TERM;
+    env[e] = NULL;
+
+    error = posix_spawnp(&session->pid, path, &actions, &attr, argv, env);
+    posix_spawn_file_actions_destroy(&actions);
+    posix_spawnattr_destroy(&attr);
+    if(error != 0) {
+	set_status(strerror(error));
+	close(mfd);
+	vscreen_fini(session->vscreen);
+	free(session->rbuf);
+	free(session->wbuf);
+	free(session);
+	errno = error;
+	return NULL;
+    }
+    enter(session);
+    if(snapshot_dir != NULL) {
+	char *to = snapshot_path(session->sid);
+	char *old = from >= 0 ? snapshot_path(from) : NULL;
+	vscreen_map(session->vscreen, to, old);
+	free(to);
+	free(old);
     }
-    return NULL;  // Session table full.
+    if((session->log = log_open(session->sid)) != NULL && log_text)
+	vscreen_log(session->vscreen, session->log);
+    session->record = log_record(session->sid, LINES - 1, COLS);
+    mainloop_watch(session);
+    set_status("New Session Made");
+    session_setfg(session);
+    return session;
 }
 
 /*
  * Set a specified session as the foreground session.
- * The current contents of the virtual screen of the new foreground session
- * are displayed in the physical screen, and subsequent input from the
- * physical terminal is directed at the new foreground session.
+ * If it is not already shown in a pane, it takes the place of the
+ * session in the pane with the focus, and the current contents of its
+ * virtual screen are displayed there; if it is, that pane gets the
+ * focus.  Subsequent input from the physical terminal is directed at
+ * the new foreground session.
  */
 void session_setfg(SESSION *session) {
-    fg_session = session;
-    // REST TO BE FILLED IN
-    //fprintf(stderr,"SID: %i, %i\n", session->sid, session->error);
-    vscreen_show(session ->vscreen);
+    layout_show(session);
+}
 
+/*
+ * Bring the size of the virtual screen of a session, and that of its
+ * pty, up to date with the pane it is shown in.  The program in the
+ * session is sent SIGWINCH by the pty driver.  Only sessions shown in
+ * panes are resized with the terminal; the others are left until they
+ * are shown again, so that resizing costs the same however many
+ * sessions there are.
+ */
+void session_resize(SESSION *session) {
+    struct pane *pane = session->pane;
+    if(pane == NULL || !vscreen_resize(session->vscreen, pane->lines,
+                                       pane->cols))
+	return;
+    struct winsize ws = { .ws_row = pane->lines, .ws_col = pane->cols };
+    ioctl(session->ptyfd, TIOCSWINSZ, &ws);
+    if(session->record != NULL)
+	log_resize(session->record, pane->lines, pane->cols);
 }
 
 /*
@@ -143,14 +274,155 @@ int session_read(SESSION *session, char *buf, int bufsize) {
 }
 
 /*
- * Write a single byte to the session pty, which will treat it as if
- * typed on the terminal.  The number of bytes written is returned,
- * or EOF in case of an error.
+ * Read all currently available output from the session pty and feed it
+ * to the session's virtual screen, then answer any queries (such as
+ * cursor position reports) that the program made in it.  Returns as
+ * session_parse() does.
+ */
+int session_drain(SESSION *session) {
+    int n = session_parse(session);
+    session_answer(session);
+    return n;
+}
+
+/*
+ * Read all currently available output from the session pty and feed it
+ * to the session's virtual screen.  A pty hands over no more than a
+ * page or so per read, however much is waiting, so the read buffer is
+ * filled by as many reads as it takes, and then parsed in one go.
+ * Reading stops when the pty would block, or once SESSION_DRAIN_MAX
+ * buffers' worth has been read.  Returns the number of bytes
+ * transferred, or EOF if the pty has been closed or a read error
+ * occurred before any output was seen.  This is what a worker thread
+ * does with a session (see pool.c), so it touches nothing but the pty,
+ * the read buffer and the virtual screen, and the logs and recording of
+ * the session, to which raw output is copied as it is read (see log.c).
+ */
+int session_parse(SESSION *session) {
+    int total = 0, reads = 0, blocked = 0, closed = 0;
+    unsigned long ns = 0;
+    while(!blocked && !closed &&
+	  total < SESSION_DRAIN_MAX * SESSION_RBUF_SIZE) {
+	int filled = 0;
+	while(filled < SESSION_RBUF_SIZE) {
+	    int n = session_read(session, session->rbuf + filled,
+				 SESSION_RBUF_SIZE - filled);
+	    if(n > 0) {
+		filled += n;
+		reads++;
+	    } else if(n == -1 && errno == EINTR) {
+		continue;
+	    } else {
+		blocked = n == -1 && errno == EAGAIN;
+		closed = !blocked;
+		break;
+	    }
+	}
+	if(filled == 0)
+	    break;
+	if(session->log != NULL && !log_text)
+	    log_write(session->log, session->rbuf, filled);
+	if(session->record != NULL)
+	    log_write(session->record, session->rbuf, filled);
+	unsigned long t = stats_clock();
+	vscreen_write(session->vscreen, session->rbuf, filled);
+	ns += stats_clock() - t;
+	total += filled;
+    }
+    if(total > 0) {
+	__atomic_add_fetch(&session->output, total, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&session->counters.reads, reads, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&session->counters.parse_ns, ns, __ATOMIC_RELAXED);
+    }
+    return closed && total == 0 ? EOF : total;
+}
+
+/*
+ * Write back to the session pty any replies to queries that the program
+ * has made in the output parsed so far.
+ */
+void session_answer(SESSION *session) {
+    char reply[VT_REPLY_SIZE];
+    int r = vscreen_reply(session->vscreen, reply, sizeof(reply));
+    if(r > 0) {
+	queue(session, reply, r);
+	session_flush(session);
+    }
+}
+
+/*
+ * Queue a single byte to be written to the session pty, which will treat
+ * it as if typed on the terminal.  Nothing is written until
+ * session_flush() is called.  The number of bytes queued is returned,
+ * or EOF if the session's input is paused because the program has let
+ * session_highwater bytes pile up unread.
  */
 int session_putc(SESSION *session, char c) {
-    // TODO: Probably should use non-blocking I/O to avoid the potential
-    // for hanging here, but this is ignored for now.
-    return write(session->ptyfd, &c, 1);
+    if(session->paused)
+	return EOF;
+    queue(session, &c, 1);
+    stats_key(session);
+    if(session->wtail - session->whead >= session_highwater) {
+	// See how much the program will take before giving up on it.
+	session_flush(session);
+	if(session->wtail - session->whead >= session_highwater) {
+	    session->paused = 1;
+	    set_status("Session not reading input: paused");
+	}
+    }
+    return 1;
+}
+
+/*
+ * Write as much of the input queued for a session as its pty will take
+ * without blocking, in a single writev() of the (possibly wrapped)
+ * contents of the queue.  If some input remains, the event loop watches
+ * for the pty to become writable and calls this function again.
+ */
+void session_flush(SESSION *session) {
+    while(session->wtail != session->whead) {
+	unsigned len = session->wtail - session->whead;
+	unsigned off = session->whead & (SESSION_WBUF_SIZE - 1);
+	unsigned first = SESSION_WBUF_SIZE - off;
+	struct iovec iov[2] = {
+	    { session->wbuf + off, len < first ? len : first },
+	    { session->wbuf, len < first ? 0 : len - first },
+	};
+	ssize_t n = writev(session->ptyfd, iov, len < first ? 1 : 2);
+	if(n == -1) {
+	    if(errno == EINTR)
+		continue;
+	    // If the pty is gone, so is any hope of writing the rest.
+	    if(errno != EAGAIN)
+		session->whead = session->wtail;
+	    break;
+	}
+	session->whead += n;
+	session->counters.writes++;
+	session->counters.written += n;
+    }
+    unsigned queued = session->wtail - session->whead;
+    if(session->paused && queued <= session_highwater / 2) {
+	session->paused = 0;
+	set_status("Session reading input again");
+    }
+    if(session->wwatch != (queued > 0) && !session->error) {
+	session->wwatch = queued > 0;
+	mainloop_output(session);
+    }
+}
+
+/*
+ * Helper function to append bytes to the queue of input for a session.
+ * Bytes that do not fit are dropped.  Returns the number queued.
+ */
+static int queue(SESSION *session, const char *buf, int n) {
+    unsigned room = SESSION_WBUF_SIZE - (session->wtail - session->whead);
+    if(n > room)
+	n = room;
+    for(int i = 0; i < n; i++)
+	session->wbuf[session->wtail++ & (SESSION_WBUF_SIZE - 1)] = buf[i];
+    return n;
 }
 
 /*
@@ -159,8 +431,57 @@ int session_putc(SESSION *session, char c) {
 void session_kill(SESSION *session) {
 
     kill(session->pid, SIGKILL);
-    close(session->ptyfd);
-    session_fini(session);
+    teardown(session);
+}
+
+/*
+ * Helper function to release the pty of a session whose leader is dead
+ * or dying, and take the session out of the registry.  The session is
+ * only marked dead, and deallocated by session_sweep() at the end of
+ * the pass of the event loop, which may still have events for it.  The
+ * pty of a session that a worker is draining is only closed once the
+ * worker is done with it.  A pane still showing the session is left
+ * empty.
+ */
+static void teardown(SESSION *session) {
+    if(session->pane != NULL)
+	session->pane->session = NULL;
+    mainloop_unwatch(session);
+    leave(session);
+    session->dead = 1;
+    if(!session->busy)
+	close(session->ptyfd);
+    session->next = graveyard;
+    graveyard = session;
+}
+
+/*
+ * Take back a session from the worker that was draining it.  Returns
+ * nonzero if the session was torn down in the meantime.
+ */
+int session_idle(SESSION *session) {
+    session->busy = 0;
+    if(session->dead)
+	close(session->ptyfd);
+    return session->dead;
+}
+
+/*
+ * Deallocate the sessions torn down since the last call, apart from
+ * any that a worker is still draining.  Called once per pass of the
+ * event loop, after all the events of the pass have been handled.
+ */
+void session_sweep(void) {
+    SESSION **link = &graveyard;
+    while(*link != NULL) {
+	SESSION *session = *link;
+	if(session->busy) {
+	    link = &session->next;
+	} else {
+	    *link = session->next;
+	    session_fini(session);
+	}
+    }
 }
 
 /*
@@ -172,61 +493,179 @@ void session_kill(SESSION *session) {
  * be set to some other session, or to NULL if there is none.
  */
 void session_fini(SESSION *session) {
+    if(!session->dead)
+	leave(session);
+    stats_forget(session);
+    if(session->log != NULL) {
+	vscreen_log(session->vscreen, NULL);
+	log_close(session->log);
+    }
+    if(session->record != NULL)
+	log_close(session->record);
     vscreen_fini(session->vscreen);
+    free(session->rbuf);
+    free(session->wbuf);
     free(session);
 }
 
+/*
+ * Find the session with a given number.  Returns NULL if there is none.
+ */
+SESSION *session_get(int sid) {
+    if(sid < 0 || sid >= used_slots)
+	return NULL;
+    return sessions[sid];
+}
 
+/*
+ * Find the session whose pty has a given file descriptor.  Returns NULL
+ * if there is none.
+ */
+SESSION *session_find_fd(int fd) {
+    if(fd < 0 || fd >= num_fds)
+	return NULL;
+    return by_fd[fd];
+}
 
-void exit_error(){
-    if(errno){
-        set_status(strerror(errno));
-    }
-
-    for(int i = 0; i < MAX_SESSIONS; i++){
-        if(sessions[i]== NULL)
-            continue;
-        session_kill(sessions[i]);
-        session_fini(sessions[i]);
-
+/*
+ * Find the session whose session leader has a given process ID.
+ * Returns NULL if there is none.
+ */
+SESSION *session_find_pid(int pid) {
+    if(num_buckets == 0)
+	return NULL;
+    SESSION *session = by_pid[PID_HASH(pid) & (num_buckets - 1)];
+    while(session != NULL && session->pid != pid)
+	session = session->pid_next;
+    return session;
+}
 
+/*
+ * Helper function to enter a new session in the registry, giving it a
+ * number.
+ */
+static void enter(SESSION *session) {
+    if(num_free > 0) {
+	session->sid = free_slots[--num_free];
+    } else {
+	if(used_slots == num_slots) {
+	    int size = num_slots;
+	    sessions = grow(sessions, sizeof(SESSION *), &num_slots,
+			    used_slots + 1);
+	    free_slots = grow(free_slots, sizeof(int), &size, used_slots + 1);
+	}
+	session->sid = used_slots++;
+    }
+    sessions[session->sid] = session;
+
+    if(session->ptyfd >= num_fds)
+	by_fd = grow(by_fd, sizeof(SESSION *), &num_fds, session->ptyfd + 1);
+    by_fd[session->ptyfd] = session;
+
+    // The hash table is rebuilt twice the size when there would be
+    // more sessions than chains.
+    if(session_count + 1 > num_buckets) {
+	int size = num_buckets ? num_buckets * 2 : SESSION_SLOTS;
+	free(by_pid);
+	if((by_pid = calloc(size, sizeof(SESSION *))) == NULL)
+	    exit_error();
+	num_buckets = size;
+	for(SESSION *s = session_list; s != NULL; s = s->next) {
+	    SESSION **chain = &by_pid[PID_HASH(s->pid) & (size - 1)];
+	    s->pid_next = *chain;
+	    *chain = s;
+	}
     }
+    SESSION **chain = &by_pid[PID_HASH(session->pid) & (num_buckets - 1)];
+    session->pid_next = *chain;
+    *chain = session;
+
+    session->prev = NULL;
+    session->next = session_list;
+    if(session_list != NULL)
+	session_list->prev = session;
+    session_list = session;
+    session_count++;
+}
 
-    exit(EXIT_FAILURE);
+/*
+ * Helper function to remove a session from the registry, freeing its
+ * number for a new session.
+ */
+static void leave(SESSION *session) {
+    sessions[session->sid] = NULL;
+    free_slots[num_free++] = session->sid;
+    by_fd[session->ptyfd] = NULL;
+
+    SESSION **chain = &by_pid[PID_HASH(session->pid) & (num_buckets - 1)];
+    while(*chain != session)
+	chain = &(*chain)->pid_next;
+    *chain = session->pid_next;
+
+    if(session->prev != NULL)
+	session->prev->next = session->next;
+    else
+	session_list = session->next;
+    if(session->next != NULL)
+	session->next->prev = session->prev;
+    session_count--;
+}
 
+/*
+ * Helper function to enlarge a table of entries of elem bytes to hold
+ * at least min entries, doubling its size, which is updated.  The new
+ * entries are zeroed.
+ */
+static void *grow(void *table, size_t elem, int *size, int min) {
+    int n = *size ? *size : SESSION_SLOTS;
+    while(n < min)
+	n *= 2;
+    char *t = realloc(table, n * elem);
+    if(t == NULL)
+	exit_error();
+    memset(t + *size * elem, 0, (n - *size) * elem);
+    *size = n;
+    return t;
 }
 
-void sigchld_handler(int sig){
-    //int i;
-    pid_t pid;
-    int old = errno;
-    if(sig == SIGCHLD){
-        while((pid = waitpid(-1,NULL,WNOHANG)) > 0){
-        }
+void exit_error(){
+    if(errno){
+        set_status(strerror(errno));
     }
 
-    errno = old;
-}
+    while(session_list != NULL)
+        session_kill(session_list);
 
-void sigalrm_handler(int sig){
-    time_t mytime = time(NULL);
-    char * time_str = ctime(&mytime);
-    time_str[strlen(time_str)-6] = '\0';
-    set(time_str + 11);
-    alarm(1);
+    exit(EXIT_FAILURE);
 
 }
 
-void set(char* s){
-    mvwprintw(status_screen, 0,COLS - 8,s);
-    wrefresh(status_screen);
+/*
+ * Reap any session leaders that have terminated, and tear down their
+ * sessions, picking a new foreground session if need be.  Called from
+ * the event loop when SIGCHLD has been received through its signalfd.
+ * Output the leader left in the pty is read first, so that its screen
+ * is complete up to the end.  A leader killed with the session (see
+ * session_kill()) is no longer in the registry, and is just reaped.
+ */
+void session_reap(void){
+    pid_t pid;
+    char s[64];
+    while((pid = waitpid(-1,NULL,WNOHANG)) > 0){
+        SESSION *session = session_find_pid(pid);
+        if(session == NULL)
+            continue;
+        sprintf(s, "Session %d exited", session->sid);
+        if(!session->error && !session->busy)
+            session_drain(session);
+        fg(session);
+        teardown(session);
+        set_status(s);
+    }
 }
 
-
 void help_init(){
-    if(help!= NULL){
-        helpvscreen = vscreen_init();
-    }
+    helpvscreen = vscreen_init();
 }
 
 void help_fini(){
@@ -0,0 +1,249 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "ecran.h"
+#include "snapshot.h"
+
+/*
+ * Snapshots of screens.
+ *
+ * Given -M, the rows of each virtual screen, scrollback and all, are
+ * kept in a file in the directory given, mapped into memory, rather
+ * than on the heap; so are the tables of attributes and of clusters that
+ * their cells refer to (see vscreen_map()).  Should ecran be killed, or crash, what
+ * was on its screens is left in the files, and the next ecran run with
+ * the same directory maps them back, showing each screen as it was in
+ * a session of its own, running a new shell (see session_restore()).
+ * Nothing is read or copied but the header and the rows shown, so this
+ * takes the same time however much history there is.  When a session
+ * ends, or ecran exits cleanly, its file is removed.
+ *
+ * A file describes itself: it starts with a header giving the kind of
+ * file and the version of its layout, the sizes of the elements of
+ * each row (a cell, or an entry of the attribute table) and of the
+ * line info that goes with a row, and where each is in the file.  A
+ * file that does not match what this ecran would write is not used.
+ * The rows are written in place by the parser as output arrives, but
+ * the rest of the state of a screen (where the top of the ring is, how
+ * much history there is, where the cursor is, and so on) is committed
+ * in one go after each slice of output, to one of two slots in the
+ * header in turn.  Each slot is stamped with a sequence number and a
+ * checksum, so that if ecran stops in the middle of a commit, the
+ * other slot still holds the state before it.  When a screen is laid
+ * out afresh, as it may be when resized, a new file is written beside
+ * the old one, and renamed over it once its state has been committed.
+ *
+ * The files are only ever used by one ecran at a time: the first to
+ * use a directory holds a lock on a file in it for as long as it runs
+ * (see snapshot_lock()), and any other run with the same directory
+ * does without snapshots.
+ */
+
+char *snapshot_dir;       // Directory the snapshots are kept in, or NULL.
+
+static size_t page_round(size_t n);
+static uint64_t checksum(const struct snapshot_slot *slot);
+
+/*
+ * Return the path of the snapshot of the screen of session sid, or of
+ * the attribute table if sid is -1, or of the cluster table if sid is
+ * -2, in a string to be freed.
+ */
+char *snapshot_path(int sid) {
+    char *path;
+    int n = sid == -2 ? asprintf(&path, "%s/clusters", snapshot_dir) :
+	    sid < 0 ? asprintf(&path, "%s/attrs", snapshot_dir) :
+		      asprintf(&path, "%s/screen.%d", snapshot_dir, sid);
+    if(n == -1)
+	exit_error();
+    return path;
+}
+
+/*
+ * Lock the snapshot directory for this process, for as long as it
+ * runs, so that no other ecran takes over the files in it.  Returns
+ * zero if another ecran holds the lock, or it cannot be taken.
+ */
+int snapshot_lock(void) {
+    char *path;
+    if(asprintf(&path, "%s/lock", snapshot_dir) == -1)
+	exit_error();
+    // The descriptor is left open, and the lock held, until exit.
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    free(path);
+    if(fd == -1)
+	return 0;
+    if(flock(fd, LOCK_EX | LOCK_NB) == -1) {
+	close(fd);
+	return 0;
+    }
+    return 1;
+}
+
+/*
+ * Set *sids to an array (to be freed) of the numbers of the sessions
+ * whose screens have snapshots, in increasing order.  Returns how many
+ * there are.
+ */
+int snapshot_list(int **sids) {
+    int n = 0, size = 0;
+    *sids = NULL;
+    DIR *dir = opendir(snapshot_dir);
+    if(dir == NULL)
+	return 0;
+    struct dirent *entry;
+    while((entry = readdir(dir)) != NULL) {
+	int sid, len = 0;
+	if(sscanf(entry->d_name, "screen.%d%n", &sid, &len) != 1 ||
+	   entry->d_name[len] != '\0' || sid < 0)
+	    continue;
+	if(n == size) {
+	    size = size ? size * 2 : 16;
+	    if((*sids = realloc(*sids, size * sizeof(int))) == NULL)
+		exit_error();
+	}
+	int i = n++;
+	for(; i > 0 && (*sids)[i - 1] > sid; i--)
+	    (*sids)[i] = (*sids)[i - 1];
+	(*sids)[i] = sid;
+    }
+    closedir(dir);
+    return n;
+}
+
+/*
+ * Create a snapshot file of a given kind, with room for rows rows of
+ * stride elements of elem_size bytes, and line info of info_size bytes
+ * for each, all zero, and map it.  The space is allocated up front, so
+ * that writing to the mapping never finds the disk full.  Returns the
+ * header, or NULL if the file cannot be made.
+ */
+struct snapshot_header *snapshot_create(const char *path, int kind,
+					int elem_size, int stride, int rows,
+					int info_size) {
+    size_t data = page_round(sizeof(struct snapshot_header));
+    size_t info = page_round(data + (size_t)rows * stride * elem_size);
+    size_t size = page_round(info + (size_t)rows * info_size);
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if(fd == -1)
+	return NULL;
+    struct snapshot_header *map = MAP_FAILED;
+    if(posix_fallocate(fd, 0, size) == 0)
+	map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(map == MAP_FAILED) {
+	unlink(path);
+	return NULL;
+    }
+    map->version = SNAPSHOT_VERSION;
+    map->kind = kind;
+    map->header_size = sizeof(struct snapshot_header);
+    map->elem_size = elem_size;
+    map->info_size = info_size;
+    map->stride = stride;
+    map->rows = rows;
+    map->data = data;
+    map->info = info;
+    map->size = size;
+    memcpy(map->magic, SNAPSHOT_MAGIC, sizeof(map->magic));
+    return map;
+}
+
+/*
+ * Map a snapshot file left by an earlier ecran, if it is of the kind
+ * given, and laid out as this one would lay it out.  Returns the header,
+ * or NULL if there is no such file.
+ */
+struct snapshot_header *snapshot_open(const char *path, int kind,
+				      int elem_size, int info_size) {
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if(fd == -1)
+	return NULL;
+    struct stat st;
+    struct snapshot_header *map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size >= sizeof(struct snapshot_header))
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+		   0);
+    close(fd);
+    if(map == MAP_FAILED)
+	return NULL;
+    uint64_t cells = (uint64_t)map->rows * map->stride * map->elem_size;
+    if(memcmp(map->magic, SNAPSHOT_MAGIC, sizeof(map->magic)) != 0 ||
+       map->version != SNAPSHOT_VERSION || map->kind != kind ||
+       map->header_size != sizeof(struct snapshot_header) ||
+       map->elem_size != elem_size || map->info_size != info_size ||
+       map->size != st.st_size || map->data < map->header_size ||
+       map->data % 64 != 0 || map->info < map->data + cells ||
+       map->info + (uint64_t)map->rows * info_size > map->size) {
+	munmap(map, st.st_size);
+	return NULL;
+    }
+    return map;
+}
+
+/*
+ * Commit the state of a screen to its snapshot, in the slot not holding
+ * the last state committed.
+ */
+void snapshot_commit(struct snapshot_header *map,
+		     const struct snapshot_state *state) {
+    uint64_t seq = (map->slot[0].seq > map->slot[1].seq ?
+		    map->slot[0].seq : map->slot[1].seq) + 1;
+    struct snapshot_slot *slot = &map->slot[seq & 1];
+    __atomic_store_n(&slot->seq, 0, __ATOMIC_RELEASE);
+    memcpy(&slot->state, state, sizeof(*state));
+    slot->check = checksum(slot) ^ seq;
+    __atomic_store_n(&slot->seq, seq, __ATOMIC_RELEASE);
+}
+
+/*
+ * Read the last state committed to a snapshot whole.  Returns -1 if
+ * there is none.
+ */
+int snapshot_state(struct snapshot_header *map, struct snapshot_state *state) {
+    struct snapshot_slot *best = NULL;
+    for(int i = 0; i < 2; i++) {
+	struct snapshot_slot *slot = &map->slot[i];
+	if(slot->seq != 0 && slot->check == (checksum(slot) ^ slot->seq) &&
+	   (best == NULL || slot->seq > best->seq))
+	    best = slot;
+    }
+    if(best == NULL)
+	return -1;
+    memcpy(state, &best->state, sizeof(*state));
+    return 0;
+}
+
+/*
+ * Unmap a snapshot file, leaving it as it is.
+ */
+void snapshot_close(struct snapshot_header *map) {
+    munmap(map, map->size);
+}
+
+/*
+ * Helper function to round a size up to a whole number of pages.
+ */
+static size_t page_round(size_t n) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    return (n + page - 1) / page * page;
+}
+
+/*
+ * Helper function to compute the FNV-1a hash of the state in a slot.
+ */
+static uint64_t checksum(const struct snapshot_slot *slot) {
+    const unsigned char *p = (const unsigned char *)&slot->state;
+    uint64_t h = 14695981039346656037ULL;
+    for(size_t i = 0; i < sizeof(slot->state); i++)
+	h = (h ^ p[i]) * 1099511628211ULL;
+    return h;
+}
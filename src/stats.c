@@ -0,0 +1,421 @@
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "ecran.h"
+#include "status.h"
+#include "stats.h"
+
+/*
+ * Performance counters.
+ *
+ * Each session counts the reads of its pty that returned output (the
+ * bytes read are its output counter, as for the status line), the time
+ * spent parsing them, the writes of input to its pty and the bytes
+ * written, and the time spent drawing its screen.  When a session ends,
+ * its counters are added to those of the sessions that have ended, so
+ * that the totals cover the whole run.  The event loop counts frames:
+ * those that sent something to the terminal, those that had nothing to
+ * send, and those held back because the terminal was not taking its
+ * output, and the time spent drawing them.
+ *
+ * The latency from a key being forwarded to a session (by
+ * session_putc()) to the first frame drawn after the session has had
+ * output since, which is usually its echo, goes into a histogram with
+ * buckets of powers of two.  Only the first key of a burst is timed,
+ * until the frame that ends it: keys typed while one is being timed
+ * would otherwise be timed from when they were typed, after the work
+ * of echoing the first had begun.
+ *
+ * The counters are shown on the stats screen (CTRL-a i), which is
+ * brought up to date on every tick of the clock, and given -J, are
+ * written as JSON to the path given on CTRL-a j, or when ecran is sent
+ * SIGUSR1.  If the path is that of a socket, which something is
+ * listening on, the JSON is sent to it; otherwise it is written to a
+ * file there, which is replaced whole, so that it can be read at any
+ * time.
+ */
+
+/*
+ * How long the JSON can take to be sent to a socket, in milliseconds,
+ * before the rest of it is dropped.
+ */
+#define STATS_TIMEOUT 100
+
+char *stats_path;
+
+static struct counters ended;        // The sessions that have ended,
+static unsigned long ended_output;   //   and their output.
+static unsigned long frames_sent, frames_idle, frames_held;
+static unsigned long frames_ns;      // Time spent drawing frames.
+static unsigned long latency[STATS_BUCKETS];
+static SESSION *waiting;             // Session a key is being timed for,
+static unsigned long key_ns;         //   when the key was forwarded,
+static unsigned long key_output;     //   and its output by then.
+static int screen_lines;             // Lines written to the stats screen.
+
+static void record(unsigned long ns);
+static unsigned long bucket_us(int i);
+static int duration_text(char *s, unsigned long us);
+static unsigned long percentile(unsigned long keys, int percent);
+static void add_counters(struct counters *to, SESSION *session);
+static void print(VSCREEN *vscreen, const char *fmt, ...);
+static void session_row(VSCREEN *vscreen, char *name, unsigned long output,
+			struct counters *c, int queue);
+static void json(FILE *f);
+static void json_counters(FILE *f, unsigned long output, struct counters *c);
+static int send_out(int fd, const char *buf, size_t len);
+
+/*
+ * Return the time on the monotonic clock, in nanoseconds, for timing
+ * with.
+ */
+unsigned long stats_clock(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000UL + ts.tv_nsec;
+}
+
+/*
+ * Note that a key has been forwarded to a session, to time its echo,
+ * unless a key is already being timed for it.
+ */
+void stats_key(SESSION *session) {
+    if(waiting == session)
+	return;
+    waiting = session;
+    key_ns = stats_clock();
+    key_output = __atomic_load_n(&session->output, __ATOMIC_RELAXED);
+}
+
+/*
+ * Count a frame, which took ns nanoseconds to draw, and sent something
+ * to the terminal if sent is positive, had nothing to send if it is
+ * zero, or was held back if it is negative.  If the session a key is
+ * being timed for has had output since, it has been drawn (unless the
+ * session is no longer shown, when the key is forgotten).
+ */
+void stats_frame(int sent, unsigned long ns) {
+    if(sent > 0)
+	frames_sent++;
+    else if(sent == 0)
+	frames_idle++;
+    else
+	frames_held++;
+    frames_ns += ns;
+    if(waiting == NULL || sent < 0 ||
+       __atomic_load_n(&waiting->output, __ATOMIC_RELAXED) == key_output)
+	return;
+    if(waiting->pane != NULL)
+	record(stats_clock() - key_ns);
+    waiting = NULL;
+}
+
+/*
+ * Take the counters of a session that is being deallocated into those
+ * of the sessions that have ended.
+ */
+void stats_forget(SESSION *session) {
+    add_counters(&ended, session);
+    ended_output += session->output;
+    if(waiting == session)
+	waiting = NULL;
+}
+
+/*
+ * Fill in the stats screen, which is shown like the help screen: the
+ * frames, the latency histogram, and the counters of as many sessions,
+ * in order of their numbers, as there is room for.
+ */
+void stats_write(VSCREEN *vscreen) {
+    char a[16], b[16], c[16];
+    unsigned long keys = 0;
+    for(int i = 0; i < STATS_BUCKETS; i++)
+	keys += latency[i];
+    screen_lines = 0;
+    vscreen_write(vscreen, "\033[H\033[2J", 7);
+    print(vscreen, "Performance Counters");
+    print(vscreen, "----------------------------");
+    print(vscreen, "Frames: %lu sent, %lu with nothing to send, %lu held back",
+	  frames_sent, frames_idle, frames_held);
+    print(vscreen, "Drawing: %.1f ms in all, %.1f us per frame sent",
+	  frames_ns / 1e6, frames_sent ? frames_ns / 1e3 / frames_sent : 0.0);
+    if(keys > 0) {
+	duration_text(a, percentile(keys, 50));
+	duration_text(b, percentile(keys, 90));
+	duration_text(c, percentile(keys, 99));
+	print(vscreen, "Key to echo: %lu keys, half under %s, 90%% under %s, "
+	      "99%% under %s", keys, a, b, c);
+	int first = 0, last = STATS_BUCKETS - 1;
+	while(latency[first] == 0)
+	    first++;
+	while(latency[last] == 0)
+	    last--;
+	for(int i = first; i <= last; i++) {
+	    char bar[41];
+	    int n = latency[i] * 40 / keys;
+	    memset(bar, '#', n);
+	    bar[n] = '\0';
+	    duration_text(a, bucket_us(i));
+	    print(vscreen, "  %s %-7s %8lu %s", i < STATS_BUCKETS - 1 ?
+		  "under" : "over ", a, latency[i], bar);
+	}
+    } else {
+	print(vscreen, "Key to echo: no keys yet");
+    }
+    print(vscreen, "");
+    print(vscreen, "Session    Read   Reads  B/read  Written  Writes "
+	  " Parse ms  Draw ms  Queue");
+
+    // Room is left for the totals, and for a line saying how many
+    // sessions there was no room for.
+    struct counters total = ended;
+    unsigned long output = ended_output;
+    int room = LINES - 1 - screen_lines - 3, shown = 0;
+    for(int sid = 0, n = 0; n < session_count; sid++) {
+	SESSION *session = session_get(sid);
+	if(session == NULL)
+	    continue;
+	n++;
+	add_counters(&total, session);
+	output += __atomic_load_n(&session->output, __ATOMIC_RELAXED);
+	if(shown < room || (shown == room && n == session_count)) {
+	    struct counters s = { 0 };
+	    add_counters(&s, session);
+	    sprintf(a, "%d%s", sid, session == fg_session ? "*" : "");
+	    session_row(vscreen, a, __atomic_load_n(&session->output,
+						    __ATOMIC_RELAXED),
+			&s, session->wtail - session->whead);
+	    shown++;
+	}
+    }
+    if(shown < session_count)
+	print(vscreen, "(%d more sessions)", session_count - shown);
+    session_row(vscreen, "ended", ended_output, &ended, 0);
+    session_row(vscreen, "total", output, &total, 0);
+}
+
+/*
+ * Write the counters as JSON to the path given with -J.  Returns 0 if
+ * they were written, or -1 with errno set if not.
+ */
+int stats_dump(void) {
+    char *buf;
+    size_t len;
+    if(stats_path == NULL) {
+	errno = ENOENT;
+	return -1;
+    }
+    FILE *f = open_memstream(&buf, &len);
+    if(f == NULL)
+	return -1;
+    json(f);
+    fclose(f);
+
+    int r = -1;
+    struct stat st;
+    if(stat(stats_path, &st) == 0 && S_ISSOCK(st.st_mode)) {
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	struct timeval tv = { 0, STATS_TIMEOUT * 1000 };
+	int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if(strlen(stats_path) >= sizeof(addr.sun_path)) {
+	    errno = ENAMETOOLONG;
+	} else if(fd != -1) {
+	    strcpy(addr.sun_path, stats_path);
+	    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+	    if(connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+		r = send_out(fd, buf, len);
+	}
+	if(fd != -1)
+	    close(fd);
+    } else {
+	// The new file takes the place of the old one only once it is
+	// complete.
+	char tmp[strlen(stats_path) + 5];
+	sprintf(tmp, "%s.new", stats_path);
+	int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if(fd != -1) {
+	    r = send_out(fd, buf, len);
+	    if(close(fd) == -1 || (r == 0 && rename(tmp, stats_path) == -1))
+		r = -1;
+	    if(r == -1)
+		unlink(tmp);
+	}
+    }
+    int error = errno;
+    free(buf);
+    errno = error;
+    return r;
+}
+
+/*
+ * Helper function to put the latency of a key into its bucket.
+ */
+static void record(unsigned long ns) {
+    int i = 0;
+    while(i < STATS_BUCKETS - 1 && ns / 1000 >= bucket_us(i))
+	i++;
+    latency[i]++;
+}
+
+/*
+ * Helper function to return the bound of bucket i of the histogram,
+ * in microseconds: the latencies counted in it are under this, or for
+ * the last bucket, at least the bound of the one before.
+ */
+static unsigned long bucket_us(int i) {
+    if(i == STATS_BUCKETS - 1)
+	i--;
+    return 1UL << (STATS_MIN_SHIFT + i);
+}
+
+/*
+ * Helper function to write a duration, given in microseconds, in a few
+ * characters, as in "512us", "4.1ms" or "131ms".  Returns the number of
+ * characters written.
+ */
+static int duration_text(char *s, unsigned long us) {
+    if(us < 1000)
+	return sprintf(s, "%luus", us);
+    if(us < 10000)
+	return sprintf(s, "%.1fms", us / 1e3);
+    return sprintf(s, "%lums", us / 1000);
+}
+
+/*
+ * Helper function to return the bound of the bucket of the histogram
+ * under which (at least) percent percent of the keys timed fall.
+ */
+static unsigned long percentile(unsigned long keys, int percent) {
+    unsigned long n = 0;
+    for(int i = 0; i < STATS_BUCKETS; i++) {
+	n += latency[i];
+	if(n * 100 >= keys * percent)
+	    return bucket_us(i);
+    }
+    return bucket_us(STATS_BUCKETS - 1);
+}
+
+/*
+ * Helper function to add the counters of a session to others.  Those
+ * that the workers update are read with atomic loads.
+ */
+static void add_counters(struct counters *to, SESSION *session) {
+    struct counters *c = &session->counters;
+    to->reads += __atomic_load_n(&c->reads, __ATOMIC_RELAXED);
+    to->parse_ns += __atomic_load_n(&c->parse_ns, __ATOMIC_RELAXED);
+    to->writes += c->writes;
+    to->written += c->written;
+    to->render_ns += c->render_ns;
+}
+
+/*
+ * Helper function to write a line of the stats screen.
+ */
+static void print(VSCREEN *vscreen, const char *fmt, ...) {
+    char s[256];
+    va_list ap;
+    va_start(ap, fmt);
+    int n = vsnprintf(s, sizeof(s), fmt, ap);
+    va_end(ap);
+    if(screen_lines++ > 0)
+	vscreen_write(vscreen, "\r\n", 2);
+    vscreen_write(vscreen, s, n < sizeof(s) ? n : sizeof(s) - 1);
+}
+
+/*
+ * Helper function to write the line of the stats screen for a session,
+ * or for the totals.
+ */
+static void session_row(VSCREEN *vscreen, char *name, unsigned long output,
+			struct counters *c, int queue) {
+    char read[16], per[16], written[16];
+    status_size(read, output);
+    status_size(per, c->reads ? output / c->reads : 0);
+    status_size(written, c->written);
+    print(vscreen, "%-7s %7s %7lu %7s %8s %7lu %9.1f %8.1f %6d", name,
+	  read, c->reads, per, written, c->writes, c->parse_ns / 1e6,
+	  c->render_ns / 1e6, queue);
+}
+
+/*
+ * Helper function to write the counters as JSON.
+ */
+static void json(FILE *f) {
+    struct counters total = ended;
+    unsigned long output = ended_output;
+    fprintf(f, "{\"time\":%ld,\"pid\":%d,\"sessions\":[", (long)time(NULL),
+	    getpid());
+    for(int sid = 0, n = 0; n < session_count; sid++) {
+	SESSION *session = session_get(sid);
+	if(session == NULL)
+	    continue;
+	struct counters c = { 0 };
+	add_counters(&c, session);
+	add_counters(&total, session);
+	unsigned long out = __atomic_load_n(&session->output,
+					    __ATOMIC_RELAXED);
+	output += out;
+	fprintf(f, "%s{\"sid\":%d,\"pid\":%d,\"foreground\":%s,", n ? "," : "",
+		sid, session->pid, session == fg_session ? "true" : "false");
+	json_counters(f, out, &c);
+	fprintf(f, ",\"queue\":%u}", session->wtail - session->whead);
+	n++;
+    }
+    fprintf(f, "],\"ended\":{");
+    json_counters(f, ended_output, &ended);
+    fprintf(f, "},\"total\":{");
+    json_counters(f, output, &total);
+    fprintf(f, "},\"frames\":{\"sent\":%lu,\"idle\":%lu,\"held\":%lu,"
+	    "\"render_ns\":%lu},\"latency_us\":[", frames_sent, frames_idle,
+	    frames_held, frames_ns);
+    for(int i = 0; i < STATS_BUCKETS; i++) {
+	if(i < STATS_BUCKETS - 1)
+	    fprintf(f, "%s{\"le\":%lu,", i ? "," : "", bucket_us(i));
+	else
+	    fprintf(f, ",{\"le\":null,");
+	fprintf(f, "\"count\":%lu}", latency[i]);
+    }
+    fprintf(f, "]}\n");
+}
+
+/*
+ * Helper function to write the counters of a session, or the totals,
+ * as JSON members.
+ */
+static void json_counters(FILE *f, unsigned long output, struct counters *c) {
+    fprintf(f, "\"bytes_read\":%lu,\"reads\":%lu,\"bytes_per_read\":%lu,"
+	    "\"bytes_written\":%lu,\"writes\":%lu,\"parse_ns\":%lu,"
+	    "\"render_ns\":%lu", output, c->reads,
+	    c->reads ? output / c->reads : 0, c->written, c->writes,
+	    c->parse_ns, c->render_ns);
+}
+
+/*
+ * Helper function to write a buffer out in full.  Returns 0 if it was,
+ * or -1 if not.
+ */
+static int send_out(int fd, const char *buf, size_t len) {
+    while(len > 0) {
+	ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+	if(n == -1 && errno == ENOTSOCK)
+	    n = write(fd, buf, len);
+	if(n == -1 && errno == EINTR)
+	    continue;
+	if(n <= 0)
+	    return -1;
+	buf += n;
+	len -= n;
+    }
+    return 0;
+}
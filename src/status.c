@@ -0,0 +1,236 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include "ecran.h"
+#include "render.h"
+#include "status.h"
+
+/*
+ * The status line.
+ *
+ * What the status line is to show is kept here, and the event loop
+ * draws it once per frame (see mainloop_step()), rather than each time
+ * something on it changes.  The line is formatted afresh each frame,
+ * and only the columns that differ from what was drawn the last time
+ * are drawn again; if none do, nothing is drawn, and nothing is sent
+ * to the terminal.  The renderer keeps what has been drawn, so the
+ * whole line is only drawn again when the terminal is resized.
+ *
+ * Given -F, the line is laid out by a template, in which
+ *   %m  is the last message set with set_status(),
+ *   %c  the time, as HH:MM:SS, and %C the time as HH:MM,
+ *   %w  the numbers of the sessions, the foreground session marked
+ *       with '*', the others shown in panes with '-', and those not
+ *       shown with '#' if they have had output since they last were,
+ *   %W  the same, each followed by the bytes of output it has had per
+ *       second over the last second, as in "2#:14K",
+ *   %r  the bytes of output per second of the foreground session,
+ *   %=  puts what follows at the right of the line, and
+ *   %%  is a percent sign.
+ * The default is STATUS_FORMAT.  The clock and the rates of output
+ * change only on the ticks of the clock of the event loop, once a
+ * second, so with a template without them, the status line costs
+ * nothing at all while the sessions are quiet.
+ */
+
+char *status_format = STATUS_FORMAT;
+
+static char message[STATUS_MESSAGE];
+static time_t now;           // When the clock last ticked.
+static char *drawn;          // The line as last drawn, or NULL to draw
+static int drawn_line;       //   it all again, on line drawn_line of a
+static int drawn_cols;       //   terminal drawn_cols wide.
+
+/*
+ * Text of one side of the line, up to max characters.
+ */
+struct side {
+    char *s;
+    int len, max;
+};
+
+static void format(struct side *left, struct side *right);
+static void add(struct side *side, const char *s, int n);
+static void add_sessions(struct side *side, int rates);
+
+/*
+ * Replace the message shown on the status line, where the template has
+ * it.  It is drawn with the next frame.
+ */
+void status_message(char *text) {
+    snprintf(message, sizeof(message), "%s", text);
+}
+
+/*
+ * Advance the clock, and work out the rate of output of each session
+ * over the seconds since the last tick.  Called from the event loop on
+ * each tick of its timerfd, with the number of seconds since the last.
+ */
+void status_tick(unsigned long seconds) {
+    now = time(NULL);
+    if(seconds == 0)
+	seconds = 1;
+    for(SESSION *session = session_list; session != NULL;
+	session = session->next) {
+	unsigned long output = __atomic_load_n(&session->output,
+					       __ATOMIC_RELAXED);
+	session->rate = (output - session->ticked) / seconds;
+	session->ticked = output;
+    }
+}
+
+/*
+ * Forget what the status line was drawn as, so that it is drawn in full
+ * with the next frame, as it must be once the terminal is resized.
+ */
+void status_invalidate(void) {
+    free(drawn);
+    drawn = NULL;
+}
+
+/*
+ * Draw the status line as the template lays it out, if it differs from
+ * what was drawn last.  Only the columns from the first that differs
+ * to the last are drawn.  Called by the event loop before each frame.
+ */
+void status_render(void) {
+    int cols = COLS, line = LINES - 1;
+    char l[cols], r[cols], text[cols + 1];
+    struct side left = { l, 0, cols }, right = { r, 0, cols };
+    if(now == 0)
+	now = time(NULL);
+    format(&left, &right);
+
+    // Whatever the right side leaves room for of the left goes first.
+    int n = left.len < cols - right.len ? left.len : cols - right.len;
+    memcpy(text, l, n);
+    memset(text + n, ' ', cols - n - right.len);
+    memcpy(text + cols - right.len, r, right.len);
+
+    int lo = 0, hi = cols;
+    if(drawn != NULL && drawn_line == line && drawn_cols == cols) {
+	while(lo < cols && text[lo] == drawn[lo])
+	    lo++;
+	if(lo == cols)
+	    return;
+	while(text[hi - 1] == drawn[hi - 1])
+	    hi--;
+    } else {
+	free(drawn);
+	if((drawn = malloc(cols)) == NULL)
+	    exit_error();
+	drawn_line = line;
+	drawn_cols = cols;
+    }
+    memcpy(drawn + lo, text + lo, hi - lo);
+    text[hi] = '\0';
+    render_text(line, lo, text + lo, hi);
+}
+
+/*
+ * Write a number of bytes (or of bytes per second) in at most four
+ * characters or so, as in "512", "1.5K" or "14M".  Returns the number
+ * of characters written.
+ */
+int status_size(char *s, unsigned long bytes) {
+    if(bytes < 1024)
+	return sprintf(s, "%lu", bytes);
+    if(bytes < 10 * 1024)
+	return sprintf(s, "%.1fK", bytes / 1024.0);
+    if(bytes < 1024 * 1024)
+	return sprintf(s, "%luK", bytes / 1024);
+    if(bytes < 10 * 1024 * 1024)
+	return sprintf(s, "%.1fM", bytes / (1024.0 * 1024));
+    if(bytes < 1024UL * 1024 * 1024)
+	return sprintf(s, "%luM", bytes / (1024 * 1024));
+    return sprintf(s, "%.1fG", bytes / (1024.0 * 1024 * 1024));
+}
+
+/*
+ * Helper function to lay out the status line by the template, into the
+ * text to go at the left of the line and the text to go at the right.
+ */
+static void format(struct side *left, struct side *right) {
+    struct side *side = left;
+    char s[32];
+    struct tm tm;
+    localtime_r(&now, &tm);
+    for(char *p = status_format; *p != '\0'; p++) {
+	if(*p != '%' || p[1] == '\0') {
+	    add(side, p, 1);
+	    continue;
+	}
+	switch(*++p) {
+	case 'm':
+	    add(side, message, strlen(message));
+	    break;
+	case 'c':
+	    add(side, s, strftime(s, sizeof(s), "%H:%M:%S", &tm));
+	    break;
+	case 'C':
+	    add(side, s, strftime(s, sizeof(s), "%H:%M", &tm));
+	    break;
+	case 'w':
+	case 'W':
+	    add_sessions(side, *p == 'W');
+	    break;
+	case 'r':
+	    if(fg_session != NULL)
+		add(side, s, status_size(s, fg_session->rate));
+	    break;
+	case '=':
+	    side = right;
+	    break;
+	default:
+	    add(side, p, 1);
+	    break;
+	}
+    }
+}
+
+/*
+ * Helper function to add up to n characters of s to one side of the
+ * line, as many as there is room for.  Characters that the terminal
+ * would not show as they are, such as control characters, are shown
+ * as '?'.
+ */
+static void add(struct side *side, const char *s, int n) {
+    if(n > side->max - side->len)
+	n = side->max - side->len;
+    for(int i = 0; i < n; i++) {
+	unsigned char c = s[i];
+	side->s[side->len++] = c < ' ' || c > '~' ? '?' : c;
+    }
+}
+
+/*
+ * Helper function to add the list of sessions to one side of the line,
+ * in order of their numbers, each with its marker, and its rate of
+ * output if rates is nonzero.  A session shown in a pane is taken to
+ * have been seen up to the output it has had so far.
+ */
+static void add_sessions(struct side *side, int rates) {
+    char s[48];
+    for(int sid = 0, n = 0; n < session_count && side->len < side->max;
+	sid++) {
+	SESSION *session = session_get(sid);
+	if(session == NULL)
+	    continue;
+	unsigned long output = __atomic_load_n(&session->output,
+					       __ATOMIC_RELAXED);
+	int len = sprintf(s, n > 0 ? " %d" : "%d", sid);
+	if(session->pane != NULL) {
+	    session->seen = output;
+	    s[len++] = session == fg_session ? '*' : '-';
+	} else if(output != session->seen) {
+	    s[len++] = '#';
+	}
+	if(rates) {
+	    s[len++] = ':';
+	    len += status_size(s + len, session->rate);
+	}
+	add(side, s, len);
+	n++;
+    }
+}
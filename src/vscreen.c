@@ -1,8 +1,15 @@
 #include <stdlib.h>
-#include <ctype.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
 #include "ecran.h"
 #include "vscreen.h"
+#include "scan.h"
+#include "render.h"
+#include "snapshot.h"
+#include "unicode.h"
 
 /*
  * Functions to implement a virtual screen that can be multiplexed
@@ -13,23 +20,347 @@
 
 WINDOW *main_screen;
 WINDOW *status_screen;
-WINDOW *split_screen1;
-WINDOW *split_screen2;
-WINDOW *help;
+int helpmode;
+int vscreen_history_lines = VSCREEN_HISTORY_LINES;
+long vscreen_history_bytes = VSCREEN_HISTORY_BYTES;
+unsigned long vscreen_render_calls;
 
+/*
+ * The lines of a virtual screen are kept in a ring of rows of cells,
+ * followed (in ring order) by the scrollback history.  Screen line l
+ * lives in ring slot (head + l) % ring_size, and the history lines
+ * occupy the slots just before head, so scrolling the screen up by one
+ * line only advances head and clears the row that becomes the new
+ * bottom line.  The rows are stored one after another in a single
+ * cache-aligned array, each padded to a whole number of cache lines.
+ * The array starts out holding just the screen and doubles in size
+ * as the history fills, up to ring_size rows; it only grows before
+ * the ring first wraps around, so the rows never need rearranging.
+ * A screen kept in a snapshot file (see vscreen_map()) has all of its
+ * ring_size rows in the file from the start.
+ * Alongside each row is kept whether the line it holds wrapped onto
+ * the next row, and for lines of history, the width of the screen they
+ * were written on, so that lines can be rewrapped when the width of
+ * the screen changes (see vscreen_resize()).
+ *
+ * The lines changed since the last sync are recorded in the bitmap
+ * dirty, together with the span of columns changed on each of them.
+ * Lines that have changed across their whole width, as all do when the
+ * screen scrolls, are instead recorded in the bitmap full.  Only the
+ * screens of the sessions shown in panes (see layout.c) are ever
+ * synced; the others just accumulate damage, and count their changes
+ * in generation so that vscreen_changed() can tell whether they need
+ * drawing.
+ *
+ * Output may be parsed on a worker thread (see pool.c) while the main
+ * thread draws, so everything but vscreen_putc() takes the screen's
+ * lock.  Syncing holds it only to copy out what is to be drawn.
+ */
 struct vscreen {
     int num_lines;
     int num_cols;
+    int at_line;           // Where the top left corner is drawn on
+    int at_col;            //   the terminal (see vscreen_place()).
     int cur_line;
     int cur_col;
-    char **lines;
-    char *line_changed;
+    CELL *cells;           // Ring of rows, stride cells apart.
+    struct line_info *info;    // Of each row allocated.
+    int stride;            // Cells per row, including padding.
+    int capacity;          // Number of rows allocated.
+    int ring_size;         // Number of slots in the ring.
+    int head;              // Slot holding the top line of the screen.
+    int history;           // Number of lines of scrollback kept.
+    int max_history;       // Limit on scrollback lines for this screen.
+    int view;              // Lines scrolled back while viewing history.
+    int repaint;           // Draw the history in view with the next sync.
+    int reflow;            // History still to be rewrapped to num_cols.
+    LOG *log;              // Lines are logged here as text (see log.c).
+    unsigned long scrolled;    // Lines ever scrolled into the history.
+    uint64_t *index;       // Signatures of blocks of rows, or NULL (see
+    unsigned long indexed; //   vscreen_search()), and scrolled then.
+    struct snapshot_header *map;   // Snapshot file holding the rows,
+    char *map_path;        //   and its path, or NULL (see vscreen_map()).
+    int map_pending;       // The file is new, to be renamed to map_path.
+    uint64_t *dirty;       // Lines changed since sync.
+    uint64_t *full;        // Lines changed across their width since sync.
+    struct span *damage;   // Columns of each dirty line changed.
+    CELL pen;              // Attribute bits of the cells printed.
+    struct cell_attr attr; // The attributes those bits stand for.
+    int top;               // Scrolling region: lines top
+    int bottom;            //   through bottom.
+    int wrap_pending;      // A character was printed in the last column.
+    int autowrap;          // DECAWM: wrap at the end of the line.
+    int origin;            // DECOM: cursor lines relative to the region.
+    int insert;            // IRM: printing shifts the line right.
+    int graphics;          // G0 is the DEC special graphics set.
+    int saved_line;        // Cursor saved by DECSC.
+    int saved_col;
+    struct cell_attr saved_attr;
+    unsigned char state;   // State of the escape sequence parser.
+    unsigned char utf8_len;    // Length of the UTF-8 sequence being
+    unsigned char utf8_need;   //   decoded, bytes of it still to come,
+    uint32_t utf8;             //   and the bits of it so far.
+    char private;          // Private marker of a control sequence.
+    char intermediate;     // Intermediate byte of an escape sequence.
+    int nparams;           // Parameters of a control sequence.
+    int params[VT_MAX_PARAMS];
+    int reply_len;         // Replies waiting to be sent to the program.
+    char reply[VT_REPLY_SIZE];
+    int bell;              // BEL received since the screen was shown.
+    unsigned long generation;  // Count of changes to the contents.
+    unsigned long synced;      // Generation last shown on the screen.
+    pthread_mutex_t lock;
+};
+
+/*
+ * What is kept of each row of a screen besides its cells: the width of
+ * the screen when it went into the history, and whether the line it
+ * holds carries on in the next row.
+ */
+struct line_info {
+    unsigned short cols;
+    unsigned char wrapped;
+};
+
+/*
+ * A span of columns lo up to (but not including) hi.  A span with
+ * lo >= hi is empty.
+ */
+struct span {
+    int lo;
+    int hi;
+};
+
+/*
+ * A span of cells copied out of a screen by vscreen_sync(), to be drawn
+ * on line line: columns lo up to end are cells, and columns end up to
+ * hi are blank.
+ */
+struct piece {
+    int line;
+    int lo;
+    int end;
+    int hi;
+    CELL *cells;
 };
 
-static void update_line(VSCREEN *vscreen, int l);
+/*
+ * Number of bytes of output parsed at a time by vscreen_write() before
+ * the lock is let go, so that a screen being flooded with output can
+ * still be synced promptly.
+ */
+#define WRITE_SLICE 4096
+
+/*
+ * Rows of the ring in each block of the index kept for searching, and
+ * the number of bits in the signature of a block (a power of two).
+ */
+#define INDEX_BLOCK 64
+#define INDEX_SHIFT 12
+#define INDEX_WORDS ((1 << INDEX_SHIFT) / 64)
+
+#define CACHE_LINE 64
+#define ROW_ALIGN (CACHE_LINE / sizeof(CELL))
+#define BITMAP_WORDS(n) (((n) + 63) / 64)
+
+/*
+ * The attribute table shared by all virtual screens, with a hash
+ * table (holding index + 1, or 0 for an empty bucket) to find the
+ * entry for a combination of attributes.  Should the table ever fill
+ * up, further combinations are shown with the default attributes.
+ * The table may be kept in a snapshot file (see vscreen_map_attrs()).
+ */
+static struct cell_attr attr_table[MAX_ATTRS] = {
+    { COLOR_DEFAULT, COLOR_DEFAULT, 0 }
+};
+static struct cell_attr *attrs = attr_table;
+static struct snapshot_header *attr_map;
+static int num_attrs = 1;
+static unsigned short attr_hash[2 * MAX_ATTRS];
+static pthread_mutex_t attr_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The table of clusters, characters with the marks combined with them,
+ * shared by all virtual screens and kept like the attribute table (see
+ * vscreen_map_clusters()).  A cluster of fewer than CLUSTER_CHARS code
+ * points ends with a zero.  Should the table ever fill up, further
+ * marks are left out.
+ */
+struct cluster {
+    uint32_t chars[CLUSTER_CHARS];
+};
+static struct cluster cluster_table[MAX_CLUSTERS];
+static struct cluster *clusters = cluster_table;
+static struct snapshot_header *cluster_map;
+static int num_clusters;
+static unsigned short cluster_hash[2 * MAX_CLUSTERS];
+static pthread_mutex_t cluster_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * The snapshot taken by vscreen_sync(), which is only ever called from
+ * the main thread.
+ */
+static struct piece *pieces;
+static CELL *piece_cells;
+static int max_pieces;
+static size_t max_piece_cells;
+
+/*
+ * Parser states, byte classes and actions.  An entry of vt_table[]
+ * holds an action in its high four bits and the next state in its
+ * low four bits.
+ */
+enum { S_GROUND, S_ESC, S_ESC_INTER, S_CSI_ENTRY, S_CSI_PARAM,
+       S_CSI_INTER, S_CSI_IGNORE, S_OSC, S_STRING, S_COUNT };
+
+enum { C_CTL,      // C0 controls not listed below
+       C_BEL,      // BEL, which also ends an OSC string
+       C_CAN,      // CAN and SUB, which abort a sequence
+       C_ESC,
+       C_INTER,    // 0x20-0x2f: space and intermediates
+       C_PARAM,    // digits, ':' and ';'
+       C_PRIV,     // '<', '=', '>', '?'
+       C_CSI,      // '['
+       C_OSC,      // ']'
+       C_STR,      // 'P', 'X', '^', '_': DCS, SOS, PM, APC
+       C_FINAL,    // the rest of 0x40-0x7e
+       C_DEL,
+       C_HIGH,     // 0x80-0xff, which make up UTF-8 sequences
+       C_COUNT };
+
+enum { A_NONE, A_PRINT, A_EXEC, A_CLEAR, A_COLLECT, A_PRIVATE, A_PARAM,
+       A_ESC, A_CSI, A_UTF8 };
+
+static const unsigned char vt_class[256] = {
+    [0x00 ... 0x1f] = C_CTL,
+    [0x07] = C_BEL,
+    [0x18] = C_CAN, [0x1a] = C_CAN,
+    [0x1b] = C_ESC,
+    [0x20 ... 0x2f] = C_INTER,
+    [0x30 ... 0x3b] = C_PARAM,
+    [0x3c ... 0x3f] = C_PRIV,
+    [0x40 ... 0x7e] = C_FINAL,
+    ['['] = C_CSI,
+    [']'] = C_OSC,
+    ['P'] = C_STR, ['X'] = C_STR, ['^'] = C_STR, ['_'] = C_STR,
+    [0x7f] = C_DEL,
+    [0x80 ... 0xff] = C_HIGH,
+};
+
+#define T(action, state) ((action) << 4 | (state))
+
+static const unsigned char vt_table[S_COUNT][C_COUNT] = {
+    [S_GROUND] = {
+	T(A_EXEC, S_GROUND),    T(A_EXEC, S_GROUND),    T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_PRINT, S_GROUND),   T(A_PRINT, S_GROUND),
+	T(A_PRINT, S_GROUND),   T(A_PRINT, S_GROUND),   T(A_PRINT, S_GROUND),
+	T(A_PRINT, S_GROUND),   T(A_PRINT, S_GROUND),   T(A_NONE, S_GROUND),
+	T(A_UTF8, S_GROUND) },
+    [S_ESC] = {
+	T(A_EXEC, S_ESC),       T(A_EXEC, S_ESC),       T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_COLLECT, S_ESC_INTER), T(A_ESC, S_GROUND),
+	T(A_ESC, S_GROUND),     T(A_CLEAR, S_CSI_ENTRY), T(A_NONE, S_OSC),
+	T(A_NONE, S_STRING),    T(A_ESC, S_GROUND),     T(A_NONE, S_ESC),
+	T(A_NONE, S_GROUND) },
+    [S_ESC_INTER] = {
+	T(A_EXEC, S_ESC_INTER), T(A_EXEC, S_ESC_INTER), T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_COLLECT, S_ESC_INTER), T(A_ESC, S_GROUND),
+	T(A_ESC, S_GROUND),     T(A_ESC, S_GROUND),     T(A_ESC, S_GROUND),
+	T(A_ESC, S_GROUND),     T(A_ESC, S_GROUND),     T(A_NONE, S_ESC_INTER),
+	T(A_NONE, S_GROUND) },
+    [S_CSI_ENTRY] = {
+	T(A_EXEC, S_CSI_ENTRY), T(A_EXEC, S_CSI_ENTRY), T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_COLLECT, S_CSI_INTER), T(A_PARAM, S_CSI_PARAM),
+	T(A_PRIVATE, S_CSI_PARAM), T(A_CSI, S_GROUND),  T(A_CSI, S_GROUND),
+	T(A_CSI, S_GROUND),     T(A_CSI, S_GROUND),     T(A_NONE, S_CSI_ENTRY),
+	T(A_NONE, S_GROUND) },
+    [S_CSI_PARAM] = {
+	T(A_EXEC, S_CSI_PARAM), T(A_EXEC, S_CSI_PARAM), T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_COLLECT, S_CSI_INTER), T(A_PARAM, S_CSI_PARAM),
+	T(A_NONE, S_CSI_IGNORE), T(A_CSI, S_GROUND),    T(A_CSI, S_GROUND),
+	T(A_CSI, S_GROUND),     T(A_CSI, S_GROUND),     T(A_NONE, S_CSI_PARAM),
+	T(A_NONE, S_GROUND) },
+    [S_CSI_INTER] = {
+	T(A_EXEC, S_CSI_INTER), T(A_EXEC, S_CSI_INTER), T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_COLLECT, S_CSI_INTER), T(A_NONE, S_CSI_IGNORE),
+	T(A_NONE, S_CSI_IGNORE), T(A_CSI, S_GROUND),    T(A_CSI, S_GROUND),
+	T(A_CSI, S_GROUND),     T(A_CSI, S_GROUND),     T(A_NONE, S_CSI_INTER),
+	T(A_NONE, S_GROUND) },
+    [S_CSI_IGNORE] = {
+	T(A_EXEC, S_CSI_IGNORE), T(A_EXEC, S_CSI_IGNORE), T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_NONE, S_CSI_IGNORE), T(A_NONE, S_CSI_IGNORE),
+	T(A_NONE, S_CSI_IGNORE), T(A_NONE, S_GROUND),   T(A_NONE, S_GROUND),
+	T(A_NONE, S_GROUND),    T(A_NONE, S_GROUND),    T(A_NONE, S_CSI_IGNORE),
+	T(A_NONE, S_GROUND) },
+    [S_OSC] = {
+	T(A_NONE, S_OSC),       T(A_NONE, S_GROUND),    T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_NONE, S_OSC),       T(A_NONE, S_OSC),
+	T(A_NONE, S_OSC),       T(A_NONE, S_OSC),       T(A_NONE, S_OSC),
+	T(A_NONE, S_OSC),       T(A_NONE, S_OSC),       T(A_NONE, S_OSC),
+	T(A_NONE, S_OSC) },
+    [S_STRING] = {
+	T(A_NONE, S_STRING),    T(A_NONE, S_STRING),    T(A_NONE, S_GROUND),
+	T(A_CLEAR, S_ESC),      T(A_NONE, S_STRING),    T(A_NONE, S_STRING),
+	T(A_NONE, S_STRING),    T(A_NONE, S_STRING),    T(A_NONE, S_STRING),
+	T(A_NONE, S_STRING),    T(A_NONE, S_STRING),    T(A_NONE, S_STRING),
+	T(A_NONE, S_STRING) },
+};
+
+static void vt_print(VSCREEN *vscreen, uint32_t ch);
+static void utf8_start(VSCREEN *vscreen, unsigned char b);
+static void utf8_next(VSCREEN *vscreen, unsigned char b);
+static inline void split_wide(VSCREEN *vscreen, int l, int lo, int hi);
+static void combine_mark(VSCREEN *vscreen, uint32_t mark);
+static void put_run(VSCREEN *vscreen, const char *run, size_t n);
+static void index_down(VSCREEN *vscreen);
+static void wrap(VSCREEN *vscreen);
+static void vt_execute(VSCREEN *vscreen, unsigned char ch);
+static void vt_esc_dispatch(VSCREEN *vscreen, unsigned char ch);
+static void vt_csi_dispatch(VSCREEN *vscreen, unsigned char ch);
+static void damage(VSCREEN *vscreen, int l, int lo, int hi);
+static void damage_lines(VSCREEN *vscreen, int top, int bottom);
+static void update_span(VSCREEN *vscreen, struct piece *p);
+static CELL *copy_piece(VSCREEN *vscreen, struct piece *p, int l, int lo,
+                        int hi, CELL *cells);
+static inline int slot_of(VSCREEN *vscreen, int l);
+static inline CELL *screen_line(VSCREEN *vscreen, int l);
+static inline struct line_info *line_info(VSCREEN *vscreen, int l);
+static inline int history_cols(VSCREEN *vscreen, int l);
+static CELL *visible_line(VSCREEN *vscreen, int l);
+static void scroll_up(VSCREEN *vscreen);
+static void reserve(VSCREEN *vscreen, int rows);
+static int history_limit(int stride);
+static int rewrap(VSCREEN *vscreen, int first, int last, int cols, int skip,
+		  CELL *out, struct line_info *out_info, int stride,
+		  int *cursor_line, int *cursor_col);
+static void relayout(VSCREEN *vscreen, int stride, int lines);
+static void reflow_history(VSCREEN *vscreen);
+static void resize_damage(VSCREEN *vscreen);
+static int line_length(const CELL *line, int n);
+static int cells_text(const CELL *cells, int n, char *text);
+static void record_line(VSCREEN *vscreen, int l);
+static void update_index(VSCREEN *vscreen);
+static int may_match(VSCREEN *vscreen, int lo, int hi, const unsigned *bits,
+		     int n);
+static int match_line(VSCREEN *vscreen, int l, const uint32_t *text, int n);
+static CELL *alloc_cells(int rows, int stride);
+static int new_ring(VSCREEN *vscreen, int rows, int ring_size, int stride,
+		    CELL **cells, struct line_info **info,
+		    struct snapshot_header **map);
+static void set_ring(VSCREEN *vscreen, CELL *cells, struct line_info *info,
+		     struct snapshot_header *map, int capacity);
+static void commit(VSCREEN *vscreen);
+static unsigned attr_hash_of(const struct cell_attr *attr);
+static uint32_t combine(uint32_t ch, uint32_t mark, int add);
+static unsigned cluster_hash_of(const struct cluster *cluster);
+static int valid_state(struct snapshot_header *map,
+		       const struct snapshot_state *st);
 
 /*
  * Create a new virtual screen of the same size as the physical screen.
+ * The amount of scrollback it keeps is the smaller of
+ * vscreen_history_lines and the number of lines that fit into
+ * vscreen_history_bytes.
  */
 VSCREEN *vscreen_init() {
 
@@ -39,10 +370,19 @@ VSCREEN *vscreen_init() {
 
     vscreen->cur_line = 0;
     vscreen->cur_col = 0;
-    vscreen->lines = calloc(sizeof(char *), vscreen->num_lines);
-    vscreen->line_changed = calloc(sizeof(char), vscreen->num_lines);
-    for(int i = 0; i < vscreen->num_lines; i++)
-	vscreen->lines[i] = calloc(sizeof(char), vscreen->num_cols);
+    vscreen->stride = (vscreen->num_cols + ROW_ALIGN - 1) & ~(ROW_ALIGN - 1);
+    vscreen->max_history = history_limit(vscreen->stride);
+    vscreen->ring_size = vscreen->num_lines + vscreen->max_history;
+    vscreen->capacity = vscreen->num_lines;
+    vscreen->cells = alloc_cells(vscreen->capacity, vscreen->stride);
+    memset(vscreen->cells, 0,
+	   (size_t)vscreen->capacity * vscreen->stride * sizeof(CELL));
+    vscreen->info = calloc(sizeof(struct line_info), vscreen->capacity);
+    resize_damage(vscreen);
+    pthread_mutex_init(&vscreen->lock, NULL);
+    vscreen->attr = attrs[0];
+    vscreen->bottom = vscreen->num_lines - 1;
+    vscreen->autowrap = 1;
     //box(main_screen,0,0);
     //box(status_screen,0,0);
 
@@ -52,42 +392,33 @@ VSCREEN *vscreen_init() {
 }
 
 /*
- * Erase the physical screen and show the current contents of a
- * specified virtual screen.
+ * Set where a virtual screen is drawn on the physical screen: with its
+ * top left corner at line, col.  A new screen is drawn at the top left
+ * of the physical screen.
+ */
+void vscreen_place(VSCREEN *vscreen, int line, int col) {
+    vscreen->at_line = line;
+    vscreen->at_col = col;
+}
+
+/*
+ * Erase the part of the physical screen where a specified virtual
+ * screen is placed, and show its current contents there.  The changes
+ * are staged for the next call of vscreen_frame().  While the help
+ * screen is up, no other screen is shown.
  */
 void vscreen_show(VSCREEN *vscreen) {
-    if(helpmode){
-        wclear(help);
-        wmove(help,0,0);
+    if(helpmode && vscreen != helpvscreen)
         return;
-    }
-    if(split_screenmode){
-        wclear(split_screen1);
-        wclear(split_screen2);
-        for(int l = 0; l < vscreen->num_lines; l++) {
-            update_line(vscreen, l);
-            vscreen->line_changed[l] = 0;
-        }
-        wmove(split_screen1, vscreen->cur_line, vscreen->cur_col);
-        wmove(split_screen2, vscreen->cur_line, vscreen->cur_col);
-        refresh();
-    }else{
-        if(wclear(main_screen) == ERR)
-            set_status("NCurses Function Failed");
-
-
-        for(int l = 0; l < vscreen->num_lines; l++) {
-            update_line(vscreen, l);
-            vscreen->line_changed[l] = 0;
-        }
-
-        if(wmove(main_screen, vscreen->cur_line, vscreen->cur_col) == ERR)
-            set_status("NCurses Function Failed");
-        refresh();
-    }
-
-
-
+    renderer->blank(vscreen->at_line, vscreen->at_col, vscreen->num_lines,
+                    vscreen->num_cols);
+    pthread_mutex_lock(&vscreen->lock);
+    damage_lines(vscreen, 0, vscreen->num_lines - 1);
+    vscreen->repaint = 1;
+    // A bell rung while the screen was in the background is old news.
+    vscreen->bell = 0;
+    pthread_mutex_unlock(&vscreen->lock);
+    vscreen_sync(vscreen);
 }
 
 
@@ -100,84 +431,144 @@ void vscreen_show(VSCREEN *vscreen) {
  * and the cursor position to be updated.
  * Although the same effect could be achieved by calling vscreen_show(),
  * the present function tries to be more economical about what is displayed,
- * by only rewriting the contents of lines that have changed.
+ * by only rewriting the spans of columns that have changed.  Nothing
+ * is sent to the terminal until vscreen_frame() is called, so that any
+ * number of syncs made while handling one batch of events cost a single
+ * terminal update.
  */
 void vscreen_sync(VSCREEN *vscreen) {
-    if(helpmode){
-        wclear(help);
-        wmove(help, vscreen->cur_line, vscreen->cur_col);
+    if(helpmode && vscreen != helpvscreen)
         return;
+    size_t size = (size_t)vscreen->num_lines * vscreen->num_cols;
+    if(vscreen->num_lines > max_pieces || size > max_piece_cells) {
+        max_pieces = vscreen->num_lines;
+        max_piece_cells = size;
+        free(pieces);
+        free(piece_cells);
+        pieces = malloc(max_pieces * sizeof(struct piece));
+        piece_cells = malloc(max_piece_cells * sizeof(CELL));
+        if(pieces == NULL || piece_cells == NULL)
+            exit_error();
+    }
+
+    // Copy out the damaged spans, then draw them once the lock is let go.
+    pthread_mutex_lock(&vscreen->lock);
+    int n = 0, bell = vscreen->bell;
+    CELL *cells = piece_cells;
+    vscreen->synced = vscreen->generation;
+    vscreen->bell = 0;
+    // The lines of history in view above the screen only change when
+    // the view does, which redraws everything.
+    if(vscreen->repaint) {
+        vscreen->repaint = 0;
+        for(int l = 0; l < vscreen->view && l < vscreen->num_lines; l++)
+            cells = copy_piece(vscreen, &pieces[n++], l, 0,
+                               vscreen->num_cols, cells);
     }
-    if(split_screenmode){
-        for(int l = 0; l < vscreen->num_lines; l++) {
-        if(vscreen->line_changed[l]) {
-            update_line(vscreen, l);
-            vscreen->line_changed[l] = 0;
+    for(int w = 0; w < BITMAP_WORDS(vscreen->num_lines); w++) {
+        uint64_t full = vscreen->full[w];
+        uint64_t bits = vscreen->dirty[w] | full;
+        vscreen->dirty[w] = vscreen->full[w] = 0;
+        while(bits) {
+            int bit = __builtin_ctzll(bits);
+            int l = w * 64 + bit;
+            struct span *d = &vscreen->damage[l];
+            if(full >> bit & 1) {
+                d->lo = 0;
+                d->hi = vscreen->num_cols;
             }
+            // While the view is scrolled back, screen line l is
+            // displayed view lines further down, if at all.
+            if(d->lo < d->hi && l + vscreen->view < vscreen->num_lines)
+                cells = copy_piece(vscreen, &pieces[n++], l + vscreen->view,
+                                   d->lo, d->hi, cells);
+            d->lo = vscreen->num_cols;
+            d->hi = 0;
+            bits &= bits - 1;
         }
-        wmove(split_screen1, vscreen->cur_line, vscreen->cur_col);
-        wmove(split_screen2, vscreen->cur_line, vscreen->cur_col);
-        wrefresh(split_screen1);
-        wrefresh(split_screen2);
-        refresh();
-    }else{
-        for(int l = 0; l < vscreen->num_lines; l++) {
-            update_line(vscreen, l);
-            vscreen->line_changed[l] = 0;
-        }
+    }
+    int cur_line = vscreen->cur_line, cur_col = vscreen->cur_col;
+    pthread_mutex_unlock(&vscreen->lock);
+
+    if(bell)
+        renderer->bell();
+    for(int i = 0; i < n; i++)
+        update_span(vscreen, &pieces[i]);
+    renderer->cursor(vscreen->at_line + cur_line, vscreen->at_col + cur_col);
+}
 
-        if(wmove(main_screen, vscreen->cur_line, vscreen->cur_col) ==ERR)
-            set_status("NCurses Function Failed");
+/*
+ * Helper function to copy columns lo up to hi of what is displayed on
+ * line l into cells, to be drawn as piece p, taking in the other half
+ * of a wide character at either end.  Blank cells at the end of the
+ * line are cleared rather than written out.  Returns where the
+ * next piece's cells go.
+ */
+static CELL *copy_piece(VSCREEN *vscreen, struct piece *p, int l, int lo,
+                        int hi, CELL *cells) {
+    CELL *line = visible_line(vscreen, l);
+    // Wide characters are drawn whole.
+    if(lo > 0 && CELL_CHAR(line[lo]) == CELL_WIDE)
+        lo--;
+    if(hi < vscreen->num_cols && CELL_CHAR(line[hi]) == CELL_WIDE)
+        hi++;
+    p->line = l;
+    p->lo = lo;
+    p->end = p->hi = hi;
+    if(hi == vscreen->num_cols)
+        while(p->end > lo && line[p->end - 1] == 0)
+            p->end--;
+    p->cells = cells;
+    memcpy(cells, line + lo, (p->end - lo) * sizeof(CELL));
+    return cells + p->end - lo;
+}
 
-        refresh();
-    }
+/*
+ * Send everything staged since the previous frame to the physical
+ * screen in a single update.  Returns as the renderer's frame() does.
+ */
+int vscreen_frame(void) {
+    return renderer->frame();
 }
 
 
 
 /*
- * Helper function to clear and rewrite a specified line of the screen.
+ * Helper function to record that columns lo up to (but not including)
+ * hi of line l have changed since the screen was last synced.
  */
-static void update_line(VSCREEN *vscreen, int l) {
-    if(helpmode){
-        wclear(help);
-        wmove(help, vscreen->cur_line, vscreen->cur_col);
-        return;
-    }
-    if(split_screenmode){
-        char *line = vscreen->lines[l];
-        wmove(split_screen1, l, 0);
-        wclrtoeol(split_screen1);
-        wmove(split_screen2, l, 0);
-        wclrtoeol(split_screen2);
-        for(int c = 0; c < vscreen->num_cols; c++) {
-            char ch = line[c];
-            if(isprint(ch)){
-                waddch(split_screen1, line[c]);
-                waddch(split_screen2, line[c]);
-            }
-        }
-        wmove(main_screen, vscreen->cur_line, vscreen->cur_col);
-        refresh();
-    }else{
-        char *line = vscreen->lines[l];
-        if(wmove(main_screen, l, 0)==ERR)
-            set_status("NCurses Function Failed");
-        if(wclrtoeol(main_screen) == ERR)
-            set_status("NCurses Function Failed");
-        for(int c = 0; c < vscreen->num_cols; c++) {
-            char ch = line[c];
-            if(isprint(ch)){
-                if(waddch(main_screen, line[c]) == ERR)
-                    set_status("NCurses Function Failed");
-            }
-        }
-        if(wmove(main_screen, vscreen->cur_line, vscreen->cur_col) ==ERR)
-            set_status("NCurses Function Failed");
-        refresh();
-    }
+static void damage(VSCREEN *vscreen, int l, int lo, int hi) {
+    struct span *d = &vscreen->damage[l];
+    vscreen->dirty[l >> 6] |= 1ULL << (l & 63);
+    if(lo < d->lo)
+        d->lo = lo;
+    if(hi > d->hi)
+        d->hi = hi;
+}
 
+/*
+ * Helper function to record that lines top through bottom have
+ * changed across their whole width.
+ */
+static void damage_lines(VSCREEN *vscreen, int top, int bottom) {
+    for(int w = top >> 6; w <= bottom >> 6; w++) {
+        uint64_t mask = ~0ULL;
+        if(w == top >> 6)
+            mask &= ~0ULL << (top & 63);
+        if(w == bottom >> 6)
+            mask &= ~0ULL >> (63 - (bottom & 63));
+        vscreen->full[w] |= mask;
+    }
+}
 
+/*
+ * Helper function to draw a span of cells copied out of a screen, where
+ * the screen is placed on the terminal.
+ */
+static void update_span(VSCREEN *vscreen, struct piece *p) {
+    vscreen_render_calls++;
+    renderer->put(vscreen->at_line + p->line, vscreen->at_col + p->lo,
+                  p->cells, p->end - p->lo, vscreen->at_col + p->hi);
 }
 
 
@@ -185,94 +576,2053 @@ static void update_line(VSCREEN *vscreen, int l) {
 /*
  * Output a character to a virtual screen, updating the cursor position
  * accordingly.  Changes are not reflected to the physical screen until
- * vscreen_show() or vscreen_sync() is called.  The current version of
- * this function emulates a "very dumb" terminal.  Each printing character
- * output is placed at the cursor position and the cursor position is
- * advanced by one column.  If the cursor advances beyond the last column,
- * it is reset to the first column.  The only non-printing characters
- * handled are carriage return, which causes the cursor to return to the
- * beginning of the current line, and line feed, which causes the cursor
- * to advance to the next line and clear from the current column position
- * to the end of the line.  There is currently no scrolling: if the cursor
- * advances beyond the last line, it wraps to the first line.
+ * vscreen_show() or vscreen_sync() is called.  The output is interpreted
+ * as by a DEC VT102: printing characters are placed at the cursor
+ * position (wrapping to the next line after the last column), control
+ * characters and ESC, CSI and OSC sequences are carried out as
+ * described with vt_esc_dispatch() and vt_csi_dispatch() below, and a
+ * line feed on the last line of the scrolling region scrolls it up.
+ * When the region is the whole screen, the line scrolled off the top
+ * is kept as history.  Bytes past ASCII are decoded as UTF-8, and
+ * the characters they make up printed as wide as unicode_width() says:
+ * characters two columns wide take up two cells, and those of no width
+ * (such as combining marks) are combined with the character before
+ * them, in its cell (see vscreen_chars()).  What is not valid UTF-8 is
+ * printed as UNICODE_REPLACEMENT.
+ *
+ * The parser is a DFA in the style of the DEC VT500 series parser.
+ * Each byte is first mapped to a class by vt_class[], and the pair of
+ * the parser state and the class selects an entry of vt_table[] that
+ * gives both the action to perform and the next state.
+ *
+ * Unlike vscreen_write(), this function does not take the screen's
+ * lock, and is for screens that no other thread is parsing output for.
  */
 void vscreen_putc(VSCREEN *vscreen, char ch) {
-    if(helpmode){
-        if(ch == 27){
-            helpmode = 0;
-            vscreen_show(fg_session->vscreen);
-        }
-        return;
+    unsigned char b = ch;
+    vscreen->generation++;
+    if(vscreen->utf8_need) {
+	if((b & 0xc0) == 0x80) {
+	    utf8_next(vscreen, b);
+	    return;
+	}
+	// The sequence was cut short, and the byte is taken afresh.
+	vscreen->utf8_need = 0;
+	vt_print(vscreen, UNICODE_REPLACEMENT);
+    }
+    unsigned char t = vt_table[vscreen->state][vt_class[b]];
+    vscreen->state = t & 0xf;
+    switch(t >> 4) {
+    case A_PRINT:
+	if(vscreen->wrap_pending | vscreen->graphics | vscreen->insert) {
+	    vt_print(vscreen, b);
+	} else {
+	    // The common case, done in line: an ordinary character
+	    // that does not wrap.
+	    int l = vscreen->cur_line;
+	    int c = vscreen->cur_col;
+	    struct span *d = &vscreen->damage[l];
+	    CELL *line = screen_line(vscreen, l);
+	    if(CELL_CHAR(line[c]) == CELL_WIDE ||
+	       (c + 1 < vscreen->num_cols && CELL_CHAR(line[c + 1]) == CELL_WIDE)) {
+		vt_print(vscreen, b);
+		break;
+	    }
+	    line[c] = b | vscreen->pen;
+	    vscreen->dirty[l >> 6] |= 1ULL << (l & 63);
+	    if(c < d->lo)
+		d->lo = c;
+	    if(c >= d->hi)
+		d->hi = c + 1;
+	    if(c + 1 < vscreen->num_cols)
+		vscreen->cur_col = c + 1;
+	    else if(vscreen->autowrap)
+		vscreen->wrap_pending = 1;
+	}
+	break;
+    case A_EXEC:
+	vt_execute(vscreen, b);
+	break;
+    case A_CLEAR:
+	vscreen->nparams = 0;
+	vscreen->params[0] = 0;
+	vscreen->private = 0;
+	vscreen->intermediate = 0;
+	break;
+    case A_COLLECT:
+	vscreen->intermediate = b;
+	break;
+    case A_PRIVATE:
+	vscreen->private = b;
+	break;
+    case A_PARAM:
+	if(vscreen->nparams == 0)
+	    vscreen->nparams = 1;
+	if(b == ';' || b == ':') {
+	    if(vscreen->nparams < VT_MAX_PARAMS)
+		vscreen->params[vscreen->nparams++] = 0;
+	} else {
+	    int *p = &vscreen->params[vscreen->nparams - 1];
+	    if(*p < 10000)
+		*p = *p * 10 + (b - '0');
+	}
+	break;
+    case A_ESC:
+	vt_esc_dispatch(vscreen, b);
+	break;
+    case A_CSI:
+	vt_csi_dispatch(vscreen, b);
+	break;
+    case A_UTF8:
+	utf8_start(vscreen, b);
+	break;
+    }
+}
+
+/*
+ * Helper function to find the slot of the ring holding line l of the
+ * screen.  Lines of history are numbered back from -1, the most recent.
+ */
+static inline int slot_of(VSCREEN *vscreen, int l) {
+    int slot = vscreen->head + l;
+    if(slot < 0)
+	slot += vscreen->ring_size;
+    else if(slot >= vscreen->ring_size)
+	slot -= vscreen->ring_size;
+    return slot;
+}
+
+/*
+ * Helper function to find the row of cells holding line l of the screen.
+ */
+static inline CELL *screen_line(VSCREEN *vscreen, int l) {
+    return vscreen->cells + (size_t)slot_of(vscreen, l) * vscreen->stride;
+}
+
+/*
+ * Helper function to find what is kept about line l of the screen
+ * besides its cells.
+ */
+static inline struct line_info *line_info(VSCREEN *vscreen, int l) {
+    return &vscreen->info[slot_of(vscreen, l)];
+}
+
+/*
+ * Helper function to return the width line l of the history was laid
+ * out at, which is no more than a row holds.  The line info of a screen
+ * restored from a snapshot is not checked as it is mapped, so that
+ * restoring takes the same time however much history there is, and is
+ * only taken at its word that far.
+ */
+static inline int history_cols(VSCREEN *vscreen, int l) {
+    int cols = line_info(vscreen, l)->cols;
+    return cols < vscreen->stride ? cols : vscreen->stride;
+}
+
+/*
+ * Helper function to allocate cache-aligned storage for a number of
+ * rows of cells.
+ */
+static CELL *alloc_cells(int rows, int stride) {
+    CELL *cells = aligned_alloc(CACHE_LINE,
+				(size_t)rows * stride * sizeof(CELL));
+    if(cells == NULL)
+	exit_error();
+    return cells;
+}
+
+/*
+ * Helper function to blank columns lo up to hi of screen line l.
+ */
+static void clear_cells(VSCREEN *vscreen, int l, int lo, int hi) {
+    if(lo < 0)
+	lo = 0;
+    if(hi > vscreen->num_cols)
+	hi = vscreen->num_cols;
+    if(lo >= hi)
+	return;
+    memset(screen_line(vscreen, l) + lo, 0, (hi - lo) * sizeof(CELL));
+    // A line erased to its end no longer carries on in the next.
+    if(hi == vscreen->num_cols)
+	line_info(vscreen, l)->wrapped = 0;
+    damage(vscreen, l, lo, hi);
+}
+
+/*
+ * Helper function to move the cursor, keeping it on the screen.
+ * In origin mode, lines are counted from the top of the scrolling
+ * region and the cursor is kept within the region.
+ */
+static void move_to(VSCREEN *vscreen, int l, int c) {
+    int top = 0, bottom = vscreen->num_lines - 1;
+    if(vscreen->origin) {
+	top = vscreen->top;
+	bottom = vscreen->bottom;
+    }
+    l = l < top ? top : l > bottom ? bottom : l;
+    c = c < 0 ? 0 : c >= vscreen->num_cols ? vscreen->num_cols - 1 : c;
+    vscreen->cur_line = l;
+    vscreen->cur_col = c;
+    vscreen->wrap_pending = 0;
+}
+
+/*
+ * Helper function to scroll lines top through bottom of the screen up
+ * by n lines (down if n is negative), blanking the lines that are
+ * scrolled in.  The lines that stay in the region are copied to their
+ * new rows one at a time, since the region need not be contiguous in
+ * the ring.
+ */
+static void rotate(VSCREEN *vscreen, int top, int bottom, int n) {
+    int size = bottom - top + 1;
+    size_t bytes = vscreen->num_cols * sizeof(CELL);
+    if(n >= size || -n >= size) {
+	for(int l = top; l <= bottom; l++)
+	    clear_cells(vscreen, l, 0, vscreen->num_cols);
+	return;
+    }
+    if(n > 0) {
+	for(int l = top; l + n <= bottom; l++) {
+	    memcpy(screen_line(vscreen, l), screen_line(vscreen, l + n), bytes);
+	    *line_info(vscreen, l) = *line_info(vscreen, l + n);
+	}
+	for(int l = bottom - n + 1; l <= bottom; l++) {
+	    memset(screen_line(vscreen, l), 0, bytes);
+	    line_info(vscreen, l)->wrapped = 0;
+	}
+    } else {
+	for(int l = bottom; l + n >= top; l--) {
+	    memcpy(screen_line(vscreen, l), screen_line(vscreen, l + n), bytes);
+	    *line_info(vscreen, l) = *line_info(vscreen, l + n);
+	}
+	for(int l = top; l < top - n; l++) {
+	    memset(screen_line(vscreen, l), 0, bytes);
+	    line_info(vscreen, l)->wrapped = 0;
+	}
+    }
+    damage_lines(vscreen, top, bottom);
+}
+
+/*
+ * Helper function to scroll the scrolling region up by n lines.
+ * When the region is the whole screen, the lines scrolled off the top
+ * go into the history.
+ */
+static void scroll_region_up(VSCREEN *vscreen, int n) {
+    if(vscreen->top == 0 && vscreen->bottom == vscreen->num_lines - 1) {
+	if(n > vscreen->num_lines)
+	    n = vscreen->num_lines;
+	while(n-- > 0)
+	    scroll_up(vscreen);
+    } else {
+	rotate(vscreen, vscreen->top, vscreen->bottom, n);
     }
+}
+
+/*
+ * Helper function to move the cursor down a line, scrolling the
+ * region up if the cursor is on its bottom line.
+ */
+static void index_down(VSCREEN *vscreen) {
+    vscreen->wrap_pending = 0;
+    if(vscreen->cur_line == vscreen->bottom)
+	scroll_region_up(vscreen, 1);
+    else if(vscreen->cur_line < vscreen->num_lines - 1)
+	vscreen->cur_line++;
+}
+
+/*
+ * Helper function to carry out a pending wrap, moving the cursor to the
+ * start of the next line.  The line it leaves is marked as carrying on
+ * there.
+ */
+static void wrap(VSCREEN *vscreen) {
+    line_info(vscreen, vscreen->cur_line)->wrapped = 1;
+    vscreen->cur_col = 0;
+    index_down(vscreen);
+}
+
+/*
+ * Helper function to move the cursor up a line, scrolling the region
+ * down if the cursor is on its top line.
+ */
+static void index_up(VSCREEN *vscreen) {
+    vscreen->wrap_pending = 0;
+    if(vscreen->cur_line == vscreen->top)
+	rotate(vscreen, vscreen->top, vscreen->bottom, -1);
+    else if(vscreen->cur_line > 0)
+	vscreen->cur_line--;
+}
+
+/*
+ * Helper function to queue a reply to a query from the program running
+ * on the screen.  Replies are collected with vscreen_reply().
+ */
+static void vt_reply(VSCREEN *vscreen, const char *reply) {
+    int n = strlen(reply);
+    if(vscreen->reply_len + n <= VT_REPLY_SIZE) {
+	memcpy(vscreen->reply + vscreen->reply_len, reply, n);
+	vscreen->reply_len += n;
+    }
+}
+
+/*
+ * Helper function to put the screen back into its initial state.
+ */
+static void vt_reset(VSCREEN *vscreen) {
+    for(int l = 0; l < vscreen->num_lines; l++)
+	clear_cells(vscreen, l, 0, vscreen->num_cols);
+    vscreen->top = 0;
+    vscreen->bottom = vscreen->num_lines - 1;
+    vscreen->autowrap = 1;
+    vscreen->origin = 0;
+    vscreen->insert = 0;
+    vscreen->graphics = 0;
+    vscreen->saved_line = vscreen->saved_col = 0;
+    vscreen->attr = vscreen->saved_attr = attrs[0];
+    vscreen->pen = 0;
+    move_to(vscreen, 0, 0);
+}
+
+/*
+ * ASCII stand-ins for the DEC special graphics characters 0x5f-0x7e,
+ * which programs use to draw lines and boxes.
+ */
+static const char vt_graphics[] = " +:    '###+++++----_++++|<>*!fo";
+
+/*
+ * Helper function to place a printing character at the cursor.
+ * A character printed in the last column leaves the cursor there with
+ * a wrap pending, so that the line only wraps if another character
+ * follows, as on a real VT100.
+ */
+static void vt_print(VSCREEN *vscreen, uint32_t ch) {
+    int width = ch < UNICODE_NARROW ? 1 : unicode_width(ch);
+    if(width == 0) {
+	combine_mark(vscreen, ch);
+	return;
+    }
+    if(width > vscreen->num_cols)
+	return;
+    if(vscreen->wrap_pending)
+	wrap(vscreen);
+    if(vscreen->graphics && ch >= 0x5f && ch <= 0x7e)
+	ch = vt_graphics[ch - 0x5f];
+
     int l = vscreen->cur_line;
     int c = vscreen->cur_col;
-    if(isprint(ch)) {
-	vscreen->lines[l][c] = ch;
+    CELL *line = screen_line(vscreen, l);
+    if(c + width > vscreen->num_cols) {
+	// A wide character that does not fit in the last column goes
+	// on the next line, or if the line cannot wrap, in the last two.
+	if(vscreen->autowrap) {
+	    split_wide(vscreen, l, c, c + 1);
+	    line[c] = vscreen->pen;
+	    damage(vscreen, l, c, c + 1);
+	    wrap(vscreen);
+	    l = vscreen->cur_line;
+	    c = 0;
+	    line = screen_line(vscreen, l);
+	} else {
+	    c = vscreen->num_cols - width;
+	}
+    }
+    if(vscreen->insert) {
+	split_wide(vscreen, l, c, c);
+	memmove(line + c + width, line + c,
+		(vscreen->num_cols - c - width) * sizeof(CELL));
+	// A wide character pushed half off the end goes altogether.
+	CELL *last = &line[vscreen->num_cols - 1];
+	uint32_t chars[CLUSTER_CHARS];
+	vscreen_chars(CELL_CHAR(*last), chars);
+	if(unicode_width(chars[0]) == 2)
+	    *last = CELL(0, CELL_ATTR(*last));
+	damage(vscreen, l, c, vscreen->num_cols);
+    } else {
+	split_wide(vscreen, l, c, c + width);
+    }
+    line[c] = ch | vscreen->pen;
+    if(width == 2)
+	line[c + 1] = CELL_WIDE | vscreen->pen;
+    damage(vscreen, l, c, c + width);
 
+    if(c + width < vscreen->num_cols) {
+	vscreen->cur_col = c + width;
+    } else {
+	vscreen->cur_col = vscreen->num_cols - 1;
+	if(vscreen->autowrap)
+	    vscreen->wrap_pending = 1;
+    }
+}
 
+/*
+ * Helper function to start decoding a UTF-8 sequence with its first
+ * byte.  A byte that cannot start one is printed as
+ * UNICODE_REPLACEMENT.
+ */
+static void utf8_start(VSCREEN *vscreen, unsigned char b) {
+    int len = utf8_length(b);
+    if(len < 2) {
+	vt_print(vscreen, UNICODE_REPLACEMENT);
+	return;
+    }
+    vscreen->utf8_len = len;
+    vscreen->utf8_need = len - 1;
+    vscreen->utf8 = b & (0x7f >> len);
+}
 
-	if(vscreen->cur_col + 1 < vscreen->num_cols)
-	    vscreen->cur_col++;
-    } else if(ch == '\n') {
-        if( l >= vscreen->num_lines -1){
-            int i;
+/*
+ * Helper function to add a continuation byte to the UTF-8 sequence
+ * being decoded, and print the character once it is complete.
+ * Overlong encodings, surrogates and what is past Unicode are printed
+ * as UNICODE_REPLACEMENT.
+ */
+static void utf8_next(VSCREEN *vscreen, unsigned char b) {
+    vscreen->utf8 = vscreen->utf8 << 6 | (b & 0x3f);
+    if(--vscreen->utf8_need > 0)
+	return;
+    vt_print(vscreen, utf8_check(vscreen->utf8, vscreen->utf8_len));
+}
 
-            for(i = 1; i <  vscreen->num_lines; i++){
-                memset(vscreen->lines[i-1], 0, vscreen->num_cols);
-                strcpy(vscreen->lines[i - 1],vscreen->lines[i]);
-                vscreen->line_changed[i-1] = 1;
-            }
+/*
+ * Helper function to blank what is left of any wide character of which
+ * columns lo up to hi of line l are about to be overwritten, or between
+ * which and the column before them the line is about to be split.
+ */
+static inline void split_wide(VSCREEN *vscreen, int l, int lo, int hi) {
+    CELL *line = screen_line(vscreen, l);
+    if(lo > 0 && lo < vscreen->num_cols && CELL_CHAR(line[lo]) == CELL_WIDE) {
+	line[lo - 1] = CELL(0, CELL_ATTR(line[lo - 1]));
+	damage(vscreen, l, lo - 1, lo);
+    }
+    if(hi < vscreen->num_cols && CELL_CHAR(line[hi]) == CELL_WIDE) {
+	line[hi] = CELL(0, CELL_ATTR(line[hi]));
+	damage(vscreen, l, hi, hi + 1);
+    }
+}
 
-            memset(vscreen->lines[vscreen->num_lines-1], 0, vscreen->num_cols);
-            vscreen->line_changed[vscreen->num_lines-1]=1;
-        }else{
-            vscreen->cur_col = 0;
-            l = vscreen->cur_line = (vscreen->cur_line + 1) ;
-            memset(vscreen->lines[l], 0, vscreen->num_cols);
-        }
+/*
+ * Helper function to combine a character of no width, such as a
+ * combining mark, with the character last printed, in its cell: the
+ * one before the cursor, or under it if a wrap is pending.  If there is
+ * none there, the mark is left out.
+ */
+static void combine_mark(VSCREEN *vscreen, uint32_t mark) {
+    int l = vscreen->cur_line;
+    int c = vscreen->cur_col - !vscreen->wrap_pending;
+    CELL *line = screen_line(vscreen, l);
+    if(c > 0 && CELL_CHAR(line[c]) == CELL_WIDE)
+	c--;
+    if(c < 0 || CELL_CHAR(line[c]) == 0 || CELL_CHAR(line[c]) == CELL_WIDE)
+	return;
+    uint32_t ch = combine(CELL_CHAR(line[c]), mark, 1);
+    if(ch == 0)
+	return;
+    line[c] = CELL(ch, CELL_ATTR(line[c]));
+    damage(vscreen, l, c, c + 1);
+}
 
+/*
+ * Helper function to carry out a C0 control character.
+ */
+static void vt_execute(VSCREEN *vscreen, unsigned char ch) {
+    int c = vscreen->cur_col;
+    switch(ch) {
+    case '\a':
+	vscreen->bell = 1;
+	break;
+    case '\b':
+	if(c != 0)
+	    vscreen->cur_col = c - 1;
+	vscreen->wrap_pending = 0;
+	break;
+    case '\t':
+	c = (c + 8) & ~7;
+	move_to(vscreen, vscreen->cur_line, c);
+	break;
+    case '\n':
+    case '\v':
+    case '\f':
+	index_down(vscreen);
+	break;
+    case '\r':
+	vscreen->cur_col = 0;
+	vscreen->wrap_pending = 0;
+	break;
+    }
+}
 
-    } else if(ch == '\r') {
+/*
+ * Helper function to carry out an escape sequence ESC [intermediate] ch.
+ */
+static void vt_esc_dispatch(VSCREEN *vscreen, unsigned char ch) {
+    if(vscreen->intermediate == '(') {
+	// Designate G0: special graphics or ASCII.
+	vscreen->graphics = (ch == '0');
+	return;
+    }
+    if(vscreen->intermediate == '#') {
+	if(ch == '8') {
+	    // DECALN: fill the screen with E's.
+	    for(int l = 0; l < vscreen->num_lines; l++) {
+		CELL *line = screen_line(vscreen, l);
+		for(int c = 0; c < vscreen->num_cols; c++)
+		    line[c] = 'E';
+	    }
+	    damage_lines(vscreen, 0, vscreen->num_lines - 1);
+	}
+	return;
+    }
+    if(vscreen->intermediate)
+	return;
+    switch(ch) {
+    case 'D':                  // IND: index
+	index_down(vscreen);
+	break;
+    case 'E':                  // NEL: next line
 	vscreen->cur_col = 0;
+	index_down(vscreen);
+	break;
+    case 'M':                  // RI: reverse index
+	index_up(vscreen);
+	break;
+    case '7':                  // DECSC: save cursor
+	vscreen->saved_line = vscreen->cur_line;
+	vscreen->saved_col = vscreen->cur_col;
+	vscreen->saved_attr = vscreen->attr;
+	break;
+    case '8':                  // DECRC: restore cursor
+	vscreen->cur_line = vscreen->saved_line;
+	vscreen->cur_col = vscreen->saved_col;
+	vscreen->attr = vscreen->saved_attr;
+	vscreen->pen = CELL(0, vscreen_attr_index(&vscreen->attr));
+	vscreen->wrap_pending = 0;
+	break;
+    case 'c':                  // RIS: reset
+	vt_reset(vscreen);
+	break;
+    }
+}
 
-    } else if(ch == '\a'){
-        flash();
-    }else if(ch == '\b'){
-        if(c != 0){
-            vscreen->cur_col = vscreen->cur_col -1;
+/*
+ * Helper function to return parameter i of a control sequence,
+ * or def if it was omitted or zero.
+ */
+static int vt_param(VSCREEN *vscreen, int i, int def) {
+    if(i >= vscreen->nparams || vscreen->params[i] == 0)
+	return def;
+    return vscreen->params[i];
+}
 
-        }
-    }else if(ch == '\t'){
-        if(c < vscreen->num_cols){
-            if(c % 8 == 0)
-                c++;
-            while(c % 8 != 0)
-                c++;
-            vscreen->cur_col = c;
-        }
-    }else if(ch == '\f'){
-        for(int i = 0; i < vscreen->num_lines; i++){
-            memset(vscreen->lines[i], 0, vscreen->num_cols);
-        }
-        vscreen->cur_line = 0;
-        vscreen->cur_col = 0;
+/*
+ * Helper function to set or reset the modes listed in a control
+ * sequence ending in 'h' or 'l'.
+ */
+static void vt_set_modes(VSCREEN *vscreen, int set) {
+    for(int i = 0; i < vscreen->nparams || i == 0; i++) {
+	int mode = vscreen->params[i];
+	if(vscreen->private == '?') {
+	    if(mode == 6) {            // DECOM: origin mode
+		vscreen->origin = set;
+		move_to(vscreen, vscreen->origin ? vscreen->top : 0, 0);
+	    } else if(mode == 7) {     // DECAWM: autowrap
+		vscreen->autowrap = set;
+		vscreen->wrap_pending = 0;
+	    }
+	} else if(!vscreen->private && mode == 4) {
+	    vscreen->insert = set;     // IRM: insert mode
+	}
+    }
+}
+
+/*
+ * Helper function to reduce a 24-bit color to the nearest entry of
+ * the 6x6x6 color cube of the 256-color palette.
+ */
+static int vt_rgb(int r, int g, int b) {
+    r = r > 255 ? 5 : r * 6 / 256;
+    g = g > 255 ? 5 : g * 6 / 256;
+    b = b > 255 ? 5 : b * 6 / 256;
+    return 16 + r * 36 + g * 6 + b;
+}
+
+/*
+ * Helper function to carry out SGR (select graphic rendition), which
+ * sets the attributes of the characters printed from then on.
+ * Besides the VT102 renditions, the ECMA-48 colors and the 256-color
+ * and direct color extensions of xterm are understood.
+ */
+static void vt_sgr(VSCREEN *vscreen) {
+    struct cell_attr a = vscreen->attr;
+    for(int i = 0; i < vscreen->nparams || i == 0; i++) {
+	int p = vscreen->params[i];
+	int *color = NULL;
+	int fg = a.fg, bg = a.bg;
+	switch(p) {
+	case 0:  a = attrs[0]; continue;
+	case 1:  a.flags |= ATTR_BOLD; continue;
+	case 2:  a.flags |= ATTR_DIM; continue;
+	case 3:  a.flags |= ATTR_ITALIC; continue;
+	case 4:  a.flags |= ATTR_UNDERLINE; continue;
+	case 5:  a.flags |= ATTR_BLINK; continue;
+	case 7:  a.flags |= ATTR_REVERSE; continue;
+	case 8:  a.flags |= ATTR_INVISIBLE; continue;
+	case 22: a.flags &= ~(ATTR_BOLD | ATTR_DIM); continue;
+	case 23: a.flags &= ~ATTR_ITALIC; continue;
+	case 24: a.flags &= ~ATTR_UNDERLINE; continue;
+	case 25: a.flags &= ~ATTR_BLINK; continue;
+	case 27: a.flags &= ~ATTR_REVERSE; continue;
+	case 28: a.flags &= ~ATTR_INVISIBLE; continue;
+	case 39: a.fg = COLOR_DEFAULT; continue;
+	case 49: a.bg = COLOR_DEFAULT; continue;
+	case 38: color = &fg; break;
+	case 48: color = &bg; break;
+	}
+	if(color != NULL) {
+	    // 38;5;n or 48;5;n selects a color of the 256-color palette,
+	    // 38;2;r;g;b or 48;2;r;g;b a color given by its components.
+	    int kind = i + 1 < vscreen->nparams ? vscreen->params[i + 1] : 0;
+	    if(kind == 5 && i + 2 < vscreen->nparams) {
+		*color = vscreen->params[i + 2] & 0xff;
+		i += 2;
+	    } else if(kind == 2 && i + 4 < vscreen->nparams) {
+		*color = vt_rgb(vscreen->params[i + 2], vscreen->params[i + 3],
+				vscreen->params[i + 4]);
+		i += 4;
+	    } else {
+		break;
+	    }
+	    a.fg = fg;
+	    a.bg = bg;
+	} else if(p >= 30 && p <= 37) {
+	    a.fg = p - 30;
+	} else if(p >= 40 && p <= 47) {
+	    a.bg = p - 40;
+	} else if(p >= 90 && p <= 97) {
+	    a.fg = p - 90 + 8;
+	} else if(p >= 100 && p <= 107) {
+	    a.bg = p - 100 + 8;
+	}
+    }
+    vscreen->attr = a;
+    vscreen->pen = CELL(0, vscreen_attr_index(&a));
+}
+
+/*
+ * Helper function to carry out a control sequence CSI params ch.
+ * The sequences understood are those of a VT102, plus the common
+ * ECMA-48 extensions for absolute positioning and scrolling.
+ */
+static void vt_csi_dispatch(VSCREEN *vscreen, unsigned char ch) {
+    int l = vscreen->cur_line;
+    int c = vscreen->cur_col;
+    int n = vt_param(vscreen, 0, 1);
+    char buf[32];
+
+    if(ch == 'h' || ch == 'l') {
+	vt_set_modes(vscreen, ch == 'h');
+	return;
+    }
+    if(vscreen->private || vscreen->intermediate)
+	return;
+    switch(ch) {
+    case 'A':                  // CUU: cursor up
+	move_to(vscreen, l - n < vscreen->top && l >= vscreen->top ?
+		vscreen->top : l - n, c);
+	break;
+    case 'B':                  // CUD: cursor down
+    case 'e':                  // VPR
+	move_to(vscreen, l + n > vscreen->bottom && l <= vscreen->bottom ?
+		vscreen->bottom : l + n, c);
+	break;
+    case 'C':                  // CUF: cursor forward
+    case 'a':                  // HPR
+	move_to(vscreen, l, c + n);
+	break;
+    case 'D':                  // CUB: cursor back
+	move_to(vscreen, l, c - n);
+	break;
+    case 'E':                  // CNL: cursor next line
+	move_to(vscreen, l + n, 0);
+	break;
+    case 'F':                  // CPL: cursor previous line
+	move_to(vscreen, l - n, 0);
+	break;
+    case 'G':                  // CHA: cursor to column
+    case '`':                  // HPA
+	move_to(vscreen, l, n - 1);
+	break;
+    case 'H':                  // CUP: cursor position
+    case 'f':                  // HVP
+	move_to(vscreen, (vscreen->origin ? vscreen->top : 0) + n - 1,
+		vt_param(vscreen, 1, 1) - 1);
+	break;
+    case 'd':                  // VPA: cursor to line
+	move_to(vscreen, (vscreen->origin ? vscreen->top : 0) + n - 1, c);
+	break;
+    case 'J':                  // ED: erase in display
+	switch(vt_param(vscreen, 0, 0)) {
+	case 0:
+	    clear_cells(vscreen, l, c, vscreen->num_cols);
+	    for(int i = l + 1; i < vscreen->num_lines; i++)
+		clear_cells(vscreen, i, 0, vscreen->num_cols);
+	    break;
+	case 1:
+	    for(int i = 0; i < l; i++)
+		clear_cells(vscreen, i, 0, vscreen->num_cols);
+	    clear_cells(vscreen, l, 0, c + 1);
+	    break;
+	case 2:
+	    for(int i = 0; i < vscreen->num_lines; i++)
+		clear_cells(vscreen, i, 0, vscreen->num_cols);
+	    break;
+	case 3:                    // xterm: erase the scrollback
+	    vscreen->history = 0;
+	    vscreen->view = 0;
+	    vscreen->reflow = 0;
+	    break;
+	}
+	break;
+    case 'K':                  // EL: erase in line
+	switch(vt_param(vscreen, 0, 0)) {
+	case 0:
+	    clear_cells(vscreen, l, c, vscreen->num_cols);
+	    break;
+	case 1:
+	    clear_cells(vscreen, l, 0, c + 1);
+	    break;
+	case 2:
+	    clear_cells(vscreen, l, 0, vscreen->num_cols);
+	    break;
+	}
+	break;
+    case 'L':                  // IL: insert lines
+    case 'M':                  // DL: delete lines
+	if(l >= vscreen->top && l <= vscreen->bottom) {
+	    rotate(vscreen, l, vscreen->bottom, ch == 'L' ? -n : n);
+	    move_to(vscreen, l, 0);
+	}
+	break;
+    case '@':                  // ICH: insert characters
+    case 'P': {                // DCH: delete characters
+	CELL *line = screen_line(vscreen, l);
+	int rest = vscreen->num_cols - c;
+	if(n > rest)
+	    n = rest;
+	if(ch == '@') {
+	    memmove(line + c + n, line + c, (rest - n) * sizeof(CELL));
+	    memset(line + c, 0, n * sizeof(CELL));
+	} else {
+	    memmove(line + c, line + c + n, (rest - n) * sizeof(CELL));
+	    memset(line + vscreen->num_cols - n, 0, n * sizeof(CELL));
+	}
+	damage(vscreen, l, c, vscreen->num_cols);
+	vscreen->wrap_pending = 0;
+	break;
+    }
+    case 'X':                  // ECH: erase characters
+	clear_cells(vscreen, l, c, c + n);
+	vscreen->wrap_pending = 0;
+	break;
+    case 'm':                  // SGR: select graphic rendition
+	vt_sgr(vscreen);
+	break;
+    case 'S':                  // SU: scroll up
+	scroll_region_up(vscreen, n);
+	break;
+    case 'T':                  // SD: scroll down
+	rotate(vscreen, vscreen->top, vscreen->bottom, -n);
+	break;
+    case 'r': {                // DECSTBM: set scrolling region
+	int top = n - 1;
+	int bottom = vt_param(vscreen, 1, vscreen->num_lines) - 1;
+	if(bottom >= vscreen->num_lines)
+	    bottom = vscreen->num_lines - 1;
+	if(top < bottom) {
+	    vscreen->top = top;
+	    vscreen->bottom = bottom;
+	    move_to(vscreen, vscreen->origin ? top : 0, 0);
+	}
+	break;
+    }
+    case 's':                  // SCOSC: save cursor
+	vscreen->saved_line = l;
+	vscreen->saved_col = c;
+	vscreen->saved_attr = vscreen->attr;
+	break;
+    case 'u':                  // SCORC: restore cursor
+	move_to(vscreen, vscreen->saved_line, vscreen->saved_col);
+	vscreen->attr = vscreen->saved_attr;
+	vscreen->pen = CELL(0, vscreen_attr_index(&vscreen->attr));
+	break;
+    case 'n':                  // DSR: device status report
+	if(n == 5) {
+	    vt_reply(vscreen, "\033[0n");
+	} else if(n == 6) {
+	    snprintf(buf, sizeof(buf), "\033[%d;%dR",
+		     l + 1 - (vscreen->origin ? vscreen->top : 0), c + 1);
+	    vt_reply(vscreen, buf);
+	}
+	break;
+    case 'c':                  // DA: device attributes
+	if(vt_param(vscreen, 0, 0) == 0)
+	    vt_reply(vscreen, "\033[?6c");
+	break;
+    }
+}
+
+/*
+ * Collect the replies that the program running on a virtual screen has
+ * asked for (such as cursor position reports), to be written back to
+ * it.  At most size bytes are copied into buf, and the number of bytes
+ * copied is returned.
+ */
+int vscreen_reply(VSCREEN *vscreen, char *buf, int size) {
+    pthread_mutex_lock(&vscreen->lock);
+    int n = vscreen->reply_len < size ? vscreen->reply_len : size;
+    memcpy(buf, vscreen->reply, n);
+    memmove(vscreen->reply, vscreen->reply + n, vscreen->reply_len - n);
+    vscreen->reply_len -= n;
+    pthread_mutex_unlock(&vscreen->lock);
+    return n;
+}
+
+/*
+ * Scroll the view of a virtual screen back into its scrollback history
+ * by the given number of lines (forward toward the live screen if
+ * negative).  The view stays within the history that is kept, and the
+ * physical screen is redrawn if the screen is being displayed.  History
+ * left as it was when the screen was resized is rewrapped first.
+ */
+void vscreen_scroll(VSCREEN *vscreen, int lines) {
+    pthread_mutex_lock(&vscreen->lock);
+    if(lines > 0 && vscreen->reflow)
+	reflow_history(vscreen);
+    int view = vscreen->view + lines;
+    if(view > vscreen->history)
+	view = vscreen->history;
+    if(view < 0)
+	view = 0;
+    int moved = view != vscreen->view;
+    vscreen->view = view;
+    pthread_mutex_unlock(&vscreen->lock);
+    if(moved)
+	vscreen_show(vscreen);
+}
+
+/*
+ * Return whether the contents of a virtual screen have changed since
+ * they were last shown on the physical screen.
+ */
+int vscreen_changed(VSCREEN *vscreen) {
+    pthread_mutex_lock(&vscreen->lock);
+    int changed = vscreen->generation != vscreen->synced;
+    pthread_mutex_unlock(&vscreen->lock);
+    return changed;
+}
+
+/*
+ * Copy the text of line l of a virtual screen (not of its history) to
+ * text as UTF-8, without its attributes or trailing blanks.  Text must
+ * have room for CELL_TEXT_MAX bytes for each column of the screen.  Returns
+ * the number of bytes copied.
+ */
+int vscreen_text(VSCREEN *vscreen, int l, char *text) {
+    pthread_mutex_lock(&vscreen->lock);
+    CELL *line = screen_line(vscreen, l);
+    int n = cells_text(line, line_length(line, vscreen->num_cols), text);
+    pthread_mutex_unlock(&vscreen->lock);
+    return n;
+}
+
+/*
+ * Find where the cursor of a virtual screen is, as a line and column
+ * of the screen.
+ */
+void vscreen_cursor(VSCREEN *vscreen, int *line, int *col) {
+    pthread_mutex_lock(&vscreen->lock);
+    *line = vscreen->cur_line;
+    *col = vscreen->cur_col;
+    pthread_mutex_unlock(&vscreen->lock);
+}
+
+/*
+ * Return the number of lines by which the view of a virtual screen
+ * is currently scrolled back into its history.
+ */
+int vscreen_scrolled(VSCREEN *vscreen) {
+    pthread_mutex_lock(&vscreen->lock);
+    int view = vscreen->view;
+    pthread_mutex_unlock(&vscreen->lock);
+    return view;
+}
+
+/*
+ * Change the size of a virtual screen, as when the terminal has been
+ * resized.  The lines on the screen are rewrapped to the new width
+ * straight away, with the cursor kept on the same character.  Lines
+ * that no longer fit go into the history from the top, unless the
+ * cursor would go with them, in which case lines below it are dropped.
+ * The history is not rewrapped until it is next scrolled back into (see
+ * vscreen_scroll()), so a screen can be resized any number of times, as
+ * while a window is dragged to size, at a cost that does not depend on
+ * how much history it keeps.  Returns whether the size has changed.
+ */
+int vscreen_resize(VSCREEN *vscreen, int lines, int cols) {
+    pthread_mutex_lock(&vscreen->lock);
+    if(lines == vscreen->num_lines && cols == vscreen->num_cols) {
+	pthread_mutex_unlock(&vscreen->lock);
+	return 0;
+    }
+
+    // Rewrap the screen down to the last line in use, or the cursor.
+    int last = vscreen->num_lines - 1;
+    while(last > vscreen->cur_line && !line_info(vscreen, last)->wrapped &&
+	  line_length(screen_line(vscreen, last), vscreen->num_cols) == 0)
+	last--;
+    int cur_line = vscreen->cur_line, cur_col = vscreen->cur_col;
+    int stride = (cols + ROW_ALIGN - 1) & ~(ROW_ALIGN - 1);
+    int rows = rewrap(vscreen, 0, last, cols, 0, NULL, NULL, 0,
+		      &cur_line, &cur_col);
+    CELL *cells = alloc_cells(rows, stride);
+    struct line_info *info = calloc(sizeof(struct line_info), rows);
+    if(info == NULL)
+	exit_error();
+    rewrap(vscreen, 0, last, cols, 0, cells, info, stride, NULL, NULL);
+    int push = rows > lines ? rows - lines : 0;
+    if(push > cur_line)
+	push = cur_line;
+
+    // Rows of the old width can hold the new screen, unless it is
+    // wider.  The screen takes the place of the oldest history
+    // should it have more lines.
+    if(stride > vscreen->stride || lines > vscreen->ring_size) {
+	relayout(vscreen, stride > vscreen->stride ? stride : vscreen->stride,
+		 lines);
+    } else {
+	vscreen->max_history = vscreen->ring_size - lines;
+	if(vscreen->history > vscreen->max_history)
+	    vscreen->history = vscreen->max_history;
+    }
+    if(cols != vscreen->num_cols && vscreen->history > 0)
+	vscreen->reflow = 1;
+    vscreen->num_lines = lines;
+    vscreen->num_cols = cols;
+    vscreen->view = 0;
+    reserve(vscreen, vscreen->head + lines < vscreen->ring_size ?
+	    vscreen->head + lines : vscreen->ring_size);
+
+    size_t bytes = cols * sizeof(CELL);
+    for(int i = 0; i < push; i++) {
+	memcpy(screen_line(vscreen, 0), cells + (size_t)i * stride, bytes);
+	line_info(vscreen, 0)->wrapped = info[i].wrapped;
+	scroll_up(vscreen);
+    }
+    for(int l = 0; l < lines; l++) {
+	if(push + l < rows) {
+	    memcpy(screen_line(vscreen, l), cells + (size_t)(push + l) * stride,
+		   bytes);
+	    line_info(vscreen, l)->wrapped = info[push + l].wrapped;
+	} else {
+	    memset(screen_line(vscreen, l), 0, bytes);
+	    line_info(vscreen, l)->wrapped = 0;
+	}
+    }
+    // The last line kept does not carry on, if the next was dropped.
+    line_info(vscreen, lines - 1)->wrapped = 0;
+    free(cells);
+    free(info);
+
+    vscreen->cur_line = cur_line - push < lines ? cur_line - push : lines - 1;
+    vscreen->cur_col = cur_col;
+    vscreen->wrap_pending = 0;
+    vscreen->top = 0;
+    vscreen->bottom = lines - 1;
+    if(vscreen->saved_line >= lines)
+	vscreen->saved_line = lines - 1;
+    if(vscreen->saved_col >= cols)
+	vscreen->saved_col = cols - 1;
+    resize_damage(vscreen);
+    damage_lines(vscreen, 0, lines - 1);
+    vscreen->generation++;
+    commit(vscreen);
+    pthread_mutex_unlock(&vscreen->lock);
+    return 1;
+}
+
+/*
+ * Helper function to find the row of cells that is displayed on line l,
+ * which is a line of scrollback history if the view has been scrolled
+ * back.  Slots between head - history and head are always allocated.
+ */
+static CELL *visible_line(VSCREEN *vscreen, int l) {
+    return screen_line(vscreen, l - vscreen->view);
+}
+
+/*
+ * Helper function to scroll the screen contents up by one line.
+ * The top line becomes the most recent line of history (and is logged,
+ * if the screen's lines are being logged), and the
+ * bottom line is taken from the slot of the oldest history line
+ * once the ring is full.  Before that, the new bottom line may lie
+ * just past the rows allocated so far, in which case the storage
+ * is doubled.
+ */
+static void scroll_up(VSCREEN *vscreen) {
+    if(vscreen->log != NULL)
+	record_line(vscreen, 0);
+    vscreen->info[vscreen->head].cols = vscreen->num_cols;
+    vscreen->head = (vscreen->head + 1) % vscreen->ring_size;
+    vscreen->scrolled++;
+    if(vscreen->history < vscreen->max_history)
+	vscreen->history++;
+    if(vscreen->view > 0 && vscreen->view < vscreen->history)
+	vscreen->view++;
+
+    int slot = slot_of(vscreen, vscreen->num_lines - 1);
+    reserve(vscreen, slot + 1);
+    memset(vscreen->cells + (size_t)slot * vscreen->stride, 0,
+	   vscreen->num_cols * sizeof(CELL));
+    vscreen->info[slot].wrapped = 0;
+    damage_lines(vscreen, 0, vscreen->num_lines - 1);
+}
+
+/*
+ * Helper function to make sure that the first rows slots of the ring
+ * are allocated, doubling the storage as often as needed.
+ */
+static void reserve(VSCREEN *vscreen, int rows) {
+    if(rows <= vscreen->capacity)
+	return;
+    int capacity = vscreen->capacity * 2;
+    while(capacity < rows)
+	capacity *= 2;
+    if(capacity > vscreen->ring_size)
+	capacity = vscreen->ring_size;
+    CELL *cells = alloc_cells(capacity, vscreen->stride);
+    memcpy(cells, vscreen->cells,
+	   (size_t)vscreen->capacity * vscreen->stride * sizeof(CELL));
+    free(vscreen->cells);
+    vscreen->cells = cells;
+    struct line_info *info = realloc(vscreen->info,
+				     capacity * sizeof(struct line_info));
+    if(info == NULL)
+	exit_error();
+    memset(info + vscreen->capacity, 0,
+	   (capacity - vscreen->capacity) * sizeof(struct line_info));
+    vscreen->info = info;
+    vscreen->capacity = capacity;
+}
+
+/*
+ * Helper function to return the number of lines of history that fit into
+ * vscreen_history_bytes with rows of stride cells, or vscreen_history_lines
+ * if that is fewer.
+ */
+static int history_limit(int stride) {
+    long fit = vscreen_history_bytes / (long)(stride * sizeof(CELL));
+    int limit = vscreen_history_lines < fit ? vscreen_history_lines : fit;
+    return limit < 0 ? 0 : limit;
+}
+
+/*
+ * Helper function to return the length of a row of n cells, not
+ * counting the blanks at its end.
+ */
+static int line_length(const CELL *line, int n) {
+    while(n > 0 && line[n - 1] == 0)
+	n--;
+    return n;
+}
+
+/*
+ * Helper function to write the characters of n cells to text as UTF-8,
+ * blanks as spaces.  Returns the number of bytes written, which is at
+ * most CELL_TEXT_MAX for each cell.
+ */
+static int cells_text(const CELL *cells, int n, char *text) {
+    int len = 0;
+    for(int i = 0; i < n; i++) {
+	uint32_t ch = CELL_CHAR(cells[i]), chars[CLUSTER_CHARS];
+	if(ch < 0x80) {
+	    text[len++] = ch == 0 ? ' ' : ch;
+	} else if(ch != CELL_WIDE) {
+	    int k = vscreen_chars(ch, chars);
+	    for(int j = 0; j < k; j++)
+		len += utf8_encode(text + len, chars[j]);
+	}
+    }
+    return len;
+}
+
+/*
+ * Helper function to log the text of screen line l, without its
+ * attributes or trailing blanks.  The line ends with a newline unless
+ * it carries on in the next one.
+ */
+static void record_line(VSCREEN *vscreen, int l) {
+    CELL *line = screen_line(vscreen, l);
+    int wrapped = line_info(vscreen, l)->wrapped;
+    int n = wrapped ? vscreen->num_cols : line_length(line, vscreen->num_cols);
+    char text[vscreen->num_cols * CELL_TEXT_MAX + 1];
+    n = cells_text(line, n, text);
+    if(!wrapped) {
+	while(n > 0 && text[n - 1] == ' ')
+	    n--;
+	text[n++] = '\n';
+    }
+    log_write(vscreen->log, text, n);
+}
+
+/*
+ * Helper function to rewrap lines first through last (numbered as by
+ * slot_of()) to a width of cols.  The rows over which each line wrapped
+ * are joined up, and split again at the new width.  Returns the number
+ * of rows that makes.  Unless out is NULL, the rows past the first skip
+ * are written to out (stride cells apart) and out_info.  If cursor_line
+ * is not NULL, the position it and cursor_col give, which must be among
+ * the lines, is moved to where the same cell is among the rows made.
+ */
+static int rewrap(VSCREEN *vscreen, int first, int last, int cols, int skip,
+		  CELL *out, struct line_info *out_info, int stride,
+		  int *cursor_line, int *cursor_col) {
+    int rows = 0;
+    for(int start = first, end; start <= last; start = end + 1) {
+	// The line is rows start through end, and len cells long.
+	long len = 0, cursor = -1;
+	for(end = start; ; end++) {
+	    int width = end < 0 ? history_cols(vscreen, end) :
+		vscreen->num_cols;
+	    if(cursor_line != NULL && end == *cursor_line)
+		cursor = len + *cursor_col;
+	    if(end == last || !line_info(vscreen, end)->wrapped) {
+		len += line_length(screen_line(vscreen, end), width);
+		break;
+	    }
+	    len += width;
+	}
+	if(cursor >= len)
+	    len = cursor + 1;
+	int n = len > 0 ? (len + cols - 1) / cols : 1;
+	if(cursor >= 0) {
+	    *cursor_line = rows + cursor / cols;
+	    *cursor_col = cursor % cols;
+	    cursor_line = NULL;
+	}
+
+	// Copy the line out a row at a time, from row r, column c on.
+	int r = start, c = 0;
+	long done = 0;
+	for(int j = 0; j < n && out != NULL; j++, rows++) {
+	    CELL *to = rows >= skip ? out + (size_t)(rows - skip) * stride : NULL;
+	    int k = 0;
+	    while(k < cols && done < len) {
+		int width = r < 0 ? history_cols(vscreen, r) :
+		    vscreen->num_cols;
+		int m = width - c;
+		if(m > cols - k)
+		    m = cols - k;
+		if(m > len - done)
+		    m = len - done;
+		if(to != NULL)
+		    memcpy(to + k, screen_line(vscreen, r) + c, m * sizeof(CELL));
+		k += m;
+		c += m;
+		done += m;
+		if(c == width) {
+		    r++;
+		    c = 0;
+		}
+	    }
+	    if(to != NULL) {
+		memset(to + k, 0, (stride - k) * sizeof(CELL));
+		out_info[rows - skip].cols = cols;
+		out_info[rows - skip].wrapped = j < n - 1;
+	    }
+	}
+	if(out == NULL)
+	    rows += n;
+    }
+    return rows;
+}
+
+/*
+ * Helper function to lay out the ring afresh, with rows of stride cells
+ * and room for a screen of the given number of lines, keeping as much
+ * of the history as will then fit.  The history goes at the start of
+ * the new rows, followed by the screen, which is left for the caller to
+ * fill in.
+ */
+static void relayout(VSCREEN *vscreen, int stride, int lines) {
+    int max_history = history_limit(stride);
+    int keep = vscreen->history < max_history ? vscreen->history : max_history;
+    CELL *cells;
+    struct line_info *info;
+    struct snapshot_header *map;
+    int capacity = new_ring(vscreen, keep + lines, lines + max_history, stride,
+			    &cells, &info, &map);
+    for(int i = 0; i < keep; i++) {
+	info[i] = *line_info(vscreen, i - keep);
+	info[i].cols = history_cols(vscreen, i - keep);
+	memcpy(cells + (size_t)i * stride, screen_line(vscreen, i - keep),
+	       info[i].cols * sizeof(CELL));
+    }
+    set_ring(vscreen, cells, info, map, capacity);
+    vscreen->stride = stride;
+    vscreen->max_history = max_history;
+    vscreen->ring_size = lines + max_history;
+    vscreen->head = keep;
+    vscreen->history = keep;
+}
+
+/*
+ * Helper function to rewrap the history to the width of the screen,
+ * which is put off after the screen is resized until the history is
+ * viewed.  As much of it as is kept goes into a ring laid out afresh,
+ * followed by the screen as it is.
+ */
+static void reflow_history(VSCREEN *vscreen) {
+    vscreen->reflow = 0;
+    if(vscreen->history == 0)
+	return;
+    int rows = rewrap(vscreen, -vscreen->history, -1, vscreen->num_cols, 0,
+		      NULL, NULL, 0, NULL, NULL);
+    int keep = rows < vscreen->max_history ? rows : vscreen->max_history;
+    int lines = vscreen->num_lines;
+    CELL *cells;
+    struct line_info *info;
+    struct snapshot_header *map;
+    int capacity = new_ring(vscreen, keep + lines, vscreen->ring_size,
+			    vscreen->stride, &cells, &info, &map);
+    rewrap(vscreen, -vscreen->history, -1, vscreen->num_cols, rows - keep,
+	   cells, info, vscreen->stride, NULL, NULL);
+    for(int l = 0; l < lines; l++) {
+	memcpy(cells + (size_t)(keep + l) * vscreen->stride,
+	       screen_line(vscreen, l), vscreen->num_cols * sizeof(CELL));
+	info[keep + l] = *line_info(vscreen, l);
+    }
+    set_ring(vscreen, cells, info, map, capacity);
+    vscreen->head = keep;
+    vscreen->history = keep;
+    commit(vscreen);
+}
+
+/*
+ * Helper function to allocate a new ring for a screen, of rows rows of
+ * stride cells, with their line info, on the heap; or if the screen is
+ * kept in a snapshot file, all ring_size rows of it, in a new file
+ * beside it.  Returns the number of rows allocated.
+ */
+static int new_ring(VSCREEN *vscreen, int rows, int ring_size, int stride,
+		    CELL **cells, struct line_info **info,
+		    struct snapshot_header **map) {
+    *map = NULL;
+    if(vscreen->map_path != NULL) {
+	char path[strlen(vscreen->map_path) + 5];
+	sprintf(path, "%s.new", vscreen->map_path);
+	*map = snapshot_create(path, SNAPSHOT_SCREEN, sizeof(CELL), stride,
+			       ring_size, sizeof(struct line_info));
+    }
+    if(*map != NULL) {
+	*cells = (CELL *)((char *)*map + (*map)->data);
+	*info = (struct line_info *)((char *)*map + (*map)->info);
+	return ring_size;
+    }
+    *cells = alloc_cells(rows, stride);
+    *info = calloc(sizeof(struct line_info), rows);
+    if(*info == NULL)
+	exit_error();
+    return rows;
+}
+
+/*
+ * Helper function to replace the ring of a screen with one allocated
+ * by new_ring(), and free the old one.  A new snapshot file takes the
+ * place of the old one when its state is next committed; if one could
+ * not be made, the screen is no longer kept in a file at all.  The
+ * index kept for searching goes with the old ring.
+ */
+static void set_ring(VSCREEN *vscreen, CELL *cells, struct line_info *info,
+		     struct snapshot_header *map, int capacity) {
+    if(vscreen->map != NULL) {
+	snapshot_close(vscreen->map);
+    } else {
+	free(vscreen->cells);
+	free(vscreen->info);
+    }
+    if(map == NULL && vscreen->map_path != NULL) {
+	unlink(vscreen->map_path);
+	free(vscreen->map_path);
+	vscreen->map_path = NULL;
+    }
+    free(vscreen->index);
+    vscreen->index = NULL;
+    vscreen->cells = cells;
+    vscreen->info = info;
+    vscreen->map = map;
+    vscreen->map_pending = map != NULL;
+    vscreen->capacity = capacity;
+}
+
+/*
+ * Helper function to commit the state of a screen kept in a snapshot
+ * file to the file, which it is renamed into place first if it is new.
+ */
+static void commit(VSCREEN *vscreen) {
+    if(vscreen->map == NULL)
+	return;
+    struct snapshot_state state = {
+	.scrolled = vscreen->scrolled,
+	.lines = vscreen->num_lines, .cols = vscreen->num_cols,
+	.cur_line = vscreen->cur_line, .cur_col = vscreen->cur_col,
+	.head = vscreen->head, .history = vscreen->history,
+	.max_history = vscreen->max_history, .reflow = vscreen->reflow,
+	.top = vscreen->top, .bottom = vscreen->bottom,
+	.wrap_pending = vscreen->wrap_pending,
+	.autowrap = vscreen->autowrap, .origin = vscreen->origin,
+	.insert = vscreen->insert, .graphics = vscreen->graphics,
+	.saved_line = vscreen->saved_line, .saved_col = vscreen->saved_col,
+	.pen = vscreen->pen,
+	.fg = vscreen->attr.fg, .bg = vscreen->attr.bg,
+	.flags = vscreen->attr.flags,
+	.saved_fg = vscreen->saved_attr.fg, .saved_bg = vscreen->saved_attr.bg,
+	.saved_flags = vscreen->saved_attr.flags,
+    };
+    snapshot_commit(vscreen->map, &state);
+    if(vscreen->map_pending) {
+	char path[strlen(vscreen->map_path) + 5];
+	sprintf(path, "%s.new", vscreen->map_path);
+	rename(path, vscreen->map_path);
+	vscreen->map_pending = 0;
+    }
+}
+
+/*
+ * Helper function to allocate the records of damage for the lines of
+ * the screen, with none recorded.
+ */
+static void resize_damage(VSCREEN *vscreen) {
+    int words = BITMAP_WORDS(vscreen->num_lines);
+    free(vscreen->dirty);
+    free(vscreen->full);
+    free(vscreen->damage);
+    vscreen->dirty = calloc(sizeof(uint64_t), words);
+    vscreen->full = calloc(sizeof(uint64_t), words);
+    vscreen->damage = calloc(sizeof(struct span), vscreen->num_lines);
+    if(vscreen->dirty == NULL || vscreen->full == NULL ||
+       vscreen->damage == NULL)
+	exit_error();
+    for(int i = 0; i < vscreen->num_lines; i++)
+	vscreen->damage[i].lo = vscreen->num_cols;
+}
+
+/*
+ * Output a buffer of characters to a virtual screen, as if by calling
+ * vscreen_putc() on each of them in turn.  As with vscreen_putc(),
+ * the physical screen is not updated until vscreen_sync() is called,
+ * so a whole chunk of session output costs a single sync.
+ * Runs of printable characters found by scan_printable() are copied
+ * into the screen a line at a time; only the bytes between them go
+ * through the escape sequence parser.  The screen is locked for each
+ * WRITE_SLICE bytes in turn.
+ */
+void vscreen_write(VSCREEN *vscreen, const char *buf, size_t len) {
+    while(len > WRITE_SLICE) {
+	vscreen_write(vscreen, buf, WRITE_SLICE);
+	buf += WRITE_SLICE;
+	len -= WRITE_SLICE;
+    }
+    size_t i = 0;
+    pthread_mutex_lock(&vscreen->lock);
+    vscreen->generation++;
+    while(i < len) {
+	if(vscreen->state == S_GROUND &&
+	   !(vscreen->graphics | vscreen->insert | vscreen->utf8_need)) {
+	    size_t n = scan_printable(buf + i, len - i);
+	    if(n > 0) {
+		put_run(vscreen, buf + i, n);
+		i += n;
+		continue;
+	    }
+	}
+	vscreen_putc(vscreen, buf[i++]);
+    }
+    commit(vscreen);
+    pthread_mutex_unlock(&vscreen->lock);
+}
+
+/*
+ * Helper function to place a run of printing characters at the cursor,
+ * with the same effect as printing them one at a time with vt_print().
+ */
+static void put_run(VSCREEN *vscreen, const char *run, size_t n) {
+    while(n > 0) {
+	if(vscreen->wrap_pending)
+	    wrap(vscreen);
+	int l = vscreen->cur_line;
+	int c = vscreen->cur_col;
+	CELL *line = screen_line(vscreen, l);
+	size_t room = vscreen->num_cols - c;
+	if(n < room) {
+	    split_wide(vscreen, l, c, c + n);
+	    scan_widen(line + c, run, n, vscreen->pen);
+	    damage(vscreen, l, c, c + n);
+	    vscreen->cur_col = c + n;
+	    return;
+	}
+	if(!vscreen->autowrap) {
+	    // Everything past the last column lands on it in turn,
+	    // so only the final character of the run remains there.
+	    split_wide(vscreen, l, c, vscreen->num_cols);
+	    scan_widen(line + c, run, room - 1, vscreen->pen);
+	    line[vscreen->num_cols - 1] =
+		(unsigned char)run[n - 1] | vscreen->pen;
+	    damage(vscreen, l, c, vscreen->num_cols);
+	    vscreen->cur_col = vscreen->num_cols - 1;
+	    return;
+	}
+	split_wide(vscreen, l, c, vscreen->num_cols);
+	scan_widen(line + c, run, room, vscreen->pen);
+	damage(vscreen, l, c, vscreen->num_cols);
+	vscreen->cur_col = vscreen->num_cols - 1;
+	vscreen->wrap_pending = 1;
+	run += room;
+	n -= room;
+    }
+}
+
+/*
+ * Log the text of the lines of a virtual screen, as each scrolls off
+ * the top into the history, to log (see log.c), or stop if log is
+ * NULL.  When logging stops, the lines still on the screen are logged
+ * as they stand, down to the cursor or the last line in use.
+ */
+void vscreen_log(VSCREEN *vscreen, LOG *log) {
+    pthread_mutex_lock(&vscreen->lock);
+    if(log == NULL && vscreen->log != NULL) {
+	int last = vscreen->num_lines - 1;
+	while(last > vscreen->cur_line && !line_info(vscreen, last)->wrapped &&
+	      line_length(screen_line(vscreen, last), vscreen->num_cols) == 0)
+	    last--;
+	for(int l = 0; l <= last; l++)
+	    record_line(vscreen, l);
+    }
+    vscreen->log = log;
+    pthread_mutex_unlock(&vscreen->lock);
+}
+
+/*
+ * Keep the rows of a virtual screen in a snapshot file at path from now
+ * on, so that they outlive the process (see snapshot.c).  If from names
+ * the snapshot of a screen left by an earlier ecran, that screen takes
+ * the place of this one, and its file is moved to path.  Its rows are
+ * mapped as they are, and none are read but those shown, so restoring
+ * a screen takes the same time however much history it has.  It is
+ * then fitted to the size this one had, and the cursor is put at the
+ * start of a fresh line for whatever runs on it next.  A snapshot that
+ * cannot be used is removed.  Returns 1 if a screen was restored, 0 if
+ * not, or -1 if the screen cannot be kept in a file.
+ */
+int vscreen_map(VSCREEN *vscreen, const char *path, const char *from) {
+    struct snapshot_header *map = NULL;
+    struct snapshot_state st;
+    if(from != NULL) {
+	map = snapshot_open(from, SNAPSHOT_SCREEN, sizeof(CELL),
+			    sizeof(struct line_info));
+	if(map != NULL && (snapshot_state(map, &st) == -1 ||
+			   !valid_state(map, &st))) {
+	    snapshot_close(map);
+	    map = NULL;
+	}
+	if(map == NULL)
+	    unlink(from);
+	else if(strcmp(from, path) != 0)
+	    rename(from, path);
+    }
+
+    pthread_mutex_lock(&vscreen->lock);
+    int lines = vscreen->num_lines, cols = vscreen->num_cols;
+    free(vscreen->map_path);
+    if((vscreen->map_path = strdup(path)) == NULL)
+	exit_error();
+    if(map == NULL) {
+	// The rows there are so far go into a new file.
+	CELL *cells;
+	struct line_info *info;
+	int capacity = new_ring(vscreen, vscreen->capacity, vscreen->ring_size,
+				vscreen->stride, &cells, &info, &map);
+	memcpy(cells, vscreen->cells,
+	       (size_t)vscreen->capacity * vscreen->stride * sizeof(CELL));
+	memcpy(info, vscreen->info,
+	       vscreen->capacity * sizeof(struct line_info));
+	set_ring(vscreen, cells, info, map, capacity);
+	commit(vscreen);
+	pthread_mutex_unlock(&vscreen->lock);
+	return map != NULL ? 0 : -1;
+    }
+
+    if(vscreen->map != NULL) {
+	snapshot_close(vscreen->map);
+    } else {
+	free(vscreen->cells);
+	free(vscreen->info);
+    }
+    free(vscreen->index);
+    vscreen->index = NULL;
+    vscreen->cells = (CELL *)((char *)map + map->data);
+    vscreen->info = (struct line_info *)((char *)map + map->info);
+    vscreen->map = map;
+    vscreen->map_pending = 0;
+    vscreen->stride = map->stride;
+    vscreen->capacity = vscreen->ring_size = map->rows;
+    vscreen->scrolled = vscreen->indexed = st.scrolled;
+    vscreen->num_lines = st.lines;
+    vscreen->num_cols = st.cols;
+    vscreen->cur_line = st.cur_line;
+    vscreen->cur_col = st.cur_col;
+    vscreen->head = st.head;
+    vscreen->history = st.history;
+    vscreen->max_history = st.max_history;
+    vscreen->reflow = st.reflow;
+    vscreen->top = st.top;
+    vscreen->bottom = st.bottom;
+    vscreen->wrap_pending = st.wrap_pending;
+    vscreen->autowrap = st.autowrap;
+    vscreen->origin = st.origin;
+    vscreen->insert = st.insert;
+    vscreen->graphics = st.graphics;
+    vscreen->saved_line = st.saved_line;
+    vscreen->saved_col = st.saved_col;
+    vscreen->pen = st.pen;
+    vscreen->attr = (struct cell_attr){ st.fg, st.bg, st.flags };
+    vscreen->saved_attr = (struct cell_attr){ st.saved_fg, st.saved_bg,
+					      st.saved_flags };
+    vscreen->view = 0;
+    resize_damage(vscreen);
+    damage_lines(vscreen, 0, vscreen->num_lines - 1);
+    vscreen->generation++;
+    pthread_mutex_unlock(&vscreen->lock);
+
+    vscreen_resize(vscreen, lines, cols);
+    if(st.cur_col > 0 || st.wrap_pending)
+	vscreen_write(vscreen, "\r\n", 2);
+    return 1;
+}
+
+/*
+ * Helper function to check that the state committed to a snapshot fits
+ * the rows in it, so that a screen can be restored from it.
+ */
+static int valid_state(struct snapshot_header *map,
+		       const struct snapshot_state *st) {
+    return st->lines >= 1 && st->cols >= 1 && st->cols <= map->stride &&
+	   st->max_history >= 0 && st->lines + st->max_history == map->rows &&
+	   st->history >= 0 && st->history <= st->max_history &&
+	   st->head >= 0 && st->head < map->rows &&
+	   st->cur_line >= 0 && st->cur_line < st->lines &&
+	   st->cur_col >= 0 && st->cur_col < st->cols &&
+	   st->top >= 0 && st->top <= st->bottom && st->bottom < st->lines &&
+	   st->saved_line >= 0 && st->saved_line < st->lines &&
+	   st->saved_col >= 0 && st->saved_col < st->cols &&
+	   CELL_ATTR(st->pen) < num_attrs;
+}
+
+/*
+ * Searching the scrollback.
+ *
+ * The rows of the history are indexed by the bigrams (pairs of
+ * characters, a blank counting as a space) in them, in blocks of
+ * INDEX_BLOCK slots of the ring: each block has a signature, a bitmap
+ * in which each bigram in any row of the block sets one bit, chosen by
+ * hashing it.  A bigram spanning the end of a row that wraps counts
+ * as in the next row.  A search only looks through the rows of blocks
+ * whose signatures have the bits of every bigram of the text set (along
+ * with those of the blocks the lines starting in them run on into),
+ * which in a deep history is very few of them.
+ *
+ * The index is brought up to date when a search is made, rather than as
+ * each line scrolls into the history, so output costs nothing more.  As
+ * the ring wraps, rows are indexed in the order of their slots; a block
+ * also keeps a second signature, of the rows indexed since its first
+ * slot was last reused, which replaces the first once its last slot
+ * has been, so that the bits of lines that are gone are dropped.  Until
+ * then, the signature of a block may have bits set for lines it no
+ * longer holds, which only costs a look at it that was not needed.
+ * When the ring is laid out afresh, the index is dropped, to be built
+ * again with the next search.
+ */
+
+/*
+ * Helper function to return the character of a cell, as searched for.
+ */
+static inline uint32_t text_char(CELL cell) {
+    uint32_t ch = CELL_CHAR(cell);
+    return ch == 0 ? ' ' : ch;
+}
+
+/*
+ * Helper function to return the bit a bigram sets in a signature.
+ */
+static inline unsigned bigram_bit(uint32_t a, uint32_t b) {
+    return ((a * 0x9e3779b1u) ^ b) * 0x85ebca6bu >> (32 - INDEX_SHIFT);
+}
+
+/*
+ * Helper function to add history line l to the index.
+ */
+static void index_line(VSCREEN *vscreen, int l) {
+    int slot = slot_of(vscreen, l);
+    uint64_t *sig = vscreen->index +
+		    (size_t)(slot / INDEX_BLOCK) * 2 * INDEX_WORDS;
+    uint64_t *fresh = sig + INDEX_WORDS;
+    if(slot % INDEX_BLOCK == 0)
+	memset(fresh, 0, INDEX_WORDS * sizeof(uint64_t));
+
+    CELL *line = screen_line(vscreen, l);
+    int n = line_info(vscreen, l)->wrapped ? vscreen->num_cols :
+	    line_length(line, vscreen->num_cols);
+    uint32_t prev = 0;
+    if(l > -vscreen->history && line_info(vscreen, l - 1)->wrapped)
+	prev = text_char(screen_line(vscreen, l - 1)[vscreen->num_cols - 1]);
+    for(int i = 0; i < n; i++) {
+	uint32_t ch = text_char(line[i]);
+	if(prev != 0) {
+	    unsigned bit = bigram_bit(prev, ch);
+	    fresh[bit / 64] |= 1ULL << bit % 64;
+	    sig[bit / 64] |= 1ULL << bit % 64;
+	}
+	prev = ch;
+    }
+    if(slot % INDEX_BLOCK == INDEX_BLOCK - 1 || slot == vscreen->ring_size - 1)
+	memcpy(sig, fresh, INDEX_WORDS * sizeof(uint64_t));
+}
+
+/*
+ * Helper function to index the lines scrolled into the history since
+ * the last search, or all of it if there is no index.
+ */
+static void update_index(VSCREEN *vscreen) {
+    int from = -vscreen->history;
+    if(vscreen->index == NULL) {
+	size_t blocks = (vscreen->ring_size + INDEX_BLOCK - 1) / INDEX_BLOCK;
+	vscreen->index = calloc(blocks * 2 * INDEX_WORDS, sizeof(uint64_t));
+	if(vscreen->index == NULL)
+	    exit_error();
+    } else if(vscreen->scrolled - vscreen->indexed <
+	      (unsigned long)vscreen->history) {
+	from = -(int)(vscreen->scrolled - vscreen->indexed);
+    }
+    for(int l = from; l < 0; l++)
+	index_line(vscreen, l);
+    vscreen->indexed = vscreen->scrolled;
+}
+
+/*
+ * Helper function to tell from the index whether a line of history that
+ * starts on one of rows lo through hi, which are in the same block,
+ * could have text with the n bigrams whose bits are given in it.
+ */
+static int may_match(VSCREEN *vscreen, int lo, int hi, const unsigned *bits,
+		     int n) {
+    // The lines run on to row end, which may be on the screen, where
+    // nothing is indexed.
+    int end = hi;
+    while(end < 0 && line_info(vscreen, end)->wrapped)
+	end++;
+    if(end >= 0)
+	return 1;
+    for(int i = 0; i < n; i++) {
+	int found = 0;
+	for(int l = lo; l <= end && !found; ) {
+	    int slot = slot_of(vscreen, l), block = slot / INDEX_BLOCK;
+	    uint64_t *sig = vscreen->index + (size_t)block * 2 * INDEX_WORDS;
+	    found = sig[bits[i] / 64] >> bits[i] % 64 & 1;
+	    int stop = (block + 1) * INDEX_BLOCK < vscreen->ring_size ?
+		       (block + 1) * INDEX_BLOCK : vscreen->ring_size;
+	    l += stop - slot;
+	}
+	if(!found)
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * Helper function to tell whether the n characters of text are found
+ * on screen line l, starting at column c and running on into the lines
+ * after if it wraps.
+ */
+static int match_at(VSCREEN *vscreen, int l, int c, const uint32_t *text,
+		    int n) {
+    CELL *line = screen_line(vscreen, l);
+    for(int i = 0; i < n; i++, c++) {
+	if(c == vscreen->num_cols) {
+	    if(l == vscreen->num_lines - 1 || !line_info(vscreen, l)->wrapped)
+		return 0;
+	    line = screen_line(vscreen, ++l);
+	    c = 0;
+	}
+	if(text_char(line[c]) != text[i])
+	    return 0;
+    }
+    return 1;
+}
+
+/*
+ * Helper function to tell whether text starts anywhere on screen line
+ * l.  Unless it starts with a space, which may be a blank, the first
+ * character is looked for with scan_find().
+ */
+static int match_line(VSCREEN *vscreen, int l, const uint32_t *text, int n) {
+    CELL *line = screen_line(vscreen, l);
+    int cols = vscreen->num_cols;
+    if(text[0] == ' ') {
+	for(int c = 0; c < cols; c++)
+	    if(match_at(vscreen, l, c, text, n))
+		return 1;
+	return 0;
+    }
+    for(int c = 0; (c += scan_find(line + c, cols - c, text[0],
+				   (1u << CELL_CHAR_BITS) - 1)) < cols; c++)
+	if(match_at(vscreen, l, c, text, n))
+	    return 1;
+    return 0;
+}
 
+/*
+ * Search a virtual screen, the history and then the screen, for the
+ * newest line on which text starts, going back from the line numbered
+ * before.  Lines are numbered from the oldest line ever scrolled into
+ * the history, so that the number of a line stays the same as more
+ * lines scroll in after it.  A line of text that wraps can be found
+ * across the rows it wraps over; the match is on the row where it
+ * starts.  History left as it was when the screen was resized is
+ * rewrapped first, as by vscreen_scroll().  Returns the number of the
+ * line found, or -1 if there is none.
+ */
+long vscreen_search(VSCREEN *vscreen, const char *text, long before) {
+    // The text is looked for as the cells printing it would hold.
+    int len = strlen(text), n = 0;
+    uint32_t chars[2 * len + 1];
+    unsigned bits[2 * len + 1];
+    for(int i = 0, k; (k = utf8_decode(text + i, len - i, &chars[n])) > 0;
+	i += k) {
+	int width = unicode_width(chars[n]);
+	if(width == 0 && n > 0) {
+	    // A mark is combined with the character before it, as it is
+	    // when printed, and a cluster no screen holds is not there.
+	    int last = n - 1 - (chars[n - 1] == CELL_WIDE);
+	    if((chars[last] = combine(chars[last], chars[n], 0)) == 0)
+		return -1;
+	    continue;
+	}
+	if(width > 0)
+	    n++;
+	if(width == 2)
+	    chars[n++] = CELL_WIDE;
+    }
+    if(n == 0)
+	return -1;
+    for(int i = 1; i < n; i++)
+	bits[i - 1] = bigram_bit(chars[i - 1], chars[i]);
 
-    }else {}
-    l = vscreen->cur_line;
-    c = vscreen->cur_col;
+    pthread_mutex_lock(&vscreen->lock);
+    if(vscreen->reflow)
+	reflow_history(vscreen);
+    update_index(vscreen);
+    long found = -1;
+    long scrolled = vscreen->scrolled;
+    int last = vscreen->num_lines - 1;
+    if(before - scrolled <= last)
+	last = before - scrolled - 1;
+    for(int l = last, lo; l >= -vscreen->history && found < 0; l = lo - 1) {
+	// Screen lines are all looked through; the history a block of
+	// the index at a time.
+	if(l >= 0) {
+	    lo = 0;
+	} else {
+	    lo = l - slot_of(vscreen, l) % INDEX_BLOCK;
+	    if(lo < -vscreen->history)
+		lo = -vscreen->history;
+	    if(!may_match(vscreen, lo, l, bits, n - 1))
+		continue;
+	}
+	for(int r = l; r >= lo; r--) {
+	    if(match_line(vscreen, r, chars, n)) {
+		found = scrolled + r;
+		break;
+	    }
+	}
+    }
+    pthread_mutex_unlock(&vscreen->lock);
+    return found;
+}
 
-    vscreen->line_changed[l] = 1;
+/*
+ * Scroll the view of a virtual screen back to show a line numbered as
+ * by vscreen_search(), in the middle of the screen if there is history
+ * enough; a line on the screen is shown with the view not scrolled
+ * back.  The physical screen is redrawn if the screen is being
+ * displayed.
+ */
+void vscreen_reveal(VSCREEN *vscreen, long line) {
+    pthread_mutex_lock(&vscreen->lock);
+    if(vscreen->reflow)
+	reflow_history(vscreen);
+    long l = line - (long)vscreen->scrolled;
+    long view = l >= 0 ? 0 : vscreen->num_lines / 2 - l;
+    if(view > vscreen->history)
+	view = vscreen->history;
+    int moved = view != vscreen->view;
+    vscreen->view = view;
+    pthread_mutex_unlock(&vscreen->lock);
+    if(moved)
+	vscreen_show(vscreen);
 }
 
 /*
- * Deallocate a virtual screen that is no longer in use.
+ * Deallocate a virtual screen that is no longer in use.  Its snapshot
+ * file, if it has one, is removed.
  */
 void vscreen_fini(VSCREEN *vscreen) {
-    for(int i = 0; i < vscreen->num_lines; i++){
-        free(vscreen->lines[i]);
+    if(vscreen->map != NULL) {
+	snapshot_close(vscreen->map);
+	vscreen->cells = NULL;
+	vscreen->info = NULL;
+    }
+    if(vscreen->map_path != NULL) {
+	if(vscreen->map_pending) {
+	    char path[strlen(vscreen->map_path) + 5];
+	    sprintf(path, "%s.new", vscreen->map_path);
+	    unlink(path);
+	}
+	unlink(vscreen->map_path);
+	free(vscreen->map_path);
     }
-    free(vscreen -> lines);
-    free(vscreen -> line_changed);
+    free(vscreen -> cells);
+    free(vscreen -> info);
+    free(vscreen -> index);
+    free(vscreen -> dirty);
+    free(vscreen -> full);
+    free(vscreen -> damage);
+    pthread_mutex_destroy(&vscreen->lock);
     free(vscreen);
 }
+
+/*
+ * Return the index in the attribute table of a combination of
+ * attributes, adding it to the table if it is not there yet.  Screens
+ * parsed on different threads share the table, so it is locked.
+ * Entries never change once added, so they can be read without it.
+ */
+int vscreen_attr_index(const struct cell_attr *attr) {
+    if(attr->fg == COLOR_DEFAULT && attr->bg == COLOR_DEFAULT &&
+       attr->flags == 0)
+	return 0;
+    unsigned h = attr_hash_of(attr);
+    int index = 0;
+    pthread_mutex_lock(&attr_lock);
+    for(;; h++) {
+	unsigned short *bucket = &attr_hash[h % (2 * MAX_ATTRS)];
+	if(*bucket == 0) {
+	    if(num_attrs < MAX_ATTRS) {
+		attrs[num_attrs] = *attr;
+		*bucket = ++num_attrs;
+		index = num_attrs - 1;
+		if(attr_map != NULL)
+		    __atomic_store_n(&attr_map->count, num_attrs,
+				     __ATOMIC_RELEASE);
+	    }
+	    break;
+	}
+	const struct cell_attr *a = &attrs[*bucket - 1];
+	if(a->fg == attr->fg && a->bg == attr->bg && a->flags == attr->flags) {
+	    index = *bucket - 1;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&attr_lock);
+    return index;
+}
+
+/*
+ * Helper function to return where to start looking for a combination of
+ * attributes in the hash table.
+ */
+static unsigned attr_hash_of(const struct cell_attr *attr) {
+    unsigned h = ((unsigned)(attr->fg + 1) * 257 + (attr->bg + 1)) * 131
+	+ attr->flags;
+    return (h * 2654435761u) >> 16;
+}
+
+/*
+ * Keep the attribute table in the snapshot file at path, taking over
+ * the table in it if it was left by an earlier ecran, so that the cells
+ * of screens restored from snapshots show as they did (see
+ * vscreen_map()).  This must be done before any screen has had output.
+ * Returns 1 if a table was taken over, 0 if a new file was made, and
+ * -1 if the table cannot be kept in a file.
+ */
+int vscreen_map_attrs(const char *path) {
+    struct snapshot_header *map = snapshot_open(path, SNAPSHOT_ATTRS,
+						sizeof(struct cell_attr), 0);
+    int kept = map != NULL && map->stride == 1 && map->rows == MAX_ATTRS &&
+	       map->count >= 1 && map->count <= MAX_ATTRS;
+    if(map != NULL && !kept)
+	snapshot_close(map);
+    if(!kept && (map = snapshot_create(path, SNAPSHOT_ATTRS,
+				       sizeof(struct cell_attr), 1, MAX_ATTRS,
+				       0)) == NULL)
+	return -1;
+    struct cell_attr *table = (struct cell_attr *)((char *)map + map->data);
+    pthread_mutex_lock(&attr_lock);
+    if(kept) {
+	num_attrs = map->count;
+	memset(attr_hash, 0, sizeof(attr_hash));
+	for(int i = 1; i < num_attrs; i++) {
+	    unsigned h = attr_hash_of(&table[i]);
+	    while(attr_hash[h % (2 * MAX_ATTRS)] != 0)
+		h++;
+	    attr_hash[h % (2 * MAX_ATTRS)] = i + 1;
+	}
+    } else {
+	memcpy(table, attrs, num_attrs * sizeof(struct cell_attr));
+	map->count = num_attrs;
+    }
+    if(attr_map != NULL)
+	snapshot_close(attr_map);
+    attrs = table;
+    attr_map = map;
+    pthread_mutex_unlock(&attr_lock);
+    return kept;
+}
+
+/*
+ * Return the attributes stored at an index of the attribute table.
+ */
+const struct cell_attr *vscreen_attr(int index) {
+    return &attrs[index];
+}
+
+/*
+ * Write the code points the character of a cell stands for to chars,
+ * which must have room for CLUSTER_CHARS of them: the character itself,
+ * or for a cluster, the character and the marks combined with it.
+ * Returns how many there are.  Clusters never change once added, so
+ * they can be read without locking the table.
+ */
+int vscreen_chars(uint32_t ch, uint32_t *chars) {
+    if(ch < CELL_CLUSTER || ch == CELL_WIDE) {
+	chars[0] = ch;
+	return 1;
+    }
+    // A cluster not in the table can only come of a damaged snapshot.
+    int i = ch - CELL_CLUSTER, n = 0;
+    if(i >= __atomic_load_n(&num_clusters, __ATOMIC_ACQUIRE)) {
+	chars[0] = UNICODE_REPLACEMENT;
+	return 1;
+    }
+    for(; n < CLUSTER_CHARS && clusters[i].chars[n] != 0; n++)
+	chars[n] = clusters[i].chars[n];
+    return n;
+}
+
+/*
+ * Keep the cluster table in the snapshot file at path, taking over the
+ * table in it if it was left by an earlier ecran, as vscreen_map_attrs()
+ * keeps the attribute table, and returning as it does.  The table is
+ * small, so what is in it is checked before it is taken over.
+ */
+int vscreen_map_clusters(const char *path) {
+    struct snapshot_header *map = snapshot_open(path, SNAPSHOT_CLUSTERS,
+						sizeof(struct cluster), 0);
+    int kept = map != NULL && map->stride == 1 &&
+	       map->rows == MAX_CLUSTERS && map->count <= MAX_CLUSTERS;
+    struct cluster *table;
+    if(kept) {
+	table = (struct cluster *)((char *)map + map->data);
+	for(int i = 0; i < map->count && kept; i++)
+	    for(int j = 0; j < CLUSTER_CHARS; j++)
+		if(table[i].chars[j] > 0x10ffff ||
+		   (j < 2 && table[i].chars[j] == 0))
+		    kept = 0;
+    }
+    if(map != NULL && !kept)
+	snapshot_close(map);
+    if(!kept && (map = snapshot_create(path, SNAPSHOT_CLUSTERS,
+				       sizeof(struct cluster), 1, MAX_CLUSTERS,
+				       0)) == NULL)
+	return -1;
+    table = (struct cluster *)((char *)map + map->data);
+    pthread_mutex_lock(&cluster_lock);
+    if(kept) {
+	num_clusters = map->count;
+	memset(cluster_hash, 0, sizeof(cluster_hash));
+	for(int i = 0; i < num_clusters; i++) {
+	    unsigned h = cluster_hash_of(&table[i]);
+	    while(cluster_hash[h % (2 * MAX_CLUSTERS)] != 0)
+		h++;
+	    cluster_hash[h % (2 * MAX_CLUSTERS)] = i + 1;
+	}
+    } else {
+	memcpy(table, clusters, num_clusters * sizeof(struct cluster));
+	map->count = num_clusters;
+    }
+    if(cluster_map != NULL)
+	snapshot_close(cluster_map);
+    clusters = table;
+    cluster_map = map;
+    pthread_mutex_unlock(&cluster_lock);
+    return kept;
+}
+
+/*
+ * Helper function to return what a cell holds for a character ch with
+ * a mark combined with it: the cluster they make, which is added to the
+ * table if it is not there yet and add is set.  A mark past
+ * CLUSTER_CHARS is left out, and ch returned.  Returns 0 if the cluster
+ * is not in the table and is not added.
+ */
+static uint32_t combine(uint32_t ch, uint32_t mark, int add) {
+    struct cluster key = { { 0 } };
+    int n = vscreen_chars(ch, key.chars);
+    if(n == CLUSTER_CHARS)
+	return ch;
+    key.chars[n] = mark;
+    unsigned h = cluster_hash_of(&key);
+    uint32_t cell = 0;
+    pthread_mutex_lock(&cluster_lock);
+    for(;; h++) {
+	unsigned short *bucket = &cluster_hash[h % (2 * MAX_CLUSTERS)];
+	if(*bucket == 0) {
+	    if(add && num_clusters < MAX_CLUSTERS) {
+		clusters[num_clusters] = key;
+		*bucket = num_clusters + 1;
+		cell = CELL_CLUSTER + num_clusters;
+		__atomic_store_n(&num_clusters, num_clusters + 1,
+				 __ATOMIC_RELEASE);
+		if(cluster_map != NULL)
+		    __atomic_store_n(&cluster_map->count, num_clusters,
+				     __ATOMIC_RELEASE);
+	    }
+	    break;
+	}
+	if(memcmp(&clusters[*bucket - 1], &key, sizeof(key)) == 0) {
+	    cell = CELL_CLUSTER + *bucket - 1;
+	    break;
+	}
+    }
+    pthread_mutex_unlock(&cluster_lock);
+    return cell;
+}
+
+/*
+ * Helper function to return where to start looking for a cluster in the
+ * hash table.
+ */
+static unsigned cluster_hash_of(const struct cluster *cluster) {
+    unsigned h = 0;
+    for(int i = 0; i < CLUSTER_CHARS; i++)
+	h = (h + cluster->chars[i]) * 2654435761u;
+    return h >> 16;
+}